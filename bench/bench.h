@@ -0,0 +1,172 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * helpers shared by the benchmarks: a monotonic clock, allocation
+ * counting, a fake modem on a socketpair and the report format
+ */
+
+#ifndef BENCH_H
+#define BENCH_H 1
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atchannel.h"
+
+static atomic_ulong s_allocCount;
+
+#ifdef __GLIBC__
+/* glibc routes its own allocations, eg strdup(), through these too */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&s_allocCount, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    atomic_fetch_add_explicit(&s_allocCount, 1, memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&s_allocCount, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+#define BENCH_COUNTS_ALLOCS 1
+#endif /* __GLIBC__ */
+
+static inline unsigned long benchAllocs(void)
+{
+    return atomic_load_explicit(&s_allocCount, memory_order_relaxed);
+}
+
+static inline uint64_t benchNowNsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/** writes all of "len" bytes, returns false on error */
+static inline bool benchWriteAll(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        len -= (size_t) written;
+    }
+
+    return true;
+}
+
+/**
+ * attaches "atch" to one end of a new socketpair
+ * returns the other end, the modem side, or -1
+ */
+static inline int benchAttach(ATChannel *atch)
+{
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    atch->fd = fds[0];
+    if (at_attach(atch) != AT_SUCCESS) {
+        fprintf(stderr, "at_attach failed\n");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    return fds[1];
+}
+
+static inline void benchDetach(ATChannel *atch, int modemfd)
+{
+    at_close(atch);
+    close(modemfd);
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static inline uint64_t percentile(const uint64_t *sorted, size_t count, double p)
+{
+    size_t index = (size_t) (p * (double) (count - 1) + 0.5);
+
+    return sorted[index];
+}
+
+/** prints one line of throughput figures */
+static inline void benchReportRate(const char *name, size_t ops, uint64_t nsec, unsigned long allocs)
+{
+    printf("%-28s %10zu ops %10.0f ops/s %9.1f ns/op %7.2f allocs/op\n",
+           name, ops, (double) ops * 1e9 / (double) nsec, (double) nsec / (double) ops,
+           (double) allocs / (double) ops);
+}
+
+/** sorts "samples" and prints their latency percentiles in microseconds */
+static inline void benchReportLatency(const char *name, uint64_t *samples, size_t count)
+{
+    qsort(samples, count, sizeof(uint64_t), compareSamples);
+
+    printf("%-28s p50 %7.1f  p90 %7.1f  p99 %7.1f  p99.9 %7.1f  max %8.1f us\n", name,
+           (double) percentile(samples, count, 0.50) / 1e3,
+           (double) percentile(samples, count, 0.90) / 1e3,
+           (double) percentile(samples, count, 0.99) / 1e3,
+           (double) percentile(samples, count, 0.999) / 1e3,
+           (double) samples[count - 1] / 1e3);
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,416 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Measures command round trips against a fake modem on a socketpair:
+ * latency percentiles and allocations of the synchronous commands, the
+ * cost of at_response_free(), the throughput of pipelined
+ * asynchronous commands, the wall time of an init script issued one
+ * by one or as a batch, a storm of identical queries from many threads
+ * with and without coalescing and SMS submissions one by one or in bulk
+ *
+ * usage: bench_command [iterations]
+ */
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include "bench.h"
+
+#define DEFAULT_ITERATIONS 20000
+#define CMGL_LINES 20
+#define STORM_THREADS 8
+#define SMS_BATCH 64
+
+typedef enum {
+    COMMAND_BASIC,
+    COMMAND_SINGLELINE,
+    COMMAND_MULTILINE,
+    COMMAND_MULTILINE_STREAM,
+} CommandKind;
+
+static const char s_cmglReply[] =
+    "\r\n+CMGL: 1,\"REC READ\",\"+31612345678\",,\"20/11/02,12:34:56+04\"\r\nHello there\r\n";
+
+static const char *s_script[] = {
+    "AT+CMEE=1", "AT+CREG=2", "AT+CGREG=2", "AT+CEREG=2",
+    "AT+CTZR=1", "AT+CNMI=2,1,2,1,0", "AT+CSCS=\"GSM\"", "AT+CMGF=0",
+};
+#define SCRIPT_LENGTH (sizeof(s_script) / sizeof(s_script[0]))
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static size_t s_completed;
+static atomic_ulong s_modemCommands;
+
+typedef struct {
+    ATChannel *atch;
+    size_t iterations;
+} StormWorker;
+
+/** returns the first \r or ^Z in "len" bytes at "cur", NULL if there is none */
+static char *findTerminator(char *cur, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (cur[i] == '\r' || cur[i] == '\032') {
+            return cur + i;
+        }
+    }
+
+    return NULL;
+}
+
+/** answers AT, AT+CSQ, AT+CREG?, AT+CMGL and AT+CMGS until the channel closes */
+static void *modemLoop(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+    char buf[4096];
+    size_t len = 0;
+
+    for (;;) {
+        ssize_t count = read(fd, buf + len, sizeof(buf) - len);
+        char *cur = buf;
+        char *eol;
+
+        if (count <= 0) {
+            return NULL;
+        }
+        len += (size_t) count;
+
+        while ((eol = findTerminator(cur, len - (size_t) (cur - buf))) != NULL) {
+            bool pdu = *eol == '\032';
+
+            *eol = '\0';
+            atomic_fetch_add_explicit(&s_modemCommands, 1, memory_order_relaxed);
+            if (pdu) {
+                benchWriteAll(fd, "\r\n+CMGS: 7\r\n\r\nOK\r\n", 19);
+            } else if (0 == strncmp(cur, "AT+CMGS", 7)) {
+                benchWriteAll(fd, "\r\n> ", 4);
+            } else if (0 == strcmp(cur, "AT+CSQ")) {
+                benchWriteAll(fd, "\r\n+CSQ: 21,99\r\n\r\nOK\r\n", 21);
+            } else if (0 == strcmp(cur, "AT+CREG?")) {
+                benchWriteAll(fd, "\r\n+CREG: 2,1\r\n\r\nOK\r\n", 20);
+            } else if (0 == strncmp(cur, "AT+CMGL", 7)) {
+                int i;
+
+                for (i = 0; i < CMGL_LINES; i++) {
+                    benchWriteAll(fd, s_cmglReply, sizeof(s_cmglReply) - 1);
+                }
+                benchWriteAll(fd, "\r\nOK\r\n", 6);
+            } else {
+                benchWriteAll(fd, "\r\nOK\r\n", 6);
+            }
+            cur = eol + 1;
+        }
+
+        len -= (size_t) (cur - buf);
+        memmove(buf, cur, len);
+    }
+}
+
+static void onLine(ATChannel *atch, const char *line, size_t len, void *ctx)
+{
+    (void) atch;
+    (void) line;
+    (void) len;
+
+    (*(size_t *) ctx)++;
+}
+
+static ATReturn sendCommand(ATChannel *atch, CommandKind kind, ATResponse **pp_response)
+{
+    size_t lines = 0;
+
+    switch (kind) {
+        case COMMAND_BASIC:
+            return at_send_command(atch, "AT", pp_response);
+        case COMMAND_SINGLELINE:
+            return at_send_command_singleline(atch, "AT+CSQ", "+CSQ:", pp_response);
+        case COMMAND_MULTILINE:
+            return at_send_command_multiline(atch, "AT+CMGL=4", "+CMGL:", pp_response);
+        case COMMAND_MULTILINE_STREAM:
+            return at_send_command_multiline_stream(atch, "AT+CMGL=4", "+CMGL:", 0,
+                                                    onLine, &lines, 0, pp_response);
+        default:
+            return AT_ERROR_INVALID_ARGUMENT;
+    }
+}
+
+static void runLatency(const char *name, ATChannel *atch, CommandKind kind, size_t iterations)
+{
+    uint64_t *samples;
+    uint64_t freeNsec = 0;
+    unsigned long allocs;
+    char freeName[64];
+    size_t i;
+
+    samples = malloc(iterations * sizeof(uint64_t));
+    if (samples == NULL) {
+        return;
+    }
+
+    allocs = benchAllocs();
+    for (i = 0; i < iterations; i++) {
+        ATResponse *p_response = NULL;
+        uint64_t start = benchNowNsec();
+        uint64_t end;
+
+        if (sendCommand(atch, kind, &p_response) != AT_SUCCESS) {
+            fprintf(stderr, "%s failed\n", name);
+            free(samples);
+            return;
+        }
+        end = benchNowNsec();
+        samples[i] = end - start;
+
+        at_response_free(p_response);
+        freeNsec += benchNowNsec() - end;
+    }
+    /* the samples themselves were allocated before counting */
+    allocs = benchAllocs() - allocs;
+
+    printf("%-28s %10zu ops %7.2f allocs/op\n", name, iterations,
+           (double) allocs / (double) iterations);
+    benchReportLatency(name, samples, iterations);
+    snprintf(freeName, sizeof(freeName), "%s/free", name);
+    printf("%-28s %9.1f ns/op\n", freeName, (double) freeNsec / (double) iterations);
+
+    free(samples);
+}
+
+static void onComplete(ATChannel *atch, ATReturn err, ATResponse *p_response, void *ctx)
+{
+    (void) atch;
+    (void) err;
+    (void) ctx;
+
+    at_response_free(p_response);
+
+    pthread_mutex_lock(&s_mutex);
+    s_completed++;
+    pthread_cond_signal(&s_cond);
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void runPipelined(const char *name, ATChannel *atch, size_t iterations)
+{
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    pthread_mutex_lock(&s_mutex);
+    s_completed = 0;
+    pthread_mutex_unlock(&s_mutex);
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        if (at_send_command_singleline_async(atch, "AT+CSQ", "+CSQ:", 0, onComplete, NULL)
+            != AT_SUCCESS) {
+            fprintf(stderr, "%s failed\n", name);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&s_mutex);
+    while (s_completed < iterations) {
+        pthread_cond_wait(&s_cond, &s_mutex);
+    }
+    pthread_mutex_unlock(&s_mutex);
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+/** runs s_script "iterations" times, flags < 0 for one command at a time */
+static void runScript(const char *name, ATChannel *atch, int flags, size_t iterations)
+{
+    ATBatchEntry entries[SCRIPT_LENGTH];
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+    size_t j;
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        memset(entries, 0, sizeof(entries));
+        for (j = 0; j < SCRIPT_LENGTH; j++) {
+            entries[j].command = s_script[j];
+            entries[j].type = AT_BATCH_NO_RESULT;
+        }
+
+        if (flags < 0) {
+            for (j = 0; j < SCRIPT_LENGTH; j++) {
+                entries[j].err = at_send_command(atch, entries[j].command,
+                                                 &entries[j].p_response);
+            }
+        } else if (at_send_command_batch(atch, entries, SCRIPT_LENGTH, (unsigned int) flags)
+                   != AT_SUCCESS) {
+            fprintf(stderr, "%s failed\n", name);
+            return;
+        }
+
+        for (j = 0; j < SCRIPT_LENGTH; j++) {
+            if (entries[j].err != AT_SUCCESS) {
+                fprintf(stderr, "%s failed\n", name);
+                return;
+            }
+            at_response_free(entries[j].p_response);
+        }
+    }
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+static void *stormLoop(void *arg)
+{
+    StormWorker *p_worker = arg;
+    size_t i;
+
+    for (i = 0; i < p_worker->iterations; i++) {
+        ATResponse *p_response = NULL;
+
+        if (at_send_command_singleline(p_worker->atch, "AT+CREG?", "+CREG:", &p_response)
+            != AT_SUCCESS) {
+            fprintf(stderr, "storm failed\n");
+            return NULL;
+        }
+        at_response_free(p_response);
+    }
+
+    return NULL;
+}
+
+/** STORM_THREADS threads polling AT+CREG? at once, "iterations" in all */
+static void runStorm(const char *name, ATChannel *atch, bool coalescing, size_t iterations)
+{
+    pthread_t tids[STORM_THREADS];
+    StormWorker worker = { atch, iterations / STORM_THREADS };
+    unsigned long allocs;
+    unsigned long commands;
+    uint64_t start;
+    size_t i;
+
+    at_set_coalescing(atch, coalescing);
+
+    allocs = benchAllocs();
+    commands = atomic_load(&s_modemCommands);
+    start = benchNowNsec();
+
+    for (i = 0; i < STORM_THREADS; i++) {
+        pthread_create(&tids[i], NULL, stormLoop, &worker);
+    }
+    for (i = 0; i < STORM_THREADS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    iterations = worker.iterations * STORM_THREADS;
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+    printf("%-28s %9.2f written/op\n", name,
+           (double) (atomic_load(&s_modemCommands) - commands) / (double) iterations);
+
+    at_set_coalescing(atch, false);
+}
+
+/** submits "iterations" SMS one at a time, or SMS_BATCH at a time */
+static void runSms(const char *name, ATChannel *atch, bool bulk, size_t iterations)
+{
+    ATSmsEntry entries[SMS_BATCH];
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+    size_t j;
+
+    iterations = (iterations + SMS_BATCH - 1) / SMS_BATCH * SMS_BATCH;
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i += SMS_BATCH) {
+        memset(entries, 0, sizeof(entries));
+        for (j = 0; j < SMS_BATCH; j++) {
+            entries[j].command = "AT+CMGS=18";
+            entries[j].pdu = "0011000B911326880736F40000A90574747A0E4A";
+        }
+
+        if (!bulk) {
+            for (j = 0; j < SMS_BATCH; j++) {
+                ATResponse *p_response = NULL;
+
+                entries[j].err = at_send_command_sms(atch, entries[j].command,
+                                                     entries[j].pdu, "+CMGS:", &p_response);
+                entries[j].success = p_response != NULL && p_response->success;
+                at_response_free(p_response);
+            }
+        } else if (at_send_command_sms_batch(atch, entries, SMS_BATCH, 0) != AT_SUCCESS) {
+            fprintf(stderr, "%s failed\n", name);
+            return;
+        }
+
+        for (j = 0; j < SMS_BATCH; j++) {
+            if (entries[j].err != AT_SUCCESS || !entries[j].success) {
+                fprintf(stderr, "%s failed\n", name);
+                return;
+            }
+        }
+    }
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+int main(int argc, char **argv)
+{
+    ATChannel atch;
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    pthread_t tid;
+    int modemfd;
+
+    if (iterations == 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    memset(&atch, 0, sizeof(atch));
+    modemfd = benchAttach(&atch);
+    if (modemfd < 0) {
+        return 1;
+    }
+    pthread_create(&tid, NULL, modemLoop, (void *) (intptr_t) modemfd);
+
+    printf("command: %zu round trips each\n", iterations);
+    runLatency("command/basic", &atch, COMMAND_BASIC, iterations);
+    runLatency("command/singleline", &atch, COMMAND_SINGLELINE, iterations);
+    runLatency("command/multiline", &atch, COMMAND_MULTILINE, iterations / 10 + 1);
+    runLatency("command/multiline-stream", &atch, COMMAND_MULTILINE_STREAM, iterations / 10 + 1);
+    runPipelined("command/pipelined-async", &atch, iterations);
+    runScript("script/one-by-one", &atch, -1, iterations / 10 + 1);
+    runScript("script/batch", &atch, 0, iterations / 10 + 1);
+    runScript("script/batch-concatenated", &atch, AT_BATCH_CONCATENATE, iterations / 10 + 1);
+    runStorm("storm/serialized", &atch, false, iterations);
+    runStorm("storm/coalesced", &atch, true, iterations);
+    runSms("sms/one-by-one", &atch, false, iterations);
+    runSms("sms/bulk", &atch, true, iterations);
+
+    /* the modem sees the end of the stream and returns */
+    at_close(&atch);
+    pthread_join(tid, NULL);
+    close(modemfd);
+
+    return 0;
+}
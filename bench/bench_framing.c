@@ -0,0 +1,212 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Feeds recorded modem traffic through a socketpair into an attached
+ * channel and measures how fast the reader frames, classifies and
+ * dispatches the lines
+ *
+ * usage: bench_framing [iterations [traffic file]]
+ */
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include "bench.h"
+
+#define DEFAULT_ITERATIONS 20000
+#define DEFAULT_TRAFFIC "bench/data/traffic.log"
+#define MAX_LINE 1024
+
+typedef struct {
+    char *data;         /* one pass of the traffic, as the modem sends it */
+    size_t len;
+    size_t lineCount;
+    char **names;       /* response names to register handlers for */
+    size_t nameCount;
+    size_t iterations;
+    int modemfd;
+} Traffic;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static size_t s_lines;
+static size_t s_target;
+
+static void countLines(size_t count)
+{
+    pthread_mutex_lock(&s_mutex);
+    s_lines += count;
+    if (s_lines >= s_target) {
+        pthread_cond_signal(&s_cond);
+    }
+    pthread_mutex_unlock(&s_mutex);
+}
+
+static void onUnsol(ATChannel *atch, const char *s)
+{
+    (void) atch;
+    (void) s;
+    countLines(1);
+}
+
+static void onUnsolSms(ATChannel *atch, const char *s, const char *sms_pdu)
+{
+    (void) atch;
+    (void) s;
+    (void) sms_pdu;
+    countLines(2);
+}
+
+static void onUnsolPrefix(ATChannel *atch, const char *s, void *ctx)
+{
+    (void) atch;
+    (void) s;
+    (void) ctx;
+    countLines(1);
+}
+
+static bool loadTraffic(Traffic *traffic, const char *path)
+{
+    char line[MAX_LINE];
+    FILE *fp;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strcspn(line, "\r\n");
+        size_t nameLen = strcspn(line, ": \r\n");
+        char *data;
+        char **names;
+
+        if (len == 0) {
+            continue;
+        }
+
+        /* "\r\n<line>\r\n" as most modems frame their responses */
+        data = realloc(traffic->data, traffic->len + len + 5);
+        names = realloc(traffic->names, (traffic->nameCount + 1) * sizeof(char *));
+        if (data == NULL || names == NULL) {
+            fclose(fp);
+            return false;
+        }
+        traffic->data = data;
+        traffic->names = names;
+
+        memcpy(traffic->data + traffic->len, "\r\n", 2);
+        memcpy(traffic->data + traffic->len + 2, line, len);
+        memcpy(traffic->data + traffic->len + 2 + len, "\r\n", 3);
+        traffic->len += len + 4;
+        traffic->lineCount++;
+
+        line[nameLen] = '\0';
+        traffic->names[traffic->nameCount++] = strdup(line);
+    }
+
+    fclose(fp);
+
+    return traffic->lineCount > 0;
+}
+
+static void *modemLoop(void *arg)
+{
+    Traffic *traffic = arg;
+    size_t i;
+
+    for (i = 0; i < traffic->iterations; i++) {
+        if (!benchWriteAll(traffic->modemfd, traffic->data, traffic->len)) {
+            perror("write");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static void run(const char *name, Traffic *traffic, bool prefixHandlers, int dispatchThreads)
+{
+    ATChannel atch;
+    pthread_t tid;
+    unsigned long allocs;
+    uint64_t start;
+    uint64_t end;
+    size_t i;
+
+    memset(&atch, 0, sizeof(atch));
+    atch.unsolHandler = onUnsol;
+    atch.unsolSmsHandler = onUnsolSms;
+
+    traffic->modemfd = benchAttach(&atch);
+    if (traffic->modemfd < 0) {
+        return;
+    }
+    if (prefixHandlers) {
+        for (i = 0; i < traffic->nameCount; i++) {
+            at_register_unsol_handler(&atch, traffic->names[i], onUnsolPrefix, NULL);
+        }
+    }
+    if (dispatchThreads > 0) {
+        at_set_unsol_dispatch(&atch, dispatchThreads, 0);
+    }
+
+    pthread_mutex_lock(&s_mutex);
+    s_lines = 0;
+    s_target = traffic->lineCount * traffic->iterations;
+    pthread_mutex_unlock(&s_mutex);
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    pthread_create(&tid, NULL, modemLoop, traffic);
+
+    pthread_mutex_lock(&s_mutex);
+    while (s_lines < s_target) {
+        pthread_cond_wait(&s_cond, &s_mutex);
+    }
+    pthread_mutex_unlock(&s_mutex);
+
+    end = benchNowNsec();
+    allocs = benchAllocs() - allocs;
+
+    pthread_join(tid, NULL);
+    benchDetach(&atch, traffic->modemfd);
+
+    benchReportRate(name, s_target, end - start, allocs);
+}
+
+int main(int argc, char **argv)
+{
+    Traffic traffic;
+    const char *path = argc > 2 ? argv[2] : DEFAULT_TRAFFIC;
+
+    memset(&traffic, 0, sizeof(traffic));
+    traffic.iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+
+    if (traffic.iterations == 0 || !loadTraffic(&traffic, path)) {
+        fprintf(stderr, "usage: %s [iterations [traffic file]]\n", argv[0]);
+        return 1;
+    }
+
+    printf("framing: %zu lines of %s x %zu\n", traffic.lineCount, path, traffic.iterations);
+    run("framing/catch-all", &traffic, false, 0);
+    run("framing/prefix-handlers", &traffic, true, 0);
+    run("framing/dispatch-2-threads", &traffic, true, 2);
+
+    return 0;
+}
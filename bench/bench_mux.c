@@ -0,0 +1,293 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Checks and measures the TS 27.010 multiplexer: frames of every size
+ * built with muxHeader()/muxFcs() must come back from muxParse(), then
+ * commands run on a DLC against a fake CMUX modem on a socketpair. The
+ * mux end of the socketpair is non-blocking with a small send buffer,
+ * so long commands go out in partial writes that must still form whole
+ * frames.
+ *
+ * usage: bench_mux [iterations]
+ */
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include <fcntl.h>
+
+#include "bench.h"
+#include "at_mux.h"
+
+#define DEFAULT_ITERATIONS 20000
+#define FRAME_SIZE 127
+#define LONG_COMMAND 4000
+#define MODEM_DLCI 1
+#define COMMAND_TIMEOUT_MSEC 5000
+
+/* the CLD control message, which the modem has to answer */
+#define CTL_CLD 0xC0
+
+static volatile size_t s_sink;
+
+/** writes one frame, returns its length */
+static size_t buildFrame(uint8_t *frame, uint8_t address, uint8_t control,
+                         const uint8_t *info, size_t len)
+{
+    size_t headerLen = muxHeader(frame, address, control, len);
+
+    memcpy(frame + headerLen, info, len);
+    frame[headerLen + len] = muxFcs(frame + 1, headerLen - 1,
+                                    (control & ~MUX_PF) == MUX_UI ? info : NULL, len);
+    frame[headerLen + len + 1] = MUX_FLAG;
+
+    return headerLen + len + 2;
+}
+
+/** round-trips UIH and UI frames of every size, returns false on a mismatch */
+static bool checkCodec(void)
+{
+    static uint8_t info[MUX_MAX_INFO];
+    static uint8_t frame[MUX_MAX_HEADER + MUX_MAX_INFO + 2];
+    static const uint8_t controls[] = { MUX_UIH, MUX_UI, MUX_SABM | MUX_PF };
+    ATMuxFrame parsed;
+    size_t consumed;
+    size_t frameLen;
+    size_t len;
+    size_t i;
+
+    for (len = 0; len < sizeof(info); len++) {
+        info[len] = (uint8_t) (len * 7);
+    }
+
+    for (i = 0; i < sizeof(controls); i++) {
+        for (len = 0; len <= 300; len++) {
+            frameLen = buildFrame(frame, MODEM_DLCI << 2 | MUX_EA, controls[i], info, len);
+            if (!muxParse(frame, frameLen, MUX_MAX_INFO, &parsed, &consumed)
+                || parsed.address != (MODEM_DLCI << 2 | MUX_EA)
+                || parsed.control != controls[i] || parsed.len != len
+                || memcmp(parsed.info, info, len) != 0 || consumed != frameLen - 1) {
+                fprintf(stderr, "mux: frame of %zu octets, control 0x%02X, does not parse\n",
+                        len, controls[i]);
+                return false;
+            }
+
+            /* a damaged FCS must not pass */
+            frame[frameLen - 2] ^= 0x01;
+            if (muxParse(frame, frameLen, MUX_MAX_INFO, &parsed, &consumed)) {
+                fprintf(stderr, "mux: frame of %zu octets with a bad FCS parses\n", len);
+                return false;
+            }
+        }
+    }
+
+    /* the largest frame, with a 2 octet length */
+    frameLen = buildFrame(frame, MODEM_DLCI << 2 | MUX_EA, MUX_UIH, info, MUX_MAX_INFO);
+    if (!muxParse(frame, frameLen, MUX_MAX_INFO, &parsed, &consumed)
+        || parsed.len != MUX_MAX_INFO || memcmp(parsed.info, info, MUX_MAX_INFO) != 0) {
+        fprintf(stderr, "mux: the largest frame does not parse\n");
+        return false;
+    }
+
+    return true;
+}
+
+static void runParse(size_t iterations)
+{
+    uint8_t info[FRAME_SIZE];
+    uint8_t frames[8 * (MUX_MAX_HEADER + FRAME_SIZE + 2)];
+    ATMuxFrame parsed;
+    size_t consumed;
+    size_t framesLen = 0;
+    size_t pos;
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    memset(info, 'x', sizeof(info));
+    for (i = 0; i < 8; i++) {
+        framesLen += buildFrame(frames + framesLen, MODEM_DLCI << 2 | MUX_EA, MUX_UIH,
+                                info, (i + 1) * FRAME_SIZE / 8);
+    }
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        pos = 0;
+        while (muxParse(frames + pos, framesLen - pos, FRAME_SIZE, &parsed, &consumed)) {
+            s_sink = parsed.len;
+            pos += consumed;
+        }
+    }
+
+    benchReportRate("mux/parse", 8 * iterations, benchNowNsec() - start,
+                    benchAllocs() - allocs);
+}
+
+static void modemSend(int fd, int dlci, uint8_t control, const uint8_t *info, size_t len)
+{
+    uint8_t frame[MUX_MAX_HEADER + FRAME_SIZE + 2];
+    size_t frameLen = buildFrame(frame, (uint8_t) (dlci << 2 | MUX_EA), control, info, len);
+
+    benchWriteAll(fd, (const char *) frame, frameLen);
+}
+
+/** answers SABM, DISC and CLD, and OK to every command line on a DLC */
+static void *modemLoop(void *arg)
+{
+    static uint8_t buf[4 * (MUX_MAX_HEADER + FRAME_SIZE + 2)];
+    static const uint8_t cld[] = { CTL_CLD | MUX_EA, MUX_EA };
+    static const uint8_t ok[] = "\r\nOK\r\n";
+    int fd = (int) (intptr_t) arg;
+    ATMuxFrame frame;
+    size_t consumed;
+    size_t len = 0;
+    size_t i;
+
+    for (;;) {
+        ssize_t count = read(fd, buf + len, sizeof(buf) - len);
+
+        if (count <= 0) {
+            return NULL;
+        }
+        len += (size_t) count;
+
+        for (;;) {
+            bool found = muxParse(buf, len, FRAME_SIZE, &frame, &consumed);
+            int dlci;
+
+            if (found) {
+                dlci = frame.address >> 2;
+                switch (frame.control & ~MUX_PF) {
+                    case MUX_SABM:
+                    case MUX_DISC:
+                        modemSend(fd, dlci, MUX_UA | MUX_PF, NULL, 0);
+                        break;
+                    case MUX_UIH:
+                        if (dlci == 0) {
+                            if (frame.len > 0 && (frame.info[0] & ~(MUX_CR | MUX_EA)) == CTL_CLD) {
+                                modemSend(fd, 0, MUX_UIH, cld, sizeof(cld));
+                            }
+                            break;
+                        }
+                        /* a frame cut short is skipped, and its command times out */
+                        for (i = 0; i < frame.len; i++) {
+                            if (frame.info[i] == '\r') {
+                                modemSend(fd, dlci, MUX_UIH, ok, sizeof(ok) - 1);
+                            }
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+            len -= consumed;
+            memmove(buf, buf + consumed, len);
+            if (!found) {
+                break;
+            }
+        }
+    }
+}
+
+/** returns false if a command failed, eg since a frame was cut short */
+static bool runCommands(const char *name, ATChannel *atch, const char *command, size_t iterations)
+{
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+    ATResponse *p_response;
+    uint64_t start;
+    size_t i;
+
+    if (samples == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < iterations; i++) {
+        start = benchNowNsec();
+        if (at_send_command_timeout(atch, command, COMMAND_TIMEOUT_MSEC, &p_response) != AT_SUCCESS
+            || !p_response->success) {
+            fprintf(stderr, "%s: command %zu failed\n", name, i);
+            at_response_free(p_response);
+            break;
+        }
+        samples[i] = benchNowNsec() - start;
+        at_response_free(p_response);
+    }
+
+    if (i > 0) {
+        benchReportLatency(name, samples, i);
+    }
+    free(samples);
+
+    return i == iterations;
+}
+
+int main(int argc, char **argv)
+{
+    static char longCommand[LONG_COMMAND + 1];
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    ATChannel atch;
+    ATMux *mux;
+    pthread_t modem;
+    int sndbuf = 1024;
+    int fds[2];
+    bool ok;
+
+    if (iterations == 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    if (!checkCodec()) {
+        return 1;
+    }
+    printf("mux: %zu iterations\n", iterations);
+    runParse(iterations);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    pthread_create(&modem, NULL, modemLoop, (void *) (intptr_t) fds[1]);
+
+    mux = at_mux_create(fds[0], FRAME_SIZE);
+    if (mux == NULL) {
+        fprintf(stderr, "at_mux_create failed\n");
+        return 1;
+    }
+    memset(&atch, 0, sizeof(atch));
+    if (at_mux_open_channel(mux, MODEM_DLCI, &atch) != AT_SUCCESS
+        || at_attach(&atch) != AT_SUCCESS) {
+        fprintf(stderr, "cannot open DLC %d\n", MODEM_DLCI);
+        return 1;
+    }
+
+    memcpy(longCommand, "AT+X=", 5);
+    memset(longCommand + 5, 'x', LONG_COMMAND - 5);
+    ok = runCommands("mux/AT", &atch, "AT", iterations)
+         && runCommands("mux/long", &atch, longCommand, iterations / 20 + 1);
+
+    at_close(&atch);
+    at_mux_destroy(mux);
+    close(fds[0]);
+    pthread_join(modem, NULL);
+    close(fds[1]);
+
+    return ok ? 0 : 1;
+}
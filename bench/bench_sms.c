@@ -0,0 +1,146 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Measures the SMS PDU codec on full length messages: the hex digits
+ * alone, then whole PDUs of GSM 7 bit and UCS2 text each way
+ *
+ * usage: bench_sms [iterations]
+ */
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include "bench.h"
+#include "at_sms.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define PDU_SIZE (2 * AT_SMS_MAX_PDU + 1)
+
+static volatile size_t s_sink;
+
+/* a full SMS-SUBMIT of "text" in "alphabet", as hex digits */
+static bool makePdu(ATSmsAlphabet alphabet, const char *text, ATSmsPdu *p_sms, char *pdu)
+{
+    size_t tpduLen;
+
+    memset(p_sms, 0, sizeof(*p_sms));
+    p_sms->type = AT_SMS_SUBMIT;
+    p_sms->alphabet = alphabet;
+    strcpy(p_sms->address, "+31612345678");
+    strcpy(p_sms->text, text);
+
+    return at_sms_encode(p_sms, pdu, PDU_SIZE, &tpduLen) == AT_SUCCESS;
+}
+
+static void runHex(const char *pdu, size_t iterations)
+{
+    uint8_t octets[AT_SMS_MAX_PDU];
+    size_t len = strlen(pdu);
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        s_sink = smsHexDecode(pdu, len, octets);
+    }
+
+    benchReportRate("sms/hex", iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+static void runDecode(const char *name, const char *pdu, size_t iterations)
+{
+    static ATSmsPdu sms;
+    size_t len = strlen(pdu);
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    if (at_sms_decode(pdu, len, &sms) != AT_SUCCESS) {
+        fprintf(stderr, "%s: cannot decode %s\n", name, pdu);
+        return;
+    }
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        at_sms_decode(pdu, len, &sms);
+        s_sink = sms.textLen;
+    }
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+static void runEncode(const char *name, const ATSmsPdu *p_sms, size_t iterations)
+{
+    char pdu[PDU_SIZE];
+    size_t tpduLen = 0;
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        at_sms_encode(p_sms, pdu, sizeof(pdu), &tpduLen);
+        s_sink = tpduLen;
+    }
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+int main(int argc, char **argv)
+{
+    static ATSmsPdu gsm7;
+    static ATSmsPdu ucs2;
+    static char gsm7Pdu[PDU_SIZE];
+    static char ucs2Pdu[PDU_SIZE];
+    char text[AT_SMS_MAX_USER_DATA + 1];
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+    size_t i;
+
+    if (iterations == 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 0; i < AT_SMS_MAX_USER_DATA; i++) {
+        text[i] = (char) ('a' + i % 26);
+    }
+    text[AT_SMS_MAX_USER_DATA] = '\0';
+    if (!makePdu(AT_SMS_GSM7, text, &gsm7, gsm7Pdu)) {
+        fprintf(stderr, "cannot encode the GSM 7 bit message\n");
+        return 1;
+    }
+    text[70] = '\0';
+    if (!makePdu(AT_SMS_UCS2, text, &ucs2, ucs2Pdu)) {
+        fprintf(stderr, "cannot encode the UCS2 message\n");
+        return 1;
+    }
+
+    printf("sms: %zu PDUs each\n", iterations);
+    runHex(gsm7Pdu, iterations);
+    runDecode("sms/decode/gsm7", gsm7Pdu, iterations);
+    runDecode("sms/decode/ucs2", ucs2Pdu, iterations);
+    runEncode("sms/encode/gsm7", &gsm7, iterations);
+    runEncode("sms/encode/ucs2", &ucs2, iterations);
+
+    return 0;
+}
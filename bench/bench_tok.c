@@ -0,0 +1,314 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+/*
+ * Measures the at_tok_* parsers on typical response lines
+ * Each pass of the at_tok_next* parsers copies the line first, as they
+ * write into it; the at_tok_split() ones parse it in place.
+ *
+ * usage: bench_tok [iterations]
+ */
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include "bench.h"
+#include "at_tok.h"
+
+#define DEFAULT_ITERATIONS 2000000
+#define NUM_FIELDS(x) (sizeof(x)/sizeof((x)[0]))
+#define MAX_LINE 256
+
+#define CSQ "+CSQ: 21,99"
+#define CREG "+CREG: 1,\"2F1C\",\"0F3A1B2\",7"
+#define CMGL "+CMGL: 1,\"REC READ\",\"+31612345678\",,\"20/11/02,12:34:56+04\""
+#define DECODE_ROWS 1000
+
+#define COPS "+COPS: (2,\"Operator\",\"Op\",\"20404\",7),(1,\"Other\",\"Ot\",\"20408\",2),,(0,1,2,3,4),(0,1,2)"
+
+typedef int (*ParseFunc)(char *line);
+typedef int (*SplitFunc)(const char *line);
+
+static volatile int s_sink;
+
+static int parseCsq(char *line)
+{
+    int rssi;
+    int ber;
+
+    if (at_tok_start(&line) < 0
+        || at_tok_nextint(&line, &rssi) < 0
+        || at_tok_nextint(&line, &ber) < 0) {
+        return -1;
+    }
+
+    return rssi + ber;
+}
+
+static int parseCreg(char *line)
+{
+    int stat;
+    int lac;
+    int ci;
+    int act;
+
+    if (at_tok_start(&line) < 0
+        || at_tok_nextint(&line, &stat) < 0
+        || at_tok_nexthexint(&line, &lac) < 0
+        || at_tok_nexthexint(&line, &ci) < 0
+        || at_tok_nextint(&line, &act) < 0) {
+        return -1;
+    }
+
+    return stat + lac + ci + act;
+}
+
+static int parseCmgl(char *line)
+{
+    int index;
+    char *stat;
+    char *oa;
+    char *alpha;
+    char *scts;
+
+    if (at_tok_start(&line) < 0
+        || at_tok_nextint(&line, &index) < 0
+        || at_tok_nextstr(&line, &stat) < 0
+        || at_tok_nextstr(&line, &oa) < 0
+        || at_tok_nextstr(&line, &alpha) < 0
+        || at_tok_nextstr(&line, &scts) < 0) {
+        return -1;
+    }
+
+    return index + stat[0] + oa[0] + scts[0];
+}
+
+static int parseAll(char *line)
+{
+    int count = 0;
+
+    if (at_tok_start(&line) < 0) {
+        return -1;
+    }
+    while (at_tok_hasmore(&line)) {
+        char *tok;
+
+        if (at_tok_nextstr(&line, &tok) < 0) {
+            break;
+        }
+        count++;
+    }
+
+    return count;
+}
+
+static int splitCsq(const char *line)
+{
+    ATToken tokens[2];
+    int rssi;
+    int ber;
+
+    if (at_tok_split(at_tok_params(line), tokens, 2) < 2
+        || at_tok_toint(&tokens[0], &rssi) < 0
+        || at_tok_toint(&tokens[1], &ber) < 0) {
+        return -1;
+    }
+
+    return rssi + ber;
+}
+
+static int splitCreg(const char *line)
+{
+    ATToken tokens[4];
+    int stat;
+    unsigned int lac;
+    unsigned int ci;
+    int act;
+
+    if (at_tok_split(at_tok_params(line), tokens, 4) < 4
+        || at_tok_toint(&tokens[0], &stat) < 0
+        || at_tok_tohexint(&tokens[1], &lac) < 0
+        || at_tok_tohexint(&tokens[2], &ci) < 0
+        || at_tok_toint(&tokens[3], &act) < 0) {
+        return -1;
+    }
+
+    return stat + (int)(lac + ci) + act;
+}
+
+static int splitCmgl(const char *line)
+{
+    ATToken tokens[5];
+    int index;
+
+    if (at_tok_split(at_tok_params(line), tokens, 5) < 5
+        || at_tok_toint(&tokens[0], &index) < 0) {
+        return -1;
+    }
+
+    return index + tokens[1].p[0] + tokens[2].p[0] + tokens[4].p[0];
+}
+
+static int splitAll(const char *line)
+{
+    ATToken tokens[32];
+
+    return at_tok_split(at_tok_params(line), tokens, 32);
+}
+
+static void run(const char *name, const char *line, ParseFunc parse, size_t iterations)
+{
+    char buf[MAX_LINE];
+    size_t len = strlen(line) + 1;
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    if (parse(strcpy(buf, line)) < 0) {
+        fprintf(stderr, "%s: cannot parse %s\n", name, line);
+        return;
+    }
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, line, len);
+        s_sink = parse(buf);
+    }
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+static void runSplit(const char *name, const char *line, SplitFunc split, size_t iterations)
+{
+    unsigned long allocs;
+    uint64_t start;
+    size_t i;
+
+    if (split(line) < 0) {
+        fprintf(stderr, "%s: cannot parse %s\n", name, line);
+        return;
+    }
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < iterations; i++) {
+        s_sink = split(line);
+    }
+
+    benchReportRate(name, iterations, benchNowNsec() - start, benchAllocs() - allocs);
+}
+
+/**
+ * Decodes a listing of DECODE_ROWS +CPBR lines, once walking the lines
+ * with the at_tok_next* parsers and once with at_tok_decode()
+ */
+static void runDecode(size_t iterations)
+{
+    static ATLine lines[DECODE_ROWS];
+    static char text[DECODE_ROWS][64];
+    static int index[DECODE_ROWS];
+    static ATToken number[DECODE_ROWS];
+    static int type[DECODE_ROWS];
+    static ATToken name[DECODE_ROWS];
+    static int errors[DECODE_ROWS];
+    const ATField fields[] = {
+        { AT_FIELD_INT, index },
+        { AT_FIELD_STRING, number },
+        { AT_FIELD_INT, type },
+        { AT_FIELD_STRING, name },
+    };
+    ATResponse response;
+    char buf[MAX_LINE];
+    unsigned long allocs;
+    uint64_t start;
+    size_t passes = iterations / DECODE_ROWS > 0 ? iterations / DECODE_ROWS : 1;
+    size_t i;
+    size_t row;
+
+    for (row = 0; row < DECODE_ROWS; row++) {
+        snprintf(text[row], sizeof(text[row]), "+CPBR: %zu,\"+3161234%04zu\",145,\"Name %zu\"",
+                 row + 1, row, row);
+        lines[row].line = text[row];
+        lines[row].p_next = row + 1 < DECODE_ROWS ? &lines[row + 1] : NULL;
+    }
+    memset(&response, 0, sizeof(response));
+    response.p_intermediates = lines;
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < passes; i++) {
+        const ATLine *p_line;
+
+        for (row = 0, p_line = response.p_intermediates; p_line != NULL; p_line = p_line->p_next, row++) {
+            char *line = strcpy(buf, p_line->line);
+            char *str;
+
+            if (at_tok_start(&line) < 0
+                || at_tok_nextint(&line, &index[row]) < 0
+                || at_tok_nextstr(&line, &str) < 0
+                || at_tok_nextint(&line, &type[row]) < 0
+                || at_tok_nextstr(&line, &str) < 0) {
+                errors[row] = 0;
+            }
+        }
+        s_sink = index[DECODE_ROWS - 1];
+    }
+
+    benchReportRate("tok/rows/next", passes * DECODE_ROWS, benchNowNsec() - start,
+                    benchAllocs() - allocs);
+
+    allocs = benchAllocs();
+    start = benchNowNsec();
+
+    for (i = 0; i < passes; i++) {
+        s_sink = at_tok_decode(&response, fields, NUM_FIELDS(fields), DECODE_ROWS, errors);
+    }
+
+    benchReportRate("tok/rows/decode", passes * DECODE_ROWS, benchNowNsec() - start,
+                    benchAllocs() - allocs);
+
+    if (errors[DECODE_ROWS - 1] != -1 || index[DECODE_ROWS - 1] != DECODE_ROWS) {
+        fprintf(stderr, "tok/rows/decode: cannot decode %s\n", text[DECODE_ROWS - 1]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : DEFAULT_ITERATIONS;
+
+    if (iterations == 0) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("tok: %zu parses each\n", iterations);
+    run("tok/csq", CSQ, parseCsq, iterations);
+    run("tok/creg", CREG, parseCreg, iterations);
+    run("tok/cmgl", CMGL, parseCmgl, iterations);
+    run("tok/cops", COPS, parseAll, iterations);
+
+    runSplit("tok/split/csq", CSQ, splitCsq, iterations);
+    runSplit("tok/split/creg", CREG, splitCreg, iterations);
+    runSplit("tok/split/cmgl", CMGL, splitCmgl, iterations);
+    runSplit("tok/split/cops", COPS, splitAll, iterations);
+
+    runDecode(iterations);
+
+    return 0;
+}
@@ -1,5 +1,5 @@
-from ctypes import c_void_p, c_bool, c_char_p, c_int, c_uint, c_longlong, \
-    byref, POINTER, Structure, CFUNCTYPE, CDLL
+from ctypes import c_void_p, c_bool, c_char, c_char_p, c_int, c_uint, \
+    c_longlong, c_size_t, c_uint64, byref, POINTER, Structure, CFUNCTYPE, CDLL
 from typing import Tuple, List, TextIO
 from enum import IntEnum
 
@@ -10,15 +10,26 @@ class LibATLine(Structure):
 
 LibATLine._fields_ = [
     ("next", POINTER(LibATLine)),
-    ("line", c_char_p)
+    ("line", c_char_p),
+    ("len", c_size_t)
 ]
 
 
+class LibATTiming(Structure):
+    _fields_ = [
+        ("writeStart", c_uint64),
+        ("writeEnd", c_uint64),
+        ("firstLine", c_uint64),
+        ("finalLine", c_uint64)
+    ]
+
+
 class LibATResponse(Structure):
     _fields_ = [
         ("success", c_bool),
         ("finalResponse", c_char_p),
-        ("intermediates", POINTER(LibATLine))
+        ("intermediates", POINTER(LibATLine)),
+        ("timing", LibATTiming)
     ]
 
 
@@ -29,6 +40,8 @@ class LibATChannel(Structure):
 LibATUnsolHandler = CFUNCTYPE(None, POINTER(LibATChannel), c_char_p)
 LibATUnsolSmsHandler = CFUNCTYPE(
     None, POINTER(LibATChannel), c_char_p, c_char_p)
+LibATUnsolHandlerN = CFUNCTYPE(
+    None, POINTER(LibATChannel), POINTER(c_char), c_size_t)
 LibATOnTimeoutHandler = CFUNCTYPE(None, POINTER(LibATChannel))
 LibATOnCloseHandler = CFUNCTYPE(None, POINTER(LibATChannel))
 LibATLog = CFUNCTYPE(None, POINTER(LibATChannel), c_int, c_char_p)
@@ -50,7 +63,8 @@ LibATChannel._fields_ = [
     ("log", LibATLog),
     ("logLevel", c_int),
     ("param", c_void_p),
-    ("impl", POINTER(LibATChannelImpl))
+    ("impl", POINTER(LibATChannelImpl)),
+    ("unsolHandlerN", LibATUnsolHandlerN)
 ]
 
 
@@ -166,6 +180,16 @@ lib_at_send_command_timeout.argtypes = [
 ]
 lib_at_send_command_timeout.restype = LibATReturn
 
+lib_at_send_command_timeout_n = libatch.at_send_command_timeout_n
+lib_at_send_command_timeout_n.argtypes = [
+    POINTER(LibATChannel),
+    c_char_p,
+    c_size_t,
+    c_longlong,
+    POINTER(POINTER(LibATResponse))
+]
+lib_at_send_command_timeout_n.restype = LibATReturn
+
 lib_at_send_command_singleline = libatch.at_send_command_singleline
 lib_at_send_command_singleline.argtypes = [
     POINTER(LibATChannel),
@@ -314,7 +338,9 @@ class ATChannel:
             # param
             self.DEFAULT_PARAM,
             # impl
-            None
+            None,
+            # unsolHandlerN
+            LibATUnsolHandlerN()
         )
 
     def open(self) -> None:
@@ -345,8 +371,9 @@ class ATChannel:
     def send_command_timeout(
             self, command: str, timeout: int) -> Tuple[bool, str]:
         patres = POINTER(LibATResponse)()
-        ret = lib_at_send_command_timeout(
-            self.atch, bytes(command, 'utf-8'), timeout, byref(patres))
+        bcommand = bytes(command, 'utf-8')
+        ret = lib_at_send_command_timeout_n(
+            self.atch, bcommand, len(bcommand), timeout, byref(patres))
         ret.check_and_raise()
         success = None
         finalResponse = None
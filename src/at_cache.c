@@ -0,0 +1,245 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_cache.h"
+#include "at_response.h"
+#include "misc.h"
+
+typedef struct ATCacheRule {
+    struct ATCacheRule *p_next;
+    uint32_t hash;              /* of command */
+    const char *command;        /* this and invalidatingPrefix follow the struct */
+    size_t commandLen;
+    const char *invalidatingPrefix;
+    uint64_t ttlNsec;
+
+    ATResponse *p_response;     /* NULL unless cached */
+    int type;
+    char *responsePrefix;       /* of p_response, NULL if none */
+    uint64_t expiry;
+    uint64_t generation;        /* changes when the response goes stale */
+} ATCacheRule;
+
+struct ATCache {
+    ATCacheRule *p_rules;
+    uint64_t generation;        /* the last one given to a rule */
+};
+
+/* FNV-1a, so that a miss rarely costs a string comparison */
+static uint32_t hashCommand(const char *command, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (uint8_t) command[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static ATCacheRule *findRule(ATCache *cache, const char *command, size_t len)
+{
+    uint32_t hash = hashCommand(command, len);
+    ATCacheRule *p_rule;
+
+    for (p_rule = cache->p_rules; p_rule != NULL; p_rule = p_rule->p_next) {
+        if (p_rule->hash == hash && p_rule->commandLen == len
+            && 0 == memcmp(p_rule->command, command, len)) {
+            return p_rule;
+        }
+    }
+
+    return NULL;
+}
+
+static void dropResponse(ATCacheRule *p_rule)
+{
+    if (p_rule->p_response != NULL) {
+        at_response_free(p_rule->p_response);
+        p_rule->p_response = NULL;
+    }
+}
+
+static void freeRule(ATCacheRule *p_rule)
+{
+    dropResponse(p_rule);
+    free(p_rule->responsePrefix);
+    free(p_rule);
+}
+
+/** a response in flight when this is called is not to be stored */
+static void staleRule(ATCache *cache, ATCacheRule *p_rule)
+{
+    dropResponse(p_rule);
+    p_rule->generation = ++cache->generation;
+}
+
+static bool samePrefix(const char *a, const char *b)
+{
+    return a == b || (a != NULL && b != NULL && 0 == strcmp(a, b));
+}
+
+ATCache *cacheNew(void)
+{
+    return (ATCache *) calloc(1, sizeof(ATCache));
+}
+
+void cacheFree(ATCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+
+    while (cache->p_rules != NULL) {
+        ATCacheRule *p_rule = cache->p_rules;
+        cache->p_rules = p_rule->p_next;
+        freeRule(p_rule);
+    }
+    free(cache);
+}
+
+bool cacheSetRule(ATCache *cache, const char *command, uint64_t ttlNsec,
+                  const char *invalidatingPrefix)
+{
+    ATCacheRule **pp_rule;
+    ATCacheRule *p_rule;
+    size_t commandSize = strlen(command) + 1;
+    size_t prefixSize = invalidatingPrefix != NULL ? strlen(invalidatingPrefix) + 1 : 0;
+    char *p_str;
+
+    for (pp_rule = &cache->p_rules; *pp_rule != NULL; pp_rule = &(*pp_rule)->p_next) {
+        if (0 == strcmp((*pp_rule)->command, command)) {
+            p_rule = *pp_rule;
+            *pp_rule = p_rule->p_next;
+            freeRule(p_rule);
+            break;
+        }
+    }
+
+    if (ttlNsec == 0) {
+        return true;
+    }
+
+    p_rule = (ATCacheRule *) calloc(1, sizeof(ATCacheRule) + commandSize + prefixSize);
+    if (p_rule == NULL) {
+        return false;
+    }
+
+    p_str = (char *) (p_rule + 1);
+    p_rule->command = memcpy(p_str, command, commandSize);
+    if (invalidatingPrefix != NULL) {
+        p_rule->invalidatingPrefix = memcpy(p_str + commandSize, invalidatingPrefix, prefixSize);
+    }
+    p_rule->commandLen = commandSize - 1;
+    p_rule->hash = hashCommand(command, p_rule->commandLen);
+    p_rule->ttlNsec = ttlNsec;
+    p_rule->generation = ++cache->generation;
+
+    p_rule->p_next = cache->p_rules;
+    cache->p_rules = p_rule;
+
+    return true;
+}
+
+ATResponse *cacheLookup(ATCache *cache, const char *command, size_t len, int type,
+                        const char *responsePrefix, uint64_t now)
+{
+    ATCacheRule *p_rule = findRule(cache, command, len);
+
+    if (p_rule == NULL || p_rule->p_response == NULL || p_rule->type != type
+        || !samePrefix(p_rule->responsePrefix, responsePrefix)) {
+        return NULL;
+    }
+    if (now >= p_rule->expiry) {
+        dropResponse(p_rule);
+        return NULL;
+    }
+
+    return responseCopy(p_rule->p_response);
+}
+
+uint64_t cacheGeneration(ATCache *cache, const char *command, size_t len)
+{
+    ATCacheRule *p_rule = findRule(cache, command, len);
+
+    return p_rule != NULL ? p_rule->generation : 0;
+}
+
+void cacheStore(ATCache *cache, const char *command, size_t len, int type,
+                const char *responsePrefix, const ATResponse *p_response,
+                uint64_t generation, uint64_t now)
+{
+    ATCacheRule *p_rule = findRule(cache, command, len);
+    ATResponse *p_copy;
+
+    if (p_rule == NULL || p_rule->generation != generation) {
+        return;
+    }
+
+    if (!samePrefix(p_rule->responsePrefix, responsePrefix)) {
+        char *p_prefix = NULL;
+
+        if (responsePrefix != NULL) {
+            p_prefix = strdup(responsePrefix);
+            if (p_prefix == NULL) {
+                return;
+            }
+        }
+        dropResponse(p_rule);
+        free(p_rule->responsePrefix);
+        p_rule->responsePrefix = p_prefix;
+    }
+
+    p_copy = responseCopy(p_response);
+    if (p_copy == NULL) {
+        return;
+    }
+
+    dropResponse(p_rule);
+    p_rule->p_response = p_copy;
+    p_rule->type = type;
+    p_rule->expiry = now + p_rule->ttlNsec;
+}
+
+void cacheInvalidateLine(ATCache *cache, const char *line)
+{
+    ATCacheRule *p_rule;
+
+    for (p_rule = cache->p_rules; p_rule != NULL; p_rule = p_rule->p_next) {
+        if (p_rule->invalidatingPrefix != NULL
+            && strStartsWith(line, p_rule->invalidatingPrefix)) {
+            staleRule(cache, p_rule);
+        }
+    }
+}
+
+void cacheInvalidate(ATCache *cache, const char *command)
+{
+    ATCacheRule *p_rule;
+
+    for (p_rule = cache->p_rules; p_rule != NULL; p_rule = p_rule->p_next) {
+        if (command == NULL || 0 == strcmp(p_rule->command, command)) {
+            staleRule(cache, p_rule);
+        }
+    }
+}
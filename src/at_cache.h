@@ -0,0 +1,80 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_CACHE_H
+#define AT_CACHE_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "atchannel.h"
+
+/**
+ * the responses of the commands a channel caches, see at_cache_command(),
+ * not thread safe
+ */
+typedef struct ATCache ATCache;
+
+/** returns an empty cache, NULL on allocation failure */
+ATCache *cacheNew(void);
+void cacheFree(ATCache *cache);
+
+/**
+ * keeps the responses to "command" for "ttlNsec", or until an unsolicited
+ * response starting with "invalidatingPrefix" if that is not NULL
+ * replaces the rule of the same command, a "ttlNsec" of 0 removes it
+ * returns false on allocation failure
+ */
+bool cacheSetRule(ATCache *cache, const char *command, uint64_t ttlNsec,
+                  const char *invalidatingPrefix);
+
+/**
+ * returns a copy of the response to "command" of "len" bytes, "type" and
+ * "responsePrefix" if it is still fresh at "now", NULL if there is none
+ */
+ATResponse *cacheLookup(ATCache *cache, const char *command, size_t len, int type,
+                        const char *responsePrefix, uint64_t now);
+
+/**
+ * returns the generation of the rule of "command", to pass to cacheStore()
+ * once its response is in; 0 if it has none
+ */
+uint64_t cacheGeneration(ATCache *cache, const char *command, size_t len);
+
+/**
+ * keeps a copy of a successful response to "command" if it has a rule,
+ * unless the rule is not of "generation" any more: the response was
+ * invalidated or the rule replaced after the command was written
+ */
+void cacheStore(ATCache *cache, const char *command, size_t len, int type,
+                const char *responsePrefix, const ATResponse *p_response,
+                uint64_t generation, uint64_t now);
+
+/** drops the responses the unsolicited response "line" makes stale */
+void cacheInvalidateLine(ATCache *cache, const char *line);
+
+/** drops the response to "command", or every response if it is NULL */
+void cacheInvalidate(ATCache *cache, const char *command);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_CACHE_H */
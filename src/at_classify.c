@@ -0,0 +1,284 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_classify.h"
+
+#define NUM_ELEMS(x) (sizeof(x)/sizeof((x)[0]))
+
+/* states are indexed by 16 bits, state 0 is the start and the dead end */
+#define MAX_STATES 65535
+
+typedef struct {
+    char *prefix;
+    ATLineClass lineClass;
+} ATPrefix;
+
+struct ATClassifier {
+    ATClassifier *p_base;       /* kept for readers still using it */
+    bool shared;
+
+    ATPrefix *prefixes;
+    size_t prefixCount;
+
+    uint8_t byteClass[256];     /* 0 for bytes not in any prefix */
+    size_t byteClassCount;
+    size_t stateCount;
+    uint8_t *accept;            /* ATLineClass + 1 ending here, or 0 */
+    uint16_t *next;             /* [state * byteClassCount + byteClass] */
+};
+
+/**
+ * final responses indicating error
+ * See 27.007 annex B
+ * WARNING: NO CARRIER and others are sometimes unsolicited
+ */
+static const char * const s_finalResponsesError[] = {
+    "ERROR",
+    "+CMS ERROR:",
+    "+CME ERROR:",
+    "NO CARRIER", /* sometimes! */
+    "NO ANSWER",
+    "NO DIALTONE",
+};
+
+/**
+ * final responses indicating success
+ * See 27.007 annex B
+ * WARNING: NO CARRIER and others are sometimes unsolicited
+ */
+static const char * const s_finalResponsesSuccess[] = {
+    "OK",
+    "CONNECT"       /* some stacks start up data on another channel */
+};
+
+/**
+ * the first line in (what will be) a two-line SMS unsolicited response
+ */
+static const char * const s_smsUnsoliciteds[] = {
+    "+CMT:",
+    "+CDS:",
+    "+CBM:"
+};
+
+static pthread_once_t s_defaultOnce = PTHREAD_ONCE_INIT;
+static ATClassifier *s_defaultClassifier;
+
+static void freeTables(ATClassifier *classifier)
+{
+    size_t i;
+
+    for (i = 0; i < classifier->prefixCount; i++) {
+        free(classifier->prefixes[i].prefix);
+    }
+    free(classifier->prefixes);
+    free(classifier->accept);
+    free(classifier->next);
+    free(classifier);
+}
+
+/** adds a prefix to the list, replacing the class of an equal one */
+static bool addPrefix(ATClassifier *classifier, const char *prefix, ATLineClass lineClass)
+{
+    ATPrefix *p_prefix;
+    size_t i;
+
+    for (i = 0; i < classifier->prefixCount; i++) {
+        if (0 == strcmp(classifier->prefixes[i].prefix, prefix)) {
+            classifier->prefixes[i].lineClass = lineClass;
+            return true;
+        }
+    }
+
+    p_prefix = realloc(classifier->prefixes, (classifier->prefixCount + 1) * sizeof(ATPrefix));
+    if (p_prefix == NULL) {
+        return false;
+    }
+    classifier->prefixes = p_prefix;
+
+    p_prefix += classifier->prefixCount;
+    p_prefix->prefix = strdup(prefix);
+    if (p_prefix->prefix == NULL) {
+        return false;
+    }
+    p_prefix->lineClass = lineClass;
+    classifier->prefixCount++;
+
+    return true;
+}
+
+/** compiles the prefix list into the transition table */
+static bool compile(ATClassifier *classifier)
+{
+    size_t stateLimit = 1;
+    size_t i;
+
+    /* only the bytes used by some prefix get a column */
+    memset(classifier->byteClass, 0, sizeof(classifier->byteClass));
+    classifier->byteClassCount = 1;
+    for (i = 0; i < classifier->prefixCount; i++) {
+        const unsigned char *p = (const unsigned char *) classifier->prefixes[i].prefix;
+
+        for (; *p != '\0'; p++) {
+            if (classifier->byteClass[*p] == 0) {
+                classifier->byteClass[*p] = (uint8_t) classifier->byteClassCount++;
+            }
+            stateLimit++;
+        }
+    }
+
+    if (stateLimit > MAX_STATES) {
+        return false;
+    }
+
+    classifier->accept = calloc(stateLimit, sizeof(uint8_t));
+    classifier->next = calloc(stateLimit * classifier->byteClassCount, sizeof(uint16_t));
+    if (classifier->accept == NULL || classifier->next == NULL) {
+        return false;
+    }
+
+    classifier->stateCount = 1;
+    for (i = 0; i < classifier->prefixCount; i++) {
+        const unsigned char *p = (const unsigned char *) classifier->prefixes[i].prefix;
+        size_t state = 0;
+
+        for (; *p != '\0'; p++) {
+            uint16_t *p_next = &classifier->next[state * classifier->byteClassCount
+                                                 + classifier->byteClass[*p]];
+
+            if (*p_next == 0) {
+                *p_next = (uint16_t) classifier->stateCount++;
+            }
+            state = *p_next;
+        }
+        classifier->accept[state] = (uint8_t) (classifier->prefixes[i].lineClass + 1);
+    }
+
+    return true;
+}
+
+static void buildDefault(void)
+{
+    ATClassifier *classifier;
+    bool ok = true;
+    size_t i;
+
+    classifier = calloc(1, sizeof(ATClassifier));
+    if (classifier == NULL) {
+        return;
+    }
+
+    for (i = 0; ok && i < NUM_ELEMS(s_finalResponsesError); i++) {
+        ok = addPrefix(classifier, s_finalResponsesError[i], AT_LINE_FINAL_ERROR);
+    }
+    for (i = 0; ok && i < NUM_ELEMS(s_finalResponsesSuccess); i++) {
+        ok = addPrefix(classifier, s_finalResponsesSuccess[i], AT_LINE_FINAL_SUCCESS);
+    }
+    for (i = 0; ok && i < NUM_ELEMS(s_smsUnsoliciteds); i++) {
+        ok = addPrefix(classifier, s_smsUnsoliciteds[i], AT_LINE_SMS_UNSOLICITED);
+    }
+
+    if (!ok || !compile(classifier)) {
+        freeTables(classifier);
+        return;
+    }
+
+    classifier->shared = true;
+    s_defaultClassifier = classifier;
+}
+
+ATClassifier *classifierDefault(void)
+{
+    pthread_once(&s_defaultOnce, buildDefault);
+
+    return s_defaultClassifier;
+}
+
+ATClassifier *classifierAdd(ATClassifier *base, const char *prefix, ATLineClass lineClass)
+{
+    ATClassifier *classifier;
+    size_t i;
+
+    classifier = calloc(1, sizeof(ATClassifier));
+    if (classifier == NULL) {
+        return NULL;
+    }
+
+    classifier->prefixes = malloc(base->prefixCount * sizeof(ATPrefix));
+    if (classifier->prefixes == NULL) {
+        free(classifier);
+        return NULL;
+    }
+    for (i = 0; i < base->prefixCount; i++) {
+        classifier->prefixes[i].prefix = strdup(base->prefixes[i].prefix);
+        if (classifier->prefixes[i].prefix == NULL) {
+            freeTables(classifier);
+            return NULL;
+        }
+        classifier->prefixes[i].lineClass = base->prefixes[i].lineClass;
+        classifier->prefixCount++;
+    }
+
+    if (!addPrefix(classifier, prefix, lineClass) || !compile(classifier)) {
+        freeTables(classifier);
+        return NULL;
+    }
+
+    classifier->p_base = base;
+
+    return classifier;
+}
+
+void classifierFree(ATClassifier *classifier)
+{
+    while (classifier != NULL && !classifier->shared) {
+        ATClassifier *p_base = classifier->p_base;
+
+        freeTables(classifier);
+        classifier = p_base;
+    }
+}
+
+ATLineClass classifierMatch(const ATClassifier *classifier, const char *line)
+{
+    const unsigned char *p = (const unsigned char *) line;
+    size_t state = 0;
+    unsigned int found = 0;
+
+    for (;;) {
+        unsigned int byteClass = classifier->byteClass[*p++];
+
+        /* '\0' is in no prefix, so this also stops at the end of the line */
+        if (byteClass == 0) {
+            break;
+        }
+        state = classifier->next[state * classifier->byteClassCount + byteClass];
+        if (state == 0) {
+            break;
+        }
+        if (classifier->accept[state] != 0) {
+            found = classifier->accept[state];
+        }
+    }
+
+    return found != 0 ? (ATLineClass) (found - 1) : AT_LINE_OTHER;
+}
@@ -0,0 +1,56 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_CLASSIFY_H
+#define AT_CLASSIFY_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "atchannel.h"
+
+/**
+ * a line classifier compiled from a set of prefixes into a DFA,
+ * classifying a line takes one pass over its first bytes
+ */
+typedef struct ATClassifier ATClassifier;
+
+/**
+ * returns the classifier for the default final and SMS prefixes,
+ * shared by all channels, NULL on allocation failure
+ */
+ATClassifier *classifierDefault(void);
+
+/**
+ * returns a new classifier for the prefixes of "base" and "prefix",
+ * NULL on allocation failure
+ * "base" is kept alive until the new classifier is freed, so that readers
+ * still using it are safe
+ */
+ATClassifier *classifierAdd(ATClassifier *base, const char *prefix, ATLineClass lineClass);
+
+/** frees a classifier and all of its bases but the default */
+void classifierFree(ATClassifier *classifier);
+
+/** returns the class of the longest prefix matching "line" */
+ATLineClass classifierMatch(const ATClassifier *classifier, const char *line);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_CLASSIFY_H */
@@ -0,0 +1,955 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "atchannel.h"
+#include "at_mux.h"
+#include "misc.h"
+
+#define MUX_DEFAULT_FRAME_SIZE  31      /* N1 of the basic option */
+#define MUX_MAX_DLCI            63
+#define MUX_T1_MSEC             1000    /* how long SABM, DISC and CLD wait for an answer */
+#define MUX_N2                  3       /* how many times SABM is sent */
+#define MUX_MAX_BACKLOG         (64 * 1024)
+
+/* multiplexer control messages on DLCI 0, the type without MUX_EA and MUX_CR */
+#define MUX_CTL_PN      0x80
+#define MUX_CTL_PSC     0x40
+#define MUX_CTL_CLD     0xC0
+#define MUX_CTL_TEST    0x20
+#define MUX_CTL_FCON    0xA0
+#define MUX_CTL_FCOFF   0x60
+#define MUX_CTL_MSC     0xE0
+#define MUX_CTL_NSC     0x10
+
+/* V.24 signals of MSC */
+#define MUX_V24_FC      0x02
+#define MUX_V24_RTC     0x04
+#define MUX_V24_RTR     0x08
+#define MUX_V24_DV      0x80
+#define MUX_V24_READY   (MUX_EA | MUX_V24_RTC | MUX_V24_RTR | MUX_V24_DV)
+
+/* the FCS check of the receiver, TS 27.010 5.2.1.6 */
+#define MUX_FCS_GOOD    0xCF
+
+typedef enum {
+    DLC_CLOSED,
+    DLC_OPENING,                /* sent SABM, waiting for UA */
+    DLC_OPEN,
+    DLC_CLOSING,                /* sent DISC, waiting for UA */
+} ATMuxDlcState;
+
+typedef struct {
+    ATMuxDlcState state;
+    int fd;                     /* the mux end of the channel's socket, -1 when closed */
+    bool flowStopped;           /* the modem sent MSC with FC */
+
+    /* what the channel has not taken yet, of the I/O thread only */
+    uint8_t *backlog;
+    size_t backlogLen;
+    bool throttled;             /* sent MSC with FC for the backlog */
+} ATMuxDlc;
+
+struct ATMux {
+    int fd;
+    size_t frameSize;
+    pthread_t tid;
+    int wakeupfd;
+
+    pthread_mutex_t mutex;      /* protects what follows but "in" */
+    pthread_cond_t cond;        /* a DLC or the mux changed state */
+    ATMuxDlc dlcs[MUX_MAX_DLCI + 1];
+    bool flowStopped;           /* the modem sent FCoff */
+    bool cldPending;
+    bool closed;                /* the port is gone or the mux closed down */
+    bool stopping;
+
+    /* serializes frames from the I/O thread and the callers */
+    pthread_mutex_t writemutex;
+
+    /* what was read from the port, of the I/O thread only */
+    uint8_t *in;
+    size_t inLen;
+    size_t inCapacity;
+};
+
+static const uint8_t s_crcTable[256] = {
+    0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75,
+    0x0E, 0x9F, 0xED, 0x7C, 0x09, 0x98, 0xEA, 0x7B,
+    0x1C, 0x8D, 0xFF, 0x6E, 0x1B, 0x8A, 0xF8, 0x69,
+    0x12, 0x83, 0xF1, 0x60, 0x15, 0x84, 0xF6, 0x67,
+    0x38, 0xA9, 0xDB, 0x4A, 0x3F, 0xAE, 0xDC, 0x4D,
+    0x36, 0xA7, 0xD5, 0x44, 0x31, 0xA0, 0xD2, 0x43,
+    0x24, 0xB5, 0xC7, 0x56, 0x23, 0xB2, 0xC0, 0x51,
+    0x2A, 0xBB, 0xC9, 0x58, 0x2D, 0xBC, 0xCE, 0x5F,
+    0x70, 0xE1, 0x93, 0x02, 0x77, 0xE6, 0x94, 0x05,
+    0x7E, 0xEF, 0x9D, 0x0C, 0x79, 0xE8, 0x9A, 0x0B,
+    0x6C, 0xFD, 0x8F, 0x1E, 0x6B, 0xFA, 0x88, 0x19,
+    0x62, 0xF3, 0x81, 0x10, 0x65, 0xF4, 0x86, 0x17,
+    0x48, 0xD9, 0xAB, 0x3A, 0x4F, 0xDE, 0xAC, 0x3D,
+    0x46, 0xD7, 0xA5, 0x34, 0x41, 0xD0, 0xA2, 0x33,
+    0x54, 0xC5, 0xB7, 0x26, 0x53, 0xC2, 0xB0, 0x21,
+    0x5A, 0xCB, 0xB9, 0x28, 0x5D, 0xCC, 0xBE, 0x2F,
+    0xE0, 0x71, 0x03, 0x92, 0xE7, 0x76, 0x04, 0x95,
+    0xEE, 0x7F, 0x0D, 0x9C, 0xE9, 0x78, 0x0A, 0x9B,
+    0xFC, 0x6D, 0x1F, 0x8E, 0xFB, 0x6A, 0x18, 0x89,
+    0xF2, 0x63, 0x11, 0x80, 0xF5, 0x64, 0x16, 0x87,
+    0xD8, 0x49, 0x3B, 0xAA, 0xDF, 0x4E, 0x3C, 0xAD,
+    0xD6, 0x47, 0x35, 0xA4, 0xD1, 0x40, 0x32, 0xA3,
+    0xC4, 0x55, 0x27, 0xB6, 0xC3, 0x52, 0x20, 0xB1,
+    0xCA, 0x5B, 0x29, 0xB8, 0xCD, 0x5C, 0x2E, 0xBF,
+    0x90, 0x01, 0x73, 0xE2, 0x97, 0x06, 0x74, 0xE5,
+    0x9E, 0x0F, 0x7D, 0xEC, 0x99, 0x08, 0x7A, 0xEB,
+    0x8C, 0x1D, 0x6F, 0xFE, 0x8B, 0x1A, 0x68, 0xF9,
+    0x82, 0x13, 0x61, 0xF0, 0x85, 0x14, 0x66, 0xF7,
+    0xA8, 0x39, 0x4B, 0xDA, 0xAF, 0x3E, 0x4C, 0xDD,
+    0xA6, 0x37, 0x45, 0xD4, 0xA1, 0x30, 0x42, 0xD3,
+    0xB4, 0x25, 0x57, 0xC6, 0xB3, 0x22, 0x50, 0xC1,
+    0xBA, 0x2B, 0x59, 0xC8, 0xBD, 0x2C, 0x5E, 0xCF,
+};
+
+static uint8_t crc(uint8_t value, const uint8_t *p, size_t len)
+{
+    while (len-- > 0) {
+        value = s_crcTable[value ^ *p++];
+    }
+    return value;
+}
+
+size_t muxHeader(uint8_t *header, uint8_t address, uint8_t control, size_t len)
+{
+    header[0] = MUX_FLAG;
+    header[1] = address;
+    header[2] = control;
+    if (len <= 0x7F) {
+        header[3] = (uint8_t)(len << 1 | MUX_EA);
+        return 4;
+    }
+    header[3] = (uint8_t)(len << 1);
+    header[4] = (uint8_t)(len >> 7);
+    return 5;
+}
+
+uint8_t muxFcs(const uint8_t *header, size_t headerLen, const uint8_t *info, size_t len)
+{
+    uint8_t value = crc(0xFF, header, headerLen);
+
+    if (info) {
+        value = crc(value, info, len);
+    }
+    return (uint8_t)(0xFF - value);
+}
+
+bool muxParse(const uint8_t *buf, size_t len, size_t maxLen,
+              ATMuxFrame *p_frame, size_t *p_consumed)
+{
+    size_t pos = 0;
+
+    for (;;) {
+        const uint8_t *p_flag = memchr(buf + pos, MUX_FLAG, len - pos);
+        const uint8_t *p_header;
+        const uint8_t *p_info;
+        size_t headerLen;
+        size_t infoLen;
+        uint8_t value;
+
+        if (!p_flag) {
+            *p_consumed = len;
+            return false;
+        }
+        pos = (size_t)(p_flag - buf);
+
+        /* any run of flags opens the frame after it */
+        while (pos + 1 < len && buf[pos + 1] == MUX_FLAG) {
+            pos++;
+        }
+
+        if (len - pos < 4) {
+            break;
+        }
+        headerLen = 3;
+        infoLen = buf[pos + 3] >> 1;
+        if (!(buf[pos + 3] & MUX_EA)) {
+            if (len - pos < 5) {
+                break;
+            }
+            infoLen |= (size_t)buf[pos + 4] << 7;
+            headerLen = 4;
+        }
+        if (!(buf[pos + 1] & MUX_EA) || infoLen > maxLen) {
+            /* a closing flag or noise, resynchronize on the next flag */
+            pos++;
+            continue;
+        }
+        if (len - pos < 1 + headerLen + infoLen + 2) {
+            break;
+        }
+
+        p_header = buf + pos + 1;
+        p_info = p_header + headerLen;
+        value = crc(0xFF, p_header, headerLen);
+        if ((p_header[1] & ~MUX_PF) == MUX_UI) {
+            value = crc(value, p_info, infoLen);
+        }
+        value = s_crcTable[value ^ p_info[infoLen]];
+        if (value != MUX_FCS_GOOD || p_info[infoLen + 1] != MUX_FLAG) {
+            pos++;
+            continue;
+        }
+
+        p_frame->address = p_header[0];
+        p_frame->control = p_header[1];
+        p_frame->info = p_info;
+        p_frame->len = infoLen;
+        *p_consumed = (size_t)(p_info + infoLen + 1 - buf);
+        return true;
+    }
+
+    *p_consumed = pos;
+    return false;
+}
+
+static void wakeup(ATMux *mux)
+{
+    uint64_t one = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(mux->wakeupfd, &one, sizeof(one));
+    } while (ret < 0 && errno == EINTR);
+}
+
+/**
+ * sends a frame to the modem; "command" is for the C/R bit, which we
+ * set on commands since the side that sent AT+CMUX is the initiator
+ *
+ * a frame is always written whole, waiting for a non-blocking port to
+ * take the rest, so returns false only once the port is gone
+ */
+static bool muxSend(ATMux *mux, int dlci, uint8_t control, bool command,
+                    const uint8_t *info, size_t len)
+{
+    uint8_t header[MUX_MAX_HEADER];
+    uint8_t trailer[2];
+    uint8_t address = (uint8_t)(dlci << 2 | (command ? MUX_CR : 0) | MUX_EA);
+    size_t headerLen = muxHeader(header, address, control, len);
+    struct iovec iov[3];
+    struct iovec *p_iov = iov;
+    int iovcnt = 3;
+    ssize_t written = 0;
+    struct pollfd pfd;
+
+    trailer[0] = muxFcs(header + 1, headerLen - 1,
+                        (control & ~MUX_PF) == MUX_UI ? info : NULL, len);
+    trailer[1] = MUX_FLAG;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerLen;
+    iov[1].iov_base = (void *)(uintptr_t) info;
+    iov[1].iov_len = len;
+    iov[2].iov_base = trailer;
+    iov[2].iov_len = sizeof(trailer);
+
+    pfd.fd = mux->fd;
+    pfd.events = POLLOUT;
+
+    pthread_mutex_lock(&mux->writemutex);
+    while (iovcnt > 0) {
+        do {
+            written = writev(mux->fd, p_iov, iovcnt);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0 && errno == EAGAIN) {
+            /* a partial frame would break the framing, wait for room */
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+                break;
+            }
+            written = 0;
+            continue;
+        }
+        if (written < 0) {
+            break;
+        }
+
+        /* skip what went out */
+        while (iovcnt > 0 && (size_t)written >= p_iov->iov_len) {
+            written -= (ssize_t)p_iov->iov_len;
+            p_iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            p_iov->iov_base = (char *)p_iov->iov_base + written;
+            p_iov->iov_len -= (size_t)written;
+        }
+    }
+    pthread_mutex_unlock(&mux->writemutex);
+
+    return written >= 0;
+}
+
+/** sends a control message on DLCI 0 with a value of up to 2 octets */
+static bool muxSendControl(ATMux *mux, uint8_t type, bool command,
+                           const uint8_t *value, size_t len)
+{
+    uint8_t info[4];
+
+    info[0] = (uint8_t)(type | (command ? MUX_CR : 0) | MUX_EA);
+    info[1] = (uint8_t)(len << 1 | MUX_EA);
+    if (len > 0) {
+        memcpy(info + 2, value, len);
+    }
+
+    return muxSend(mux, 0, MUX_UIH, true, info, 2 + len);
+}
+
+static bool muxSendMsc(ATMux *mux, int dlci, bool flowStopped)
+{
+    uint8_t value[2];
+
+    value[0] = (uint8_t)(dlci << 2 | MUX_CR | MUX_EA);
+    value[1] = (uint8_t)(MUX_V24_READY | (flowStopped ? MUX_V24_FC : 0));
+
+    return muxSendControl(mux, MUX_CTL_MSC, true, value, sizeof(value));
+}
+
+/** forgets a DLC, whose channel reads an end of file; called with mutex held */
+static void closeDlc(ATMux *mux, int dlci)
+{
+    ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+
+    if (p_dlc->fd >= 0) {
+        close(p_dlc->fd);
+        p_dlc->fd = -1;
+    }
+    free(p_dlc->backlog);
+    p_dlc->backlog = NULL;
+    p_dlc->backlogLen = 0;
+    p_dlc->throttled = false;
+    p_dlc->flowStopped = false;
+    p_dlc->state = DLC_CLOSED;
+}
+
+/** the port is gone or the mux closed down; called with mutex held */
+static void closeMux(ATMux *mux)
+{
+    int dlci;
+
+    for (dlci = 0; dlci <= MUX_MAX_DLCI; dlci++) {
+        closeDlc(mux, dlci);
+    }
+    mux->closed = true;
+    mux->cldPending = false;
+    pthread_cond_broadcast(&mux->cond);
+}
+
+/** takes in what the modem sent on an open DLC, keeping what the channel cannot */
+static void deliver(ATMux *mux, int dlci, const uint8_t *data, size_t len)
+{
+    ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+    uint8_t *backlog;
+    ssize_t sent = 0;
+
+    if (p_dlc->backlogLen == 0) {
+        do {
+            sent = send(p_dlc->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+
+        if (sent < 0) {
+            if (errno != EAGAIN) {
+                /* the channel is closed, which its poll tells */
+                return;
+            }
+            sent = 0;
+        }
+    }
+    data += sent;
+    len -= (size_t)sent;
+    if (len == 0) {
+        return;
+    }
+
+    if (p_dlc->backlogLen + len > MUX_MAX_BACKLOG) {
+        /* the modem ignores flow control, overrun as a UART would */
+        return;
+    }
+    backlog = realloc(p_dlc->backlog, p_dlc->backlogLen + len);
+    if (!backlog) {
+        return;
+    }
+    memcpy(backlog + p_dlc->backlogLen, data, len);
+    p_dlc->backlog = backlog;
+    p_dlc->backlogLen += len;
+
+    if (!p_dlc->throttled) {
+        p_dlc->throttled = true;
+        if (!muxSendMsc(mux, dlci, true)) {
+            closeMux(mux);
+        }
+    }
+}
+
+/** hands the backlog to a channel that can take it again */
+static void flushBacklog(ATMux *mux, int dlci)
+{
+    ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+    ssize_t sent;
+
+    do {
+        sent = send(p_dlc->fd, p_dlc->backlog, p_dlc->backlogLen,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent <= 0) {
+        return;
+    }
+    p_dlc->backlogLen -= (size_t)sent;
+    memmove(p_dlc->backlog, p_dlc->backlog + sent, p_dlc->backlogLen);
+
+    if (p_dlc->backlogLen == 0 && p_dlc->throttled) {
+        p_dlc->throttled = false;
+        if (!muxSendMsc(mux, dlci, false)) {
+            closeMux(mux);
+        }
+    }
+}
+
+/** a control message on DLCI 0; called with mutex held */
+static void handleControl(ATMux *mux, uint8_t type, const uint8_t *value, size_t len)
+{
+    bool command = (type & MUX_CR) != 0;
+    uint8_t kind = (uint8_t)(type & ~(MUX_CR | MUX_EA));
+    bool sent = true;
+
+    if (!command) {
+        /* answers to what we sent, of which CLD is waited for */
+        if (kind == MUX_CTL_CLD && mux->cldPending) {
+            closeMux(mux);
+        }
+        return;
+    }
+
+    switch (kind) {
+        case MUX_CTL_MSC:
+            if (len >= 2) {
+                int dlci = value[0] >> 2;
+                if (dlci > 0) {
+                    mux->dlcs[dlci].flowStopped = (value[1] & MUX_V24_FC) != 0;
+                }
+            }
+            sent = muxSendControl(mux, kind, false, value, len < 2 ? len : 2);
+            break;
+
+        case MUX_CTL_FCON:
+        case MUX_CTL_FCOFF:
+            mux->flowStopped = (kind == MUX_CTL_FCOFF);
+            sent = muxSendControl(mux, kind, false, NULL, 0);
+            break;
+
+        case MUX_CTL_CLD:
+            muxSendControl(mux, kind, false, NULL, 0);
+            closeMux(mux);
+            break;
+
+        default:
+            sent = muxSendControl(mux, MUX_CTL_NSC, false, &type, 1);
+            break;
+    }
+
+    if (!sent) {
+        closeMux(mux);
+    }
+}
+
+/** a frame from the modem; called with mutex held */
+static void handleFrame(ATMux *mux, const ATMuxFrame *p_frame)
+{
+    int dlci = p_frame->address >> 2;
+    ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+
+    switch (p_frame->control & ~MUX_PF) {
+        case MUX_UA:
+            if (p_dlc->state == DLC_OPENING) {
+                p_dlc->state = DLC_OPEN;
+            } else if (p_dlc->state == DLC_CLOSING) {
+                closeDlc(mux, dlci);
+            }
+            pthread_cond_broadcast(&mux->cond);
+            break;
+
+        case MUX_DM:
+            if (p_dlc->state != DLC_CLOSED) {
+                closeDlc(mux, dlci);
+                pthread_cond_broadcast(&mux->cond);
+            }
+            break;
+
+        case MUX_DISC:
+            if (!muxSend(mux, dlci, MUX_UA | MUX_PF, false, NULL, 0) || dlci == 0) {
+                closeMux(mux);
+            } else {
+                closeDlc(mux, dlci);
+                pthread_cond_broadcast(&mux->cond);
+            }
+            break;
+
+        case MUX_SABM:
+            /* the modem does not get to open DLCs */
+            if (!muxSend(mux, dlci, MUX_DM | MUX_PF, false, NULL, 0)) {
+                closeMux(mux);
+            }
+            break;
+
+        case MUX_UIH:
+        case MUX_UI:
+            if (dlci == 0) {
+                const uint8_t *p = p_frame->info;
+                const uint8_t *p_end = p + p_frame->len;
+
+                /* a type and an EA coded length per message */
+                while (p < p_end) {
+                    uint8_t type = *p++;
+                    size_t len = 0;
+                    unsigned shift = 0;
+                    while (p < p_end && shift < 16) {
+                        uint8_t octet = *p++;
+                        len |= (size_t)(octet >> 1) << shift;
+                        shift += 7;
+                        if (octet & MUX_EA) {
+                            break;
+                        }
+                    }
+                    if (len > (size_t)(p_end - p)) {
+                        break;
+                    }
+                    handleControl(mux, type, p, len);
+                    if (mux->closed) {
+                        break;
+                    }
+                    p += len;
+                }
+            } else if (p_dlc->state == DLC_OPEN && p_dlc->fd >= 0) {
+                deliver(mux, dlci, p_frame->info, p_frame->len);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/** reads and handles what the modem sent, returns false when the port is gone */
+static bool readPort(ATMux *mux)
+{
+    ssize_t count;
+    size_t consumed;
+    ATMuxFrame frame;
+
+    do {
+        count = read(mux->fd, mux->in + mux->inLen, mux->inCapacity - mux->inLen);
+    } while (count < 0 && errno == EINTR);
+
+    if (count == 0 || (count < 0 && errno != EAGAIN)) {
+        return false;
+    }
+    if (count < 0) {
+        return true;
+    }
+    mux->inLen += (size_t)count;
+
+    pthread_mutex_lock(&mux->mutex);
+    for (;;) {
+        bool found = muxParse(mux->in, mux->inLen, mux->frameSize, &frame, &consumed);
+
+        if (found) {
+            handleFrame(mux, &frame);
+        }
+        mux->inLen -= consumed;
+        memmove(mux->in, mux->in + consumed, mux->inLen);
+        if (!found || mux->closed) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mux->mutex);
+
+    return true;
+}
+
+/** sends what a channel wrote as UIH frames, or DISC once it is closed */
+static void readDlc(ATMux *mux, int dlci, int fd)
+{
+    uint8_t data[MUX_MAX_INFO];
+    ssize_t count;
+
+    do {
+        count = recv(fd, data, mux->frameSize, MSG_DONTWAIT);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        if (!muxSend(mux, dlci, MUX_UIH, true, data, (size_t)count)) {
+            /* rather than drop what the channel wrote, end it */
+            pthread_mutex_lock(&mux->mutex);
+            closeMux(mux);
+            pthread_mutex_unlock(&mux->mutex);
+        }
+        return;
+    }
+    if (count < 0 && errno == EAGAIN) {
+        return;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+    if (mux->dlcs[dlci].fd == fd) {
+        ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+
+        /* nobody is left to read the backlog */
+        close(fd);
+        p_dlc->fd = -1;
+        free(p_dlc->backlog);
+        p_dlc->backlog = NULL;
+        p_dlc->backlogLen = 0;
+        p_dlc->throttled = false;
+        p_dlc->state = DLC_CLOSING;
+        if (!muxSend(mux, dlci, MUX_DISC | MUX_PF, true, NULL, 0)) {
+            closeMux(mux);
+        }
+    }
+    pthread_mutex_unlock(&mux->mutex);
+}
+
+static void *muxLoop(void *arg)
+{
+    ATMux *mux = arg;
+    struct pollfd fds[2 + MUX_MAX_DLCI];
+    int dlcis[2 + MUX_MAX_DLCI];
+    nfds_t count;
+    nfds_t i;
+    int dlci;
+    int ret;
+
+    fds[0].fd = mux->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = mux->wakeupfd;
+    fds[1].events = POLLIN;
+
+    pthread_mutex_lock(&mux->mutex);
+    while (!mux->stopping && !mux->closed) {
+        count = 2;
+        for (dlci = 1; dlci <= MUX_MAX_DLCI; dlci++) {
+            const ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+
+            if (p_dlc->fd < 0) {
+                continue;
+            }
+            /* a stopped DLC is not read, so its channel blocks when writing */
+            fds[count].fd = p_dlc->fd;
+            fds[count].events = 0;
+            if (!mux->flowStopped && !p_dlc->flowStopped) {
+                fds[count].events |= POLLIN;
+            }
+            if (p_dlc->backlogLen > 0) {
+                fds[count].events |= POLLOUT;
+            }
+            dlcis[count] = dlci;
+            count++;
+        }
+        pthread_mutex_unlock(&mux->mutex);
+
+        ret = poll(fds, count, -1);
+
+        if (ret < 0 && errno != EINTR) {
+            pthread_mutex_lock(&mux->mutex);
+            closeMux(mux);
+            break;
+        }
+        if (ret > 0 && fds[1].revents) {
+            uint64_t value;
+            while (read(mux->wakeupfd, &value, sizeof(value)) < 0 && errno == EINTR) {
+            }
+        }
+        if (ret > 0 && fds[0].revents) {
+            if (!readPort(mux)) {
+                pthread_mutex_lock(&mux->mutex);
+                closeMux(mux);
+                break;
+            }
+        }
+        for (i = 2; ret > 0 && i < count; i++) {
+            bool current;
+
+            if (!fds[i].revents) {
+                continue;
+            }
+            dlci = dlcis[i];
+            pthread_mutex_lock(&mux->mutex);
+            current = (mux->dlcs[dlci].fd == fds[i].fd);
+            if (current && (fds[i].revents & POLLOUT)) {
+                flushBacklog(mux, dlci);
+            }
+            pthread_mutex_unlock(&mux->mutex);
+
+            /* unless closed by a frame read above */
+            if (current && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                readDlc(mux, dlci, fds[i].fd);
+            }
+        }
+        pthread_mutex_lock(&mux->mutex);
+    }
+    pthread_mutex_unlock(&mux->mutex);
+
+    return NULL;
+}
+
+/**
+ * opens a DLC by sending SABM until UA, DM or the give up
+ * called with mutex held
+ */
+static ATReturn connectDlc(ATMux *mux, int dlci)
+{
+    ATMuxDlc *p_dlc = &mux->dlcs[dlci];
+    struct timespec ts;
+    int i;
+
+    p_dlc->state = DLC_OPENING;
+    for (i = 0; i < MUX_N2 && p_dlc->state == DLC_OPENING && !mux->closed; i++) {
+        if (!muxSend(mux, dlci, MUX_SABM | MUX_PF, true, NULL, 0)) {
+            break;
+        }
+        setTimespecRelative(&ts, MUX_T1_MSEC);
+        while (p_dlc->state == DLC_OPENING && !mux->closed) {
+            if (pthread_cond_timedwait(&mux->cond, &mux->mutex, &ts) == ETIMEDOUT) {
+                break;
+            }
+        }
+    }
+
+    switch (p_dlc->state) {
+        case DLC_OPEN:
+            return AT_SUCCESS;
+        case DLC_OPENING:
+            p_dlc->state = DLC_CLOSED;
+            return mux->closed ? AT_ERROR_CHANNEL_CLOSED : AT_ERROR_TIMEOUT;
+        case DLC_CLOSED:
+        case DLC_CLOSING:
+        default:
+            return mux->closed ? AT_ERROR_CHANNEL_CLOSED : AT_ERROR_GENERIC;
+    }
+}
+
+static void freeMux(ATMux *mux)
+{
+    if (mux->wakeupfd >= 0) {
+        close(mux->wakeupfd);
+    }
+    pthread_mutex_destroy(&mux->mutex);
+    pthread_mutex_destroy(&mux->writemutex);
+    pthread_cond_destroy(&mux->cond);
+    free(mux->in);
+    free(mux);
+}
+
+/**
+ * Starts multiplexing "fd", a port the modem has switched to TS 27.010
+ * basic option framing, eg by AT+CMUX=0 on a channel that was detached
+ * then, and opens DLCI 0.
+ *
+ * "frameSize" is N1 as given to AT+CMUX, 0 for its default of 31.
+ * The port stays the caller's; at_mux_destroy() does not close it. It
+ * may be non-blocking, frames are still written whole. Once reading or
+ * writing it fails the mux closes down and its channels read an end of
+ * file.
+ *
+ * Returns NULL if the mux could not be started or the modem did not
+ * answer.
+ */
+ATMux* at_mux_create(int fd, size_t frameSize)
+{
+    ATMux *mux;
+    pthread_condattr_t condattr;
+    ATReturn err;
+    int dlci;
+    int ret;
+
+    if (fd < 0 || frameSize > MUX_MAX_INFO) {
+        return NULL;
+    }
+    if (frameSize == 0) {
+        frameSize = MUX_DEFAULT_FRAME_SIZE;
+    }
+
+    mux = calloc(1, sizeof(ATMux));
+    if (!mux) {
+        return NULL;
+    }
+    mux->fd = fd;
+    mux->frameSize = frameSize;
+    for (dlci = 0; dlci <= MUX_MAX_DLCI; dlci++) {
+        mux->dlcs[dlci].fd = -1;
+    }
+    pthread_mutex_init(&mux->mutex, NULL);
+    pthread_mutex_init(&mux->writemutex, NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mux->cond, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    /* room for two whole frames, so one is never cut by the buffer end */
+    mux->inCapacity = 2 * (MUX_MAX_HEADER + frameSize + 2);
+    mux->in = malloc(mux->inCapacity);
+    mux->wakeupfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!mux->in || mux->wakeupfd < 0) {
+        freeMux(mux);
+        return NULL;
+    }
+
+    ret = pthread_create(&mux->tid, NULL, muxLoop, mux);
+    if (ret != 0) {
+        freeMux(mux);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+    err = connectDlc(mux, 0);
+    if (err != AT_SUCCESS) {
+        mux->stopping = true;
+        wakeup(mux);
+    }
+    pthread_mutex_unlock(&mux->mutex);
+
+    if (err != AT_SUCCESS) {
+        pthread_join(mux->tid, NULL);
+        freeMux(mux);
+        return NULL;
+    }
+
+    return mux;
+}
+
+/**
+ * Opens DLC "dlci", 1 to 63, for "atch": on success atch->fd is a socket
+ * carrying the DLC, on which the channel is attached as usual with
+ * at_attach() or at_attach_to_engine(). Closing the channel closes the
+ * DLC.
+ *
+ * Data to the modem is held back while it asks for flow control, data
+ * from it while the channel does not read, up to 64 KiB.
+ */
+ATReturn at_mux_open_channel(ATMux* mux, int dlci, ATChannel* atch)
+{
+    int sv[2];
+    struct timespec ts;
+    ATReturn err;
+
+    if (!mux || !atch || dlci < 1 || dlci > MUX_MAX_DLCI) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+
+    /* give a DLC that is being closed a chance to finish */
+    setTimespecRelative(&ts, MUX_T1_MSEC);
+    while (mux->dlcs[dlci].state == DLC_CLOSING && !mux->closed) {
+        if (pthread_cond_timedwait(&mux->cond, &mux->mutex, &ts) == ETIMEDOUT) {
+            closeDlc(mux, dlci);
+        }
+    }
+    if (mux->closed) {
+        pthread_mutex_unlock(&mux->mutex);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+    if (mux->dlcs[dlci].state != DLC_CLOSED) {
+        pthread_mutex_unlock(&mux->mutex);
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        pthread_mutex_unlock(&mux->mutex);
+        return AT_ERROR_GENERIC;
+    }
+
+    err = connectDlc(mux, dlci);
+    if (err != AT_SUCCESS) {
+        pthread_mutex_unlock(&mux->mutex);
+        close(sv[0]);
+        close(sv[1]);
+        return err;
+    }
+    mux->dlcs[dlci].fd = sv[1];
+    if (!muxSendMsc(mux, dlci, false)) {
+        closeMux(mux);
+        pthread_mutex_unlock(&mux->mutex);
+        close(sv[0]);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+    wakeup(mux);
+    pthread_mutex_unlock(&mux->mutex);
+
+    atch->fd = sv[0];
+    return AT_SUCCESS;
+}
+
+/**
+ * Closes the mux down with CLD, which returns the modem to AT commands
+ * on the port, and stops it. Channels still open on it read an end of
+ * file.
+ */
+ATReturn at_mux_destroy(ATMux* mux)
+{
+    struct timespec ts;
+    int dlci;
+
+    if (!mux) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    pthread_mutex_lock(&mux->mutex);
+    if (!mux->closed) {
+        mux->cldPending = true;
+        if (muxSendControl(mux, MUX_CTL_CLD, true, NULL, 0)) {
+            setTimespecRelative(&ts, MUX_T1_MSEC);
+            while (mux->cldPending) {
+                if (pthread_cond_timedwait(&mux->cond, &mux->mutex, &ts) == ETIMEDOUT) {
+                    break;
+                }
+            }
+        }
+    }
+    mux->stopping = true;
+    wakeup(mux);
+    pthread_mutex_unlock(&mux->mutex);
+
+    pthread_join(mux->tid, NULL);
+
+    for (dlci = 0; dlci <= MUX_MAX_DLCI; dlci++) {
+        closeDlc(mux, dlci);
+    }
+    freeMux(mux);
+
+    return AT_SUCCESS;
+}
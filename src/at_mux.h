@@ -0,0 +1,81 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_MUX_H
+#define AT_MUX_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* 3GPP TS 27.010 basic option framing */
+#define MUX_FLAG        0xF9
+#define MUX_EA          0x01    /* the last octet of an address or length */
+#define MUX_CR          0x02    /* command/response */
+#define MUX_PF          0x10    /* poll/final */
+
+/* frame types, the control field without MUX_PF */
+#define MUX_SABM        0x2F
+#define MUX_UA          0x63
+#define MUX_DM          0x0F
+#define MUX_DISC        0x43
+#define MUX_UIH         0xEF
+#define MUX_UI          0x03
+
+/* the opening flag, address, control and a 2 octet length */
+#define MUX_MAX_HEADER  5
+#define MUX_MAX_INFO    32767
+
+/** a frame parsed by muxParse(), "info" points into its buffer */
+typedef struct {
+    uint8_t address;
+    uint8_t control;
+    const uint8_t *info;
+    size_t len;
+} ATMuxFrame;
+
+/**
+ * writes the opening flag, address, control and length of a frame
+ * carrying "len" octets to "header", returning how many it took
+ */
+size_t muxHeader(uint8_t *header, uint8_t address, uint8_t control, size_t len);
+
+/**
+ * returns the FCS of a frame whose header, without the opening flag, is
+ * "header"; "info" counts for UI frames only, and is NULL for the rest
+ */
+uint8_t muxFcs(const uint8_t *header, size_t headerLen, const uint8_t *info, size_t len);
+
+/**
+ * looks for a frame of at most "maxLen" octets of information in "buf",
+ * skipping whatever is not one
+ *
+ * returns true and the frame if there is one; either way *p_consumed
+ * tells how much of "buf" is done with. The closing flag of a frame is
+ * left in the buffer since it may open the next one.
+ */
+bool muxParse(const uint8_t *buf, size_t len, size_t maxLen,
+              ATMuxFrame *p_frame, size_t *p_consumed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_MUX_H */
@@ -0,0 +1,307 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _POSIX_C_SOURCE (200809L)
+#include <features.h>
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "at_response.h"
+
+/*
+ * A response lives in a single arena: the header below, with the public
+ * ATResponse first, followed by the ATLine entries and their strings in the
+ * order they were received. Growing the arena may move it, in which case the
+ * internal pointers are rebased.
+ */
+
+#define ARENA_INITIAL_CAPACITY      ((size_t) 256)
+#define ARENA_RECYCLE_MAX_CAPACITY  ((size_t) (4 * 1024))
+#define POOL_MAX_ARENAS             8
+
+typedef struct ATResponseArena {
+    ATResponse response;        /* must be first, this is what callers see */
+    ATResponsePool *pool;
+    ATLine *p_last;             /* tail of response.p_intermediates */
+    size_t size;                /* bytes used, including this header */
+    size_t capacity;            /* bytes allocated */
+    struct ATResponseArena *p_nextFree;
+} ATResponseArena;
+
+struct ATResponsePool {
+    pthread_mutex_t mutex;
+    int refs;                   /* the channel and every live response */
+    int freeCount;
+    ATResponseArena *p_free;
+};
+
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~((size_t) (a) - 1))
+
+ATResponsePool *responsePoolNew(void)
+{
+    ATResponsePool *pool;
+
+    pool = (ATResponsePool *) calloc(1, sizeof(ATResponsePool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->refs = 1;
+
+    return pool;
+}
+
+/** assumes pool->mutex is held, returns true if the pool must be destroyed */
+static bool poolUnref(ATResponsePool *pool)
+{
+    return --pool->refs == 0;
+}
+
+static void poolDestroy(ATResponsePool *pool)
+{
+    while (pool->p_free != NULL) {
+        ATResponseArena *arena = pool->p_free;
+        pool->p_free = arena->p_nextFree;
+        free(arena);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+void responsePoolRelease(ATResponsePool *pool)
+{
+    bool destroy;
+
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    destroy = poolUnref(pool);
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (destroy) {
+        poolDestroy(pool);
+    }
+}
+
+ATResponse *responseNew(ATResponsePool *pool)
+{
+    ATResponseArena *arena = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->p_free != NULL) {
+        arena = pool->p_free;
+        pool->p_free = arena->p_nextFree;
+        pool->freeCount--;
+    }
+    pool->refs++;
+    pthread_mutex_unlock(&pool->mutex);
+
+    if (arena == NULL) {
+        arena = (ATResponseArena *) malloc(ARENA_INITIAL_CAPACITY);
+        if (arena == NULL) {
+            responsePoolRelease(pool);
+            return NULL;
+        }
+        arena->capacity = ARENA_INITIAL_CAPACITY;
+    }
+
+    memset(&arena->response, 0, sizeof(arena->response));
+    arena->pool = pool;
+    arena->p_last = NULL;
+    arena->size = ALIGN_UP(sizeof(ATResponseArena), _Alignof(ATLine));
+    arena->p_nextFree = NULL;
+
+    return &arena->response;
+}
+
+static uintptr_t rebase(uintptr_t p, uintptr_t oldBase, uintptr_t newBase)
+{
+    return p - oldBase + newBase;
+}
+
+/**
+ * Reserves "bytes" at the end of the arena, moving it if needed
+ * returns the offset of the reserved space, or 0 on allocation failure
+ */
+static size_t arenaReserve(ATResponseArena **p_arena, size_t bytes)
+{
+    ATResponseArena *arena = *p_arena;
+    size_t offset = arena->size;
+
+    if (arena->capacity - arena->size < bytes) {
+        uintptr_t oldBase = (uintptr_t) arena;
+        uintptr_t newBase;
+        size_t capacity = arena->capacity * 2;
+        ATLine *p_line;
+
+        while (capacity - arena->size < bytes) {
+            capacity *= 2;
+        }
+
+        arena = (ATResponseArena *) realloc(arena, capacity);
+        if (arena == NULL) {
+            return 0;
+        }
+        arena->capacity = capacity;
+
+        newBase = (uintptr_t) arena;
+        if (newBase != oldBase) {
+            ATResponse *p_response = &arena->response;
+
+            if (p_response->finalResponse != NULL) {
+                p_response->finalResponse = (char *) rebase(
+                        (uintptr_t) p_response->finalResponse, oldBase, newBase);
+            }
+            if (p_response->p_intermediates != NULL) {
+                p_response->p_intermediates = (ATLine *) rebase(
+                        (uintptr_t) p_response->p_intermediates, oldBase, newBase);
+                arena->p_last = (ATLine *) rebase(
+                        (uintptr_t) arena->p_last, oldBase, newBase);
+            }
+            for (p_line = p_response->p_intermediates; p_line != NULL; p_line = p_line->p_next) {
+                p_line->line = (char *) rebase((uintptr_t) p_line->line, oldBase, newBase);
+                if (p_line->p_next != NULL) {
+                    p_line->p_next = (ATLine *) rebase(
+                            (uintptr_t) p_line->p_next, oldBase, newBase);
+                }
+            }
+        }
+        *p_arena = arena;
+    }
+
+    arena->size = ALIGN_UP(offset + bytes, _Alignof(ATLine));
+
+    return offset;
+}
+
+bool responseAddIntermediate(ATResponse **pp_response, const char *line, size_t len)
+{
+    ATResponseArena *arena = (ATResponseArena *) *pp_response;
+    size_t offset;
+    ATLine *p_new;
+
+    offset = arenaReserve(&arena, sizeof(ATLine) + len + 1);
+    if (offset == 0) {
+        return false;
+    }
+
+    p_new = (ATLine *) (void *) ((char *) arena + offset);
+    p_new->p_next = NULL;
+    p_new->line = memcpy(p_new + 1, line, len);
+    p_new->line[len] = '\0';
+    p_new->len = len;
+
+    if (arena->p_last == NULL) {
+        arena->response.p_intermediates = p_new;
+    } else {
+        arena->p_last->p_next = p_new;
+    }
+    arena->p_last = p_new;
+
+    *pp_response = &arena->response;
+
+    return true;
+}
+
+bool responseSetFinal(ATResponse **pp_response, const char *line)
+{
+    ATResponseArena *arena = (ATResponseArena *) *pp_response;
+    size_t len = strlen(line) + 1;
+    size_t offset;
+
+    offset = arenaReserve(&arena, len);
+    if (offset == 0) {
+        return false;
+    }
+
+    arena->response.finalResponse = memcpy((char *) arena + offset, line, len);
+
+    *pp_response = &arena->response;
+
+    return true;
+}
+
+ATResponse *responseCopy(const ATResponse *p_response)
+{
+    const ATResponseArena *source = (const ATResponseArena *) p_response;
+    ATResponse *p_copy;
+    const ATLine *p_line;
+
+    p_copy = responseNew(source->pool);
+    if (p_copy == NULL) {
+        return NULL;
+    }
+
+    for (p_line = p_response->p_intermediates; p_line != NULL; p_line = p_line->p_next) {
+        if (!responseAddIntermediate(&p_copy, p_line->line, p_line->len)) {
+            at_response_free(p_copy);
+            return NULL;
+        }
+    }
+    if (p_response->finalResponse != NULL
+        && !responseSetFinal(&p_copy, p_response->finalResponse)) {
+        at_response_free(p_copy);
+        return NULL;
+    }
+    p_copy->success = p_response->success;
+    p_copy->timing = p_response->timing;
+
+    return p_copy;
+}
+
+/**
+ * Frees a response and everything it points to
+ * The arena goes back to the channel it came from when there is room
+ */
+ATReturn at_response_free(ATResponse *p_response)
+{
+    ATResponseArena *arena = (ATResponseArena *) p_response;
+    ATResponsePool *pool;
+    bool destroy;
+
+    if (p_response == NULL) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    pool = arena->pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->refs > 1
+        && pool->freeCount < POOL_MAX_ARENAS
+        && arena->capacity <= ARENA_RECYCLE_MAX_CAPACITY
+    ) {
+        arena->p_nextFree = pool->p_free;
+        pool->p_free = arena;
+        pool->freeCount++;
+        arena = NULL;
+    }
+    destroy = poolUnref(pool);
+    pthread_mutex_unlock(&pool->mutex);
+
+    free(arena);
+    if (destroy) {
+        poolDestroy(pool);
+    }
+
+    return AT_SUCCESS;
+}
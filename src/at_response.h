@@ -0,0 +1,57 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_RESPONSE_H
+#define AT_RESPONSE_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "atchannel.h"
+
+/** a per-channel cache of response arenas for reuse */
+typedef struct ATResponsePool ATResponsePool;
+
+ATResponsePool *responsePoolNew(void);
+/** drops the channel reference, the pool goes away with its last response */
+void responsePoolRelease(ATResponsePool *pool);
+
+/** returns an empty response, NULL on allocation failure */
+ATResponse *responseNew(ATResponsePool *pool);
+
+/**
+ * append an intermediate line of "len" bytes or set the final response
+ * these may move the response, *pp_response is updated
+ * return false on allocation failure
+ */
+bool responseAddIntermediate(ATResponse **pp_response, const char *line, size_t len);
+bool responseSetFinal(ATResponse **pp_response, const char *line);
+
+/**
+ * returns a copy of "p_response" from the pool it came from, NULL on
+ * allocation failure
+ */
+ATResponse *responseCopy(const ATResponse *p_response);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_RESPONSE_H */
@@ -0,0 +1,172 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_sched.h"
+#include "misc.h"
+
+typedef struct {
+    char *prefix;
+    size_t len;
+    ATPriority priority;
+} ATPriorityRule;
+
+typedef struct {
+    ATPriorityStats summary;    /* meanWaitNsec is filled in by schedulerGetStats() */
+    uint64_t totalWaitNsec;
+} ATClassStats;
+
+struct ATScheduler {
+    ATPriorityRule *rules;
+    size_t ruleCount;
+    ATClassStats classes[AT_PRIORITY_COUNT];
+};
+
+ATScheduler *schedulerNew(void)
+{
+    return (ATScheduler *) calloc(1, sizeof(ATScheduler));
+}
+
+void schedulerFree(ATScheduler *sched)
+{
+    size_t i;
+
+    if (sched == NULL) {
+        return;
+    }
+
+    for (i = 0; i < sched->ruleCount; i++) {
+        free(sched->rules[i].prefix);
+    }
+    free(sched->rules);
+    free(sched);
+}
+
+bool schedulerSetRule(ATScheduler *sched, const char *prefix, ATPriority priority)
+{
+    ATPriorityRule *rules;
+    size_t i;
+
+    for (i = 0; i < sched->ruleCount; i++) {
+        if (0 == strcmp(sched->rules[i].prefix, prefix)) {
+            break;
+        }
+    }
+
+    if (i < sched->ruleCount) {
+        if (priority != AT_PRIORITY_NORMAL) {
+            sched->rules[i].priority = priority;
+            return true;
+        }
+        free(sched->rules[i].prefix);
+        sched->rules[i] = sched->rules[--sched->ruleCount];
+        return true;
+    }
+
+    if (priority == AT_PRIORITY_NORMAL) {
+        return true;
+    }
+
+    rules = realloc(sched->rules, (sched->ruleCount + 1) * sizeof(ATPriorityRule));
+    if (rules == NULL) {
+        return false;
+    }
+    sched->rules = rules;
+
+    rules[sched->ruleCount].prefix = strdup(prefix);
+    if (rules[sched->ruleCount].prefix == NULL) {
+        return false;
+    }
+    rules[sched->ruleCount].len = strlen(prefix);
+    rules[sched->ruleCount].priority = priority;
+    sched->ruleCount++;
+
+    return true;
+}
+
+ATPriority schedulerClassify(const ATScheduler *sched, const char *command)
+{
+    ATPriority priority = AT_PRIORITY_NORMAL;
+    size_t longest = 0;
+    size_t i;
+
+    for (i = 0; i < sched->ruleCount; i++) {
+        const ATPriorityRule *p_rule = &sched->rules[i];
+
+        if (p_rule->len >= longest && strStartsWith(command, p_rule->prefix)) {
+            priority = p_rule->priority;
+            longest = p_rule->len;
+        }
+    }
+
+    return priority;
+}
+
+void schedulerQueued(ATScheduler *sched, ATPriority priority)
+{
+    ATPriorityStats *p_summary = &sched->classes[priority].summary;
+
+    p_summary->submitted++;
+    p_summary->depth++;
+    if (p_summary->depth > p_summary->maxDepth) {
+        p_summary->maxDepth = p_summary->depth;
+    }
+}
+
+void schedulerDequeued(ATScheduler *sched, ATPriority priority, uint64_t waitNsec)
+{
+    ATClassStats *p_class = &sched->classes[priority];
+
+    p_class->summary.depth--;
+    p_class->summary.dequeued++;
+    p_class->totalWaitNsec += waitNsec;
+    if (waitNsec > p_class->summary.maxWaitNsec) {
+        p_class->summary.maxWaitNsec = waitNsec;
+    }
+}
+
+void schedulerGetStats(const ATScheduler *sched, ATPriorityStats *p_stats)
+{
+    size_t i;
+
+    for (i = 0; i < AT_PRIORITY_COUNT; i++) {
+        const ATClassStats *p_class = &sched->classes[i];
+
+        p_stats[i] = p_class->summary;
+        if (p_class->summary.dequeued > 0) {
+            p_stats[i].meanWaitNsec = p_class->totalWaitNsec / p_class->summary.dequeued;
+        }
+    }
+}
+
+void schedulerResetStats(ATScheduler *sched)
+{
+    size_t i;
+
+    for (i = 0; i < AT_PRIORITY_COUNT; i++) {
+        ATClassStats *p_class = &sched->classes[i];
+        size_t depth = p_class->summary.depth;
+
+        memset(p_class, 0, sizeof(*p_class));
+        /* the commands still queued will leave it */
+        p_class->summary.depth = depth;
+        p_class->summary.maxDepth = depth;
+    }
+}
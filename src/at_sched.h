@@ -0,0 +1,62 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_SCHED_H
+#define AT_SCHED_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "atchannel.h"
+
+/**
+ * the priority classes of a channel's commands, by prefix, and the
+ * counters of each class, not thread safe
+ */
+typedef struct ATScheduler ATScheduler;
+
+/** returns a scheduler with every command NORMAL, NULL on allocation failure */
+ATScheduler *schedulerNew(void);
+void schedulerFree(ATScheduler *sched);
+
+/**
+ * puts the commands starting with "prefix" in class "priority", the
+ * longest matching prefix decides; AT_PRIORITY_NORMAL removes the rule
+ * returns false on allocation failure
+ */
+bool schedulerSetRule(ATScheduler *sched, const char *prefix, ATPriority priority);
+
+ATPriority schedulerClassify(const ATScheduler *sched, const char *command);
+
+/** accounts for a command of "priority" joining the queue */
+void schedulerQueued(ATScheduler *sched, ATPriority priority);
+
+/** accounts for a command of "priority" leaving the queue after "waitNsec" */
+void schedulerDequeued(ATScheduler *sched, ATPriority priority, uint64_t waitNsec);
+
+/** fills AT_PRIORITY_COUNT entries of "p_stats" */
+void schedulerGetStats(const ATScheduler *sched, ATPriorityStats *p_stats);
+void schedulerResetStats(ATScheduler *sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_SCHED_H */
@@ -0,0 +1,846 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _POSIX_C_SOURCE (200809L)
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "atchannel.h"
+#include "at_sms.h"
+
+#define SMS_ESC                 0x1B
+#define SMS_MAX_OCTETS          140     /* of user data, its header included */
+#define SMS_MAX_ADDRESS_DIGITS  20
+#define SMS_MAX_SCA_OCTETS      11      /* of the SMSC address, its type included */
+
+/* the first octet of a TPDU */
+#define SMS_MTI_MASK            0x03
+#define SMS_MTI_DELIVER         0x00
+#define SMS_MTI_SUBMIT          0x01
+#define SMS_MTI_STATUS_REPORT   0x02
+#define SMS_VPF_SHIFT           3
+#define SMS_UDHI                0x40
+
+/* type of address, the type of number bits */
+#define SMS_TON_MASK            0x70
+#define SMS_TON_INTERNATIONAL   0x10
+#define SMS_TON_ALPHANUMERIC    0x50
+#define SMS_TOA_INTERNATIONAL   0x91
+#define SMS_TOA_UNKNOWN         0x81
+
+/* user data header information elements */
+#define SMS_IEI_CONCAT_8        0x00
+#define SMS_IEI_CONCAT_16       0x08
+
+/* 3GPP TS 23.038 default alphabet, ESC decodes as a space when alone */
+static const uint16_t s_gsmDefault[128] = {
+    0x0040, 0x00A3, 0x0024, 0x00A5, 0x00E8, 0x00E9, 0x00F9, 0x00EC,
+    0x00F2, 0x00C7, 0x000A, 0x00D8, 0x00F8, 0x000D, 0x00C5, 0x00E5,
+    0x0394, 0x005F, 0x03A6, 0x0393, 0x039B, 0x03A9, 0x03A0, 0x03A8,
+    0x03A3, 0x0398, 0x039E, 0x00A0, 0x00C6, 0x00E6, 0x00DF, 0x00C9,
+    0x0020, 0x0021, 0x0022, 0x0023, 0x00A4, 0x0025, 0x0026, 0x0027,
+    0x0028, 0x0029, 0x002A, 0x002B, 0x002C, 0x002D, 0x002E, 0x002F,
+    0x0030, 0x0031, 0x0032, 0x0033, 0x0034, 0x0035, 0x0036, 0x0037,
+    0x0038, 0x0039, 0x003A, 0x003B, 0x003C, 0x003D, 0x003E, 0x003F,
+    0x00A1, 0x0041, 0x0042, 0x0043, 0x0044, 0x0045, 0x0046, 0x0047,
+    0x0048, 0x0049, 0x004A, 0x004B, 0x004C, 0x004D, 0x004E, 0x004F,
+    0x0050, 0x0051, 0x0052, 0x0053, 0x0054, 0x0055, 0x0056, 0x0057,
+    0x0058, 0x0059, 0x005A, 0x00C4, 0x00D6, 0x00D1, 0x00DC, 0x00A7,
+    0x00BF, 0x0061, 0x0062, 0x0063, 0x0064, 0x0065, 0x0066, 0x0067,
+    0x0068, 0x0069, 0x006A, 0x006B, 0x006C, 0x006D, 0x006E, 0x006F,
+    0x0070, 0x0071, 0x0072, 0x0073, 0x0074, 0x0075, 0x0076, 0x0077,
+    0x0078, 0x0079, 0x007A, 0x00E4, 0x00F6, 0x00F1, 0x00FC, 0x00E0,
+};
+
+/* the default alphabet extension table, the septets that follow an ESC */
+static const struct {
+    uint8_t septet;
+    uint16_t cp;
+} s_gsmExtension[] = {
+    { 0x0A, 0x000C }, { 0x14, 0x005E }, { 0x28, 0x007B }, { 0x29, 0x007D },
+    { 0x2F, 0x005C }, { 0x3C, 0x005B }, { 0x3D, 0x007E }, { 0x3E, 0x005D },
+    { 0x40, 0x007C }, { 0x65, 0x20AC },
+};
+
+/* the semi-octets of an address */
+static const char s_bcdDigits[] = "0123456789*#abc";
+
+/* the hex digits of the scalar path, 0xFF for the rest */
+static const uint8_t s_hexValues[256] = {
+    ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+    ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+    ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+    ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F,
+};
+
+/* the digits that are left after the vector loop, or everything without one */
+static bool hexDecodeScalar(const char *hex, size_t len, uint8_t *out)
+{
+    /* the table holds the value plus 0x10, so that 0 marks a non-digit */
+    for (; len >= 2; hex += 2, len -= 2) {
+        unsigned int hi = s_hexValues[(unsigned char) hex[0]];
+        unsigned int lo = s_hexValues[(unsigned char) hex[1]];
+
+        if (hi == 0 || lo == 0) {
+            return false;
+        }
+        *out++ = (uint8_t) (((hi & 0x0F) << 4) | (lo & 0x0F));
+    }
+
+    return true;
+}
+
+#if defined(__SSE2__)
+/* the values of the 16 hex digits in "x", and whether they all are ones */
+static inline __m128i hexNibbles(__m128i x, __m128i *p_valid)
+{
+    const __m128i digit = _mm_sub_epi8(x, _mm_set1_epi8('0'));
+    const __m128i letter = _mm_sub_epi8(_mm_or_si128(x, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    /* unsigned x <= n as min(x, n) == x */
+    const __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    const __m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(5)), letter);
+
+    *p_valid = _mm_and_si128(*p_valid, _mm_or_si128(isDigit, isLetter));
+
+    return _mm_or_si128(_mm_and_si128(isDigit, digit),
+                        _mm_andnot_si128(isDigit, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+/* the 8 octets of the 16 nibbles in "n", one per 16 bit lane */
+static inline __m128i hexCombine(__m128i n)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00FF)), 4),
+                        _mm_srli_epi16(n, 8));
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+/* the values of the 16 hex digits in "x", and whether they all are ones */
+static inline uint8x16_t hexNibbles(uint8x16_t x, uint8x16_t *p_valid)
+{
+    const uint8x16_t digit = vsubq_u8(x, vdupq_n_u8('0'));
+    const uint8x16_t letter = vsubq_u8(vorrq_u8(x, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    const uint8x16_t isDigit = vcleq_u8(digit, vdupq_n_u8(9));
+    const uint8x16_t isLetter = vcleq_u8(letter, vdupq_n_u8(5));
+
+    *p_valid = vandq_u8(*p_valid, vorrq_u8(isDigit, isLetter));
+
+    return vbslq_u8(isDigit, digit, vaddq_u8(letter, vdupq_n_u8(10)));
+}
+#endif
+
+bool smsHexDecode(const char *hex, size_t len, uint8_t *out)
+{
+    if (len % 2 != 0) {
+        return false;
+    }
+
+#if defined(__SSE2__)
+    while (len >= 2 * sizeof(__m128i)) {
+        __m128i valid = _mm_set1_epi8(-1);
+        __m128i n0 = hexNibbles(_mm_loadu_si128((const __m128i *) (const void *) hex), &valid);
+        __m128i n1 = hexNibbles(_mm_loadu_si128((const __m128i *) (const void *) (hex + 16)), &valid);
+
+        if (_mm_movemask_epi8(valid) != 0xFFFF) {
+            return false;
+        }
+        _mm_storeu_si128((__m128i *) (void *) out, _mm_packus_epi16(hexCombine(n0), hexCombine(n1)));
+        hex += 2 * sizeof(__m128i);
+        len -= 2 * sizeof(__m128i);
+        out += sizeof(__m128i);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    while (len >= 2 * sizeof(uint8x16_t)) {
+        /* the high nibbles land in val[0], the low ones in val[1] */
+        uint8x16x2_t x = vld2q_u8((const uint8_t *) (const void *) hex);
+        uint8x16_t valid = vdupq_n_u8(0xFF);
+        uint8x16_t hi = hexNibbles(x.val[0], &valid);
+        uint8x16_t lo = hexNibbles(x.val[1], &valid);
+
+        if (vminvq_u8(valid) == 0) {
+            return false;
+        }
+        vst1q_u8(out, vorrq_u8(vshlq_n_u8(hi, 4), lo));
+        hex += 2 * sizeof(uint8x16_t);
+        len -= 2 * sizeof(uint8x16_t);
+        out += sizeof(uint8x16_t);
+    }
+#endif
+
+    return hexDecodeScalar(hex, len, out);
+}
+
+void smsHexEncode(const uint8_t *in, size_t len, char *hex)
+{
+    static const char digits[] = "0123456789ABCDEF";
+
+    for (; len > 0; in++, len--) {
+        *hex++ = digits[*in >> 4];
+        *hex++ = digits[*in & 0x0F];
+    }
+}
+
+/* up to 8 septets of the up to 7 octets at "in", a word at a time */
+static inline void unpack7Group(const uint8_t *in, size_t octets, uint8_t *out, size_t count)
+{
+    uint64_t x = 0;
+    size_t i;
+
+    for (i = 0; i < octets; i++) {
+        x |= (uint64_t) in[i] << (8 * i);
+    }
+    for (i = 0; i < count; i++) {
+        out[i] = (uint8_t) ((x >> (7 * i)) & 0x7F);
+    }
+}
+
+void smsUnpack7(const uint8_t *in, size_t count, uint8_t *out)
+{
+    /* every 7 octets hold 8 whole septets, the loops unroll to shifts */
+    for (; count >= 8; in += 7, out += 8, count -= 8) {
+        unpack7Group(in, 7, out, 8);
+    }
+    if (count > 0) {
+        unpack7Group(in, (count * 7 + 7) / 8, out, count);
+    }
+}
+
+void smsPack7(const uint8_t *in, size_t count, size_t offset, uint8_t *out)
+{
+    size_t bit = offset * 7;
+    size_t i;
+
+    for (i = 0; i < count; i++, bit += 7) {
+        size_t octet = bit / 8;
+        unsigned int shift = (unsigned int) (bit % 8);
+        unsigned int septet = in[i] & 0x7Fu;
+
+        out[octet] = (uint8_t) ((out[octet] & ((1u << shift) - 1)) | (septet << shift));
+        if (shift > 1) {
+            out[octet + 1] = (uint8_t) (septet >> (8 - shift));
+        }
+    }
+}
+
+/* writes "cp" as UTF-8 to "out", returning how many bytes it took */
+static size_t putUtf8(uint32_t cp, char *out)
+{
+    if (cp < 0x80) {
+        out[0] = (char) cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char) (0xC0 | (cp >> 6));
+        out[1] = (char) (0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char) (0xE0 | (cp >> 12));
+        out[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char) (0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char) (0xF0 | (cp >> 18));
+    out[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char) (0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/**
+ * reads the UTF-8 character at "s", of the "len" bytes left, returning
+ * how many bytes it took, or 0 if it is not valid
+ */
+static size_t getUtf8(const char *s, size_t len, uint32_t *p_cp)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    uint32_t cp;
+    size_t n;
+    size_t i;
+
+    if (p[0] < 0x80) {
+        *p_cp = p[0];
+        return 1;
+    } else if ((p[0] & 0xE0) == 0xC0) {
+        cp = p[0] & 0x1Fu;
+        n = 2;
+    } else if ((p[0] & 0xF0) == 0xE0) {
+        cp = p[0] & 0x0Fu;
+        n = 3;
+    } else if ((p[0] & 0xF8) == 0xF0) {
+        cp = p[0] & 0x07u;
+        n = 4;
+    } else {
+        return 0;
+    }
+    if (n > len) {
+        return 0;
+    }
+    for (i = 1; i < n; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (p[i] & 0x3Fu);
+    }
+    /* overlong forms, surrogates and what is past Unicode */
+    if ((n == 2 && cp < 0x80) || (n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000)
+        || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+        return 0;
+    }
+    *p_cp = cp;
+
+    return n;
+}
+
+/* the text of "count" septets, which fits AT_SMS_TEXT_SIZE for up to 160 */
+static size_t gsm7ToUtf8(const uint8_t *septets, size_t count, char *out)
+{
+    size_t len = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        uint32_t cp = s_gsmDefault[septets[i]];
+
+        if (septets[i] == SMS_ESC && i + 1 < count) {
+            size_t k;
+
+            /* an unknown extension stands for its default character */
+            cp = s_gsmDefault[septets[++i]];
+            for (k = 0; k < sizeof(s_gsmExtension) / sizeof(s_gsmExtension[0]); k++) {
+                if (s_gsmExtension[k].septet == septets[i]) {
+                    cp = s_gsmExtension[k].cp;
+                    break;
+                }
+            }
+        }
+        len += putUtf8(cp, out + len);
+    }
+    out[len] = '\0';
+
+    return len;
+}
+
+/* the text of the "len" UTF-16BE octets at "in" */
+static size_t ucs2ToUtf8(const uint8_t *in, size_t len, char *out)
+{
+    size_t outLen = 0;
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        uint32_t cp = ((uint32_t) in[i] << 8) | in[i + 1];
+
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 3 < len) {
+            uint32_t low = ((uint32_t) in[i + 2] << 8) | in[i + 3];
+
+            if (low >= 0xDC00 && low <= 0xDFFF) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        if (cp >= 0xD800 && cp <= 0xDFFF) {
+            cp = 0xFFFD;
+        }
+        outLen += putUtf8(cp, out + outLen);
+    }
+    out[outLen] = '\0';
+
+    return outLen;
+}
+
+/**
+ * appends the septets of "cp" to "septets", returning how many it took,
+ * 0 if the default alphabet and its extension do not have it
+ */
+static size_t gsm7FromCodepoint(uint32_t cp, uint8_t *septets)
+{
+    size_t k;
+
+    /* most of ASCII stands for itself */
+    if (cp < 0x80 && s_gsmDefault[cp] == cp) {
+        septets[0] = (uint8_t) cp;
+        return 1;
+    }
+    for (k = 0; k < 128; k++) {
+        if (s_gsmDefault[k] == cp && k != SMS_ESC) {
+            septets[0] = (uint8_t) k;
+            return 1;
+        }
+    }
+    for (k = 0; k < sizeof(s_gsmExtension) / sizeof(s_gsmExtension[0]); k++) {
+        if (s_gsmExtension[k].cp == cp) {
+            septets[0] = SMS_ESC;
+            septets[1] = s_gsmExtension[k].septet;
+            return 2;
+        }
+    }
+
+    return 0;
+}
+
+/* the character set of the user data, 3GPP TS 23.038 section 4 */
+static ATSmsAlphabet dcsAlphabet(uint8_t dcs)
+{
+    unsigned int group = dcs >> 4;
+
+    if (group <= 0x07) {
+        /* general data coding, compressed text is taken as data */
+        if (dcs & 0x20) {
+            return AT_SMS_8BIT;
+        }
+        return ((dcs >> 2) & 0x03) == 1 ? AT_SMS_8BIT
+             : ((dcs >> 2) & 0x03) == 2 ? AT_SMS_UCS2 : AT_SMS_GSM7;
+    }
+    if (group == 0x0E) {
+        return AT_SMS_UCS2;
+    }
+    if (group == 0x0F) {
+        return (dcs & 0x04) ? AT_SMS_8BIT : AT_SMS_GSM7;
+    }
+
+    /* the message waiting and reserved groups */
+    return AT_SMS_GSM7;
+}
+
+/**
+ * decodes the "digits" semi-octets at "in" of an address of type "toa"
+ * to "out", which has AT_SMS_ADDRESS_SIZE bytes
+ */
+static void decodeAddress(const uint8_t *in, size_t digits, uint8_t toa, char *out)
+{
+    size_t len = 0;
+    size_t i;
+
+    if ((toa & SMS_TON_MASK) == SMS_TON_ALPHANUMERIC) {
+        uint8_t septets[SMS_MAX_ADDRESS_DIGITS * 4 / 7];
+
+        smsUnpack7(in, digits * 4 / 7, septets);
+        gsm7ToUtf8(septets, digits * 4 / 7, out);
+        return;
+    }
+
+    if ((toa & SMS_TON_MASK) == SMS_TON_INTERNATIONAL) {
+        out[len++] = '+';
+    }
+    for (i = 0; i < digits; i++) {
+        unsigned int nibble = (i % 2 == 0) ? (in[i / 2] & 0x0Fu) : (in[i / 2] >> 4);
+
+        if (nibble == 0x0F) {
+            break;
+        }
+        out[len++] = s_bcdDigits[nibble];
+    }
+    out[len] = '\0';
+}
+
+/* a semi-octet swapped BCD octet, eg of a time stamp */
+static uint8_t decodeBcd(uint8_t octet)
+{
+    return (uint8_t) ((octet & 0x0F) * 10 + (octet >> 4));
+}
+
+static void decodeTime(const uint8_t *in, ATSmsTime *p_time)
+{
+    int tz = (in[6] & 0x07) * 10 + (in[6] >> 4);
+
+    p_time->year = decodeBcd(in[0]);
+    p_time->month = decodeBcd(in[1]);
+    p_time->day = decodeBcd(in[2]);
+    p_time->hour = decodeBcd(in[3]);
+    p_time->minute = decodeBcd(in[4]);
+    p_time->second = decodeBcd(in[5]);
+    p_time->tzQuarters = (int8_t) ((in[6] & 0x08) ? -tz : tz);
+}
+
+/* the information elements of the user data header that are known */
+static ATReturn decodeHeader(ATSmsPdu *p_sms)
+{
+    size_t pos = 0;
+
+    while (pos + 2 <= p_sms->udhLen) {
+        const uint8_t *ie = p_sms->udh + pos + 2;
+        uint8_t iei = p_sms->udh[pos];
+        size_t iedl = p_sms->udh[pos + 1];
+
+        if (pos + 2 + iedl > p_sms->udhLen) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        if (iei == SMS_IEI_CONCAT_8 && iedl == 3) {
+            p_sms->concatRef = ie[0];
+            p_sms->concatTotal = ie[1];
+            p_sms->concatSeq = ie[2];
+        } else if (iei == SMS_IEI_CONCAT_16 && iedl == 4) {
+            p_sms->concatRef = (uint16_t) ((ie[0] << 8) | ie[1]);
+            p_sms->concatTotal = ie[2];
+            p_sms->concatSeq = ie[3];
+        }
+        pos += 2 + iedl;
+    }
+
+    return AT_SUCCESS;
+}
+
+/* the "udl" septets or octets of user data at "in", of the "len" left */
+static ATReturn decodeUserData(const uint8_t *in, size_t len, size_t udl, bool udhi,
+                               ATSmsPdu *p_sms)
+{
+    size_t octets = udl;
+    size_t headerOctets = 0;
+    size_t skip = 0;
+
+    if (p_sms->alphabet == AT_SMS_GSM7) {
+        if (udl > AT_SMS_MAX_USER_DATA) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        octets = (udl * 7 + 7) / 8;
+    }
+    if (octets > len || octets > SMS_MAX_OCTETS) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (udhi && octets > 0) {
+        headerOctets = (size_t) in[0] + 1;
+        if (headerOctets > octets) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        p_sms->udhLen = headerOctets - 1;
+        memcpy(p_sms->udh, in + 1, p_sms->udhLen);
+        if (decodeHeader(p_sms) != AT_SUCCESS) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+    }
+
+    if (p_sms->alphabet == AT_SMS_GSM7) {
+        /* the text starts at the septet boundary after the header */
+        skip = (headerOctets * 8 + 6) / 7;
+        if (skip > udl) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        smsUnpack7(in, udl, p_sms->userData);
+        p_sms->userDataLen = udl - skip;
+        memmove(p_sms->userData, p_sms->userData + skip, p_sms->userDataLen);
+        p_sms->textLen = gsm7ToUtf8(p_sms->userData, p_sms->userDataLen, p_sms->text);
+        return AT_SUCCESS;
+    }
+
+    p_sms->userDataLen = octets - headerOctets;
+    memcpy(p_sms->userData, in + headerOctets, p_sms->userDataLen);
+    if (p_sms->alphabet == AT_SMS_UCS2) {
+        p_sms->textLen = ucs2ToUtf8(p_sms->userData, p_sms->userDataLen, p_sms->text);
+    }
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Decodes a PDU mode SMS, eg the line after +CMT: or +CMGR:, without
+ * allocating
+ *
+ * "pdu" is the "len" hex digits of the SMSC address followed by the
+ * TPDU, as 3GPP TS 27.005 gives them. SMS-DELIVER and SMS-SUBMIT are
+ * decoded in full; of an SMS-STATUS-REPORT, the message reference,
+ * recipient and time stamp are.
+ * The hex digits are decoded with SSE2 or NEON when the compiler targets
+ * them, and the GSM 7 bit septets a word at a time.
+ *
+ * Returns AT_ERROR_INVALID_ARGUMENT if the PDU is malformed
+ */
+ATReturn at_sms_decode(const char *pdu, size_t len, ATSmsPdu *p_sms)
+{
+    uint8_t buf[AT_SMS_MAX_PDU];
+    size_t octets = len / 2;
+    size_t pos = 0;
+    size_t digits;
+    uint8_t fo;
+    uint8_t mti;
+
+    if (!pdu || !p_sms || len > 2 * AT_SMS_MAX_PDU || !smsHexDecode(pdu, len, buf)) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    p_sms->smsc[0] = '\0';
+    p_sms->address[0] = '\0';
+    p_sms->addressType = 0;
+    p_sms->messageRef = 0;
+    p_sms->pid = 0;
+    p_sms->dcs = 0;
+    p_sms->alphabet = AT_SMS_GSM7;
+    memset(&p_sms->timestamp, 0, sizeof(p_sms->timestamp));
+    p_sms->concatRef = 0;
+    p_sms->concatTotal = 0;
+    p_sms->concatSeq = 0;
+    p_sms->udhLen = 0;
+    p_sms->userDataLen = 0;
+    p_sms->text[0] = '\0';
+    p_sms->textLen = 0;
+
+    /* the SMSC address counts its octets, the type included */
+    if (octets < 1 || buf[0] > SMS_MAX_SCA_OCTETS || 1 + (size_t) buf[0] >= octets) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (buf[0] > 1) {
+        decodeAddress(buf + 2, (size_t) (buf[0] - 1) * 2, buf[1], p_sms->smsc);
+    }
+    pos = 1 + (size_t) buf[0];
+
+    fo = buf[pos++];
+    mti = fo & SMS_MTI_MASK;
+    if (mti == SMS_MTI_SUBMIT) {
+        p_sms->type = AT_SMS_SUBMIT;
+    } else if (mti == SMS_MTI_STATUS_REPORT) {
+        p_sms->type = AT_SMS_STATUS_REPORT;
+    } else {
+        p_sms->type = AT_SMS_DELIVER;
+    }
+
+    if (p_sms->type != AT_SMS_DELIVER) {
+        if (pos >= octets) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        p_sms->messageRef = buf[pos++];
+    }
+
+    /* the originator, destination or recipient, which counts its digits */
+    if (pos + 2 > octets || buf[pos] > SMS_MAX_ADDRESS_DIGITS
+        || pos + 2 + ((size_t) buf[pos] + 1) / 2 > octets) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    digits = buf[pos];
+    p_sms->addressType = buf[pos + 1];
+    decodeAddress(buf + pos + 2, digits, p_sms->addressType, p_sms->address);
+    pos += 2 + (digits + 1) / 2;
+
+    if (p_sms->type == AT_SMS_STATUS_REPORT) {
+        if (pos + 7 > octets) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        decodeTime(buf + pos, &p_sms->timestamp);
+        return AT_SUCCESS;
+    }
+
+    if (pos + 2 > octets) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    p_sms->pid = buf[pos++];
+    p_sms->dcs = buf[pos++];
+    p_sms->alphabet = dcsAlphabet(p_sms->dcs);
+
+    if (p_sms->type == AT_SMS_DELIVER) {
+        if (pos + 7 > octets) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        decodeTime(buf + pos, &p_sms->timestamp);
+        pos += 7;
+    } else {
+        /* skip the validity period: none, enhanced, relative or absolute */
+        static const size_t vpOctets[4] = { 0, 7, 1, 7 };
+
+        pos += vpOctets[(fo >> SMS_VPF_SHIFT) & 0x03];
+    }
+
+    if (pos >= octets) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    return decodeUserData(buf + pos + 1, octets - pos - 1, buf[pos], (fo & SMS_UDHI) != 0, p_sms);
+}
+
+/**
+ * writes "address" as a length, type of address and semi-octets to
+ * "out", returning how many octets it took, or 0 if it is not a number
+ * "smsc" counts octets instead of digits, as the SMSC address does
+ */
+static size_t encodeAddress(const char *address, uint8_t toa, bool smsc, uint8_t *out)
+{
+    size_t digits = 0;
+    size_t octets;
+
+    if (*address == '+') {
+        address++;
+    }
+    for (; address[digits] != '\0'; digits++) {
+        const char *bcd = strchr(s_bcdDigits, address[digits]);
+        size_t i = digits / 2 + 2;
+
+        if (!bcd || digits >= SMS_MAX_ADDRESS_DIGITS) {
+            return 0;
+        }
+        if (digits % 2 == 0) {
+            out[i] = (uint8_t) (0xF0 | (bcd - s_bcdDigits));
+        } else {
+            out[i] = (uint8_t) ((out[i] & 0x0F) | ((bcd - s_bcdDigits) << 4));
+        }
+    }
+    if (digits == 0) {
+        return 0;
+    }
+
+    octets = (digits + 1) / 2;
+    out[0] = (uint8_t) (smsc ? octets + 1 : digits);
+    out[1] = toa;
+
+    return octets + 2;
+}
+
+/**
+ * Encodes an SMS-SUBMIT in PDU mode, for at_send_command_sms()
+ *
+ * Of "p_sms", the smsc ("" for the default one), address, addressType
+ * (0 to take it from a leading +), messageRef, pid, alphabet and the
+ * message class bits of dcs are used, along with the concatenation
+ * fields when concatTotal is above 1. The UTF-8 "text" is sent in GSM 7
+ * bit or UCS2, and "userData" as 8 bit data.
+ *
+ * Writes the hex digits and a NUL to the "size" bytes at "pdu", and the
+ * TPDU octets AT+CMGS=<length> wants to *p_tpduLen.
+ *
+ * Returns AT_ERROR_INVALID_ARGUMENT if the message does not fit an SMS or
+ * "pdu", or the text does not fit its alphabet
+ */
+ATReturn at_sms_encode(const ATSmsPdu *p_sms, char *pdu, size_t size, size_t *p_tpduLen)
+{
+    uint8_t buf[AT_SMS_MAX_PDU];
+    uint8_t septets[AT_SMS_MAX_USER_DATA];
+    size_t headerOctets = 0;
+    size_t textLen;
+    size_t scaLen;
+    size_t pos;
+    size_t udlPos;
+    size_t udl = 0;
+    size_t i;
+    uint8_t toa;
+
+    if (!p_sms || !pdu || !p_tpduLen || p_sms->type != AT_SMS_SUBMIT
+        || (p_sms->alphabet != AT_SMS_GSM7 && p_sms->alphabet != AT_SMS_8BIT
+            && p_sms->alphabet != AT_SMS_UCS2)) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    if (p_sms->smsc[0] == '\0') {
+        buf[0] = 0;
+        scaLen = 1;
+    } else {
+        toa = p_sms->smsc[0] == '+' ? SMS_TOA_INTERNATIONAL : SMS_TOA_UNKNOWN;
+        scaLen = encodeAddress(p_sms->smsc, toa, true, buf);
+        if (scaLen == 0 || scaLen > SMS_MAX_SCA_OCTETS + 1) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+    }
+    pos = scaLen;
+
+    buf[pos++] = (uint8_t) (SMS_MTI_SUBMIT | (p_sms->concatTotal > 1 ? SMS_UDHI : 0));
+    buf[pos++] = p_sms->messageRef;
+
+    toa = p_sms->addressType;
+    if (toa == 0) {
+        toa = p_sms->address[0] == '+' ? SMS_TOA_INTERNATIONAL : SMS_TOA_UNKNOWN;
+    }
+    i = encodeAddress(p_sms->address, toa, false, buf + pos);
+    if (i == 0) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    pos += i;
+
+    buf[pos++] = p_sms->pid;
+    /* the general data coding group, the alphabet values match its bits */
+    buf[pos++] = (uint8_t) ((p_sms->dcs & 0x13) | ((unsigned int) p_sms->alphabet << 2));
+    udlPos = pos++;
+    /* the fill bits after the header are zeros */
+    memset(buf + pos, 0, sizeof(buf) - pos);
+
+    if (p_sms->concatTotal > 1) {
+        if (p_sms->concatRef > 0xFF) {
+            buf[pos++] = 6;
+            buf[pos++] = SMS_IEI_CONCAT_16;
+            buf[pos++] = 4;
+            buf[pos++] = (uint8_t) (p_sms->concatRef >> 8);
+        } else {
+            buf[pos++] = 5;
+            buf[pos++] = SMS_IEI_CONCAT_8;
+            buf[pos++] = 3;
+        }
+        buf[pos++] = (uint8_t) (p_sms->concatRef & 0xFF);
+        buf[pos++] = p_sms->concatTotal;
+        buf[pos++] = p_sms->concatSeq;
+        headerOctets = (size_t) buf[udlPos + 1] + 1;
+    }
+
+    textLen = strnlen(p_sms->text, sizeof(p_sms->text));
+
+    if (p_sms->alphabet == AT_SMS_GSM7) {
+        /* the text starts at the septet boundary after the header */
+        size_t skip = (headerOctets * 8 + 6) / 7;
+        size_t count = 0;
+
+        for (i = 0; i < textLen; ) {
+            uint8_t ch[2];
+            uint32_t cp;
+            size_t n = getUtf8(p_sms->text + i, textLen - i, &cp);
+            size_t k = n ? gsm7FromCodepoint(cp, ch) : 0;
+
+            if (k == 0 || skip + count + k > AT_SMS_MAX_USER_DATA) {
+                return AT_ERROR_INVALID_ARGUMENT;
+            }
+            memcpy(septets + count, ch, k);
+            count += k;
+            i += n;
+        }
+        udl = skip + count;
+        smsPack7(septets, count, skip, buf + udlPos + 1);
+        pos = udlPos + 1 + (udl * 7 + 7) / 8;
+    } else if (p_sms->alphabet == AT_SMS_UCS2) {
+        for (i = 0; i < textLen; ) {
+            uint32_t cp;
+            size_t n = getUtf8(p_sms->text + i, textLen - i, &cp);
+            size_t units = cp >= 0x10000 ? 2 : 1;
+
+            if (n == 0 || pos - udlPos - 1 + 2 * units > SMS_MAX_OCTETS) {
+                return AT_ERROR_INVALID_ARGUMENT;
+            }
+            if (units == 2) {
+                uint32_t high = 0xD800 + ((cp - 0x10000) >> 10);
+
+                buf[pos++] = (uint8_t) (high >> 8);
+                buf[pos++] = (uint8_t) (high & 0xFF);
+                cp = 0xDC00 + ((cp - 0x10000) & 0x3FF);
+            }
+            buf[pos++] = (uint8_t) (cp >> 8);
+            buf[pos++] = (uint8_t) (cp & 0xFF);
+            i += n;
+        }
+        udl = pos - udlPos - 1;
+    } else {
+        if (p_sms->userDataLen > SMS_MAX_OCTETS - headerOctets) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        memcpy(buf + pos, p_sms->userData, p_sms->userDataLen);
+        pos += p_sms->userDataLen;
+        udl = pos - udlPos - 1;
+    }
+    buf[udlPos] = (uint8_t) udl;
+
+    if (2 * pos + 1 > size) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    smsHexEncode(buf, pos, pdu);
+    pdu[2 * pos] = '\0';
+    *p_tpduLen = pos - scaLen;
+
+    return AT_SUCCESS;
+}
@@ -0,0 +1,55 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_SMS_H
+#define AT_SMS_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * decodes the "len" hex digits at "hex" into len / 2 octets at "out",
+ * returning false if "len" is odd or one is not a hex digit
+ * uses SSE2 or NEON when the compiler targets them
+ */
+bool smsHexDecode(const char *hex, size_t len, uint8_t *out);
+
+/** writes the "len" octets at "in" as 2 * len upper case hex digits to "hex" */
+void smsHexEncode(const uint8_t *in, size_t len, char *hex);
+
+/**
+ * unpacks the first "count" GSM 7 bit septets of the packed user data
+ * at "in", which holds at least (count * 7 + 7) / 8 octets, to "out"
+ */
+void smsUnpack7(const uint8_t *in, size_t count, uint8_t *out);
+
+/**
+ * packs the "count" septets at "in" into "out" from septet "offset" on,
+ * leaving the bits before it as they are; "out" must have room for
+ * ((offset + count) * 7 + 7) / 8 octets
+ */
+void smsPack7(const uint8_t *in, size_t count, size_t offset, uint8_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_SMS_H */
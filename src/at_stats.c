@@ -0,0 +1,259 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_stats.h"
+
+#define MAX_VERBS 64
+
+/*
+ * log-linear buckets as in HdrHistogram: 32 per power of 2 from 64 ns
+ * on, so a bucket is at most 1/32 of its value wide
+ */
+#define SUB_BUCKET_BITS 5
+#define SUB_BUCKETS (1u << SUB_BUCKET_BITS)
+#define MAX_VALUE_BITS 42       /* about 73 minutes, longer ones are clamped */
+#define BUCKET_COUNT ((MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKETS + 2 * SUB_BUCKETS)
+
+typedef struct {
+    ATCommandStats summary;     /* the percentiles are filled in by statsGet() */
+    uint64_t totalNsec;
+    uint32_t buckets[BUCKET_COUNT];
+} ATVerbStats;
+
+struct ATStats {
+    ATVerbStats *verbs[MAX_VERBS + 1];  /* the last one for all the others */
+    size_t verbCount;
+};
+
+static size_t bucketIndex(uint64_t value)
+{
+    unsigned int shift = 0;
+
+    if (value >= (UINT64_C(1) << MAX_VALUE_BITS)) {
+        value = (UINT64_C(1) << MAX_VALUE_BITS) - 1;
+    }
+    if (value >= 2 * SUB_BUCKETS) {
+        shift = (unsigned int) (63 - __builtin_clzll(value)) - SUB_BUCKET_BITS;
+    }
+
+    return shift * SUB_BUCKETS + (size_t) (value >> shift);
+}
+
+/** returns the middle of the values counted in a bucket */
+static uint64_t bucketValue(size_t index)
+{
+    unsigned int shift = 0;
+
+    if (index >= 2 * SUB_BUCKETS) {
+        shift = (unsigned int) (index / SUB_BUCKETS) - 1;
+    }
+
+    return ((uint64_t) (index - shift * SUB_BUCKETS) << shift) + ((UINT64_C(1) << shift) >> 1);
+}
+
+/**
+ * copies the verb of "command" into "verb": the name of an extended
+ * command like "+CSQ" of "AT+CSQ?", or the letter of a basic one like
+ * "D" of "ATD123;". Just "AT" is "AT".
+ */
+static void commandVerb(const char *command, char *verb, size_t size)
+{
+    size_t len = 0;
+
+    if ((command[0] == 'A' || command[0] == 'a') && (command[1] == 'T' || command[1] == 't')) {
+        command += 2;
+    }
+
+    if (command[0] == '\0') {
+        strcpy(verb, "AT");
+        return;
+    }
+
+    if (isalpha((unsigned char) command[0])) {
+        /* a basic command */
+        verb[len++] = (char) toupper((unsigned char) command[0]);
+    } else if (command[0] == '&' && isalpha((unsigned char) command[1])) {
+        verb[len++] = '&';
+        verb[len++] = (char) toupper((unsigned char) command[1]);
+    } else {
+        /* an extended command, eg +CSQ, ^SYSINFO or $QCPDPP */
+        verb[len++] = command[0];
+        for (command++; len < size - 1 && isalnum((unsigned char) *command); command++) {
+            verb[len++] = (char) toupper((unsigned char) *command);
+        }
+    }
+
+    verb[len] = '\0';
+}
+
+static ATVerbStats *findVerb(ATStats *stats, const char *command)
+{
+    char verb[sizeof(((ATCommandStats *) NULL)->verb)];
+    ATVerbStats *p_verb;
+    size_t i;
+
+    commandVerb(command, verb, sizeof(verb));
+
+    for (i = 0; i < stats->verbCount; i++) {
+        if (0 == strcmp(stats->verbs[i]->summary.verb, verb)) {
+            return stats->verbs[i];
+        }
+    }
+
+    if (stats->verbCount == MAX_VERBS) {
+        strcpy(verb, "*");
+        if (stats->verbs[MAX_VERBS] != NULL) {
+            return stats->verbs[MAX_VERBS];
+        }
+    }
+
+    p_verb = calloc(1, sizeof(ATVerbStats));
+    if (p_verb == NULL) {
+        return NULL;
+    }
+    strcpy(p_verb->summary.verb, verb);
+
+    if (stats->verbCount == MAX_VERBS) {
+        stats->verbs[MAX_VERBS] = p_verb;
+    } else {
+        stats->verbs[stats->verbCount++] = p_verb;
+    }
+
+    return p_verb;
+}
+
+ATStats *statsNew(void)
+{
+    return calloc(1, sizeof(ATStats));
+}
+
+void statsFree(ATStats *stats)
+{
+    if (stats == NULL) {
+        return;
+    }
+
+    statsReset(stats);
+    free(stats);
+}
+
+void statsRecord(ATStats *stats, const char *command, ATReturn err,
+                 const ATResponse *p_response)
+{
+    ATVerbStats *p_verb;
+    uint64_t latency;
+
+    if (p_response == NULL || p_response->timing.writeStart == 0) {
+        /* never written */
+        return;
+    }
+    if (err != AT_ERROR_TIMEOUT && p_response->timing.finalLine == 0) {
+        /* eg the channel closed */
+        return;
+    }
+
+    p_verb = findVerb(stats, command);
+    if (p_verb == NULL) {
+        return;
+    }
+
+    if (err == AT_ERROR_TIMEOUT) {
+        p_verb->summary.timeouts++;
+        return;
+    }
+
+    latency = p_response->timing.finalLine - p_response->timing.writeStart;
+
+    if (p_verb->summary.count == 0 || latency < p_verb->summary.minNsec) {
+        p_verb->summary.minNsec = latency;
+    }
+    if (latency > p_verb->summary.maxNsec) {
+        p_verb->summary.maxNsec = latency;
+    }
+    p_verb->summary.count++;
+    if (err != AT_SUCCESS || !p_response->success) {
+        p_verb->summary.errors++;
+    }
+    p_verb->totalNsec += latency;
+    p_verb->buckets[bucketIndex(latency)]++;
+}
+
+/** returns the value below which "ratio" of the latencies fall */
+static uint64_t percentile(const ATVerbStats *p_verb, double ratio)
+{
+    uint64_t rank = (uint64_t) (ratio * (double) p_verb->summary.count + 0.5);
+    uint64_t seen = 0;
+    size_t i;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+
+    for (i = 0; i < BUCKET_COUNT; i++) {
+        seen += p_verb->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucketValue(i);
+
+            /* the exact extremes are known */
+            if (value < p_verb->summary.minNsec) {
+                return p_verb->summary.minNsec;
+            }
+            if (value > p_verb->summary.maxNsec) {
+                return p_verb->summary.maxNsec;
+            }
+            return value;
+        }
+    }
+
+    return p_verb->summary.maxNsec;
+}
+
+size_t statsGet(const ATStats *stats, ATCommandStats *p_stats, size_t maxCount)
+{
+    size_t count = stats->verbCount + (stats->verbs[MAX_VERBS] != NULL ? 1 : 0);
+    size_t i;
+
+    for (i = 0; i < count && i < maxCount; i++) {
+        const ATVerbStats *p_verb = i < stats->verbCount ? stats->verbs[i] : stats->verbs[MAX_VERBS];
+
+        p_stats[i] = p_verb->summary;
+        if (p_verb->summary.count > 0) {
+            p_stats[i].meanNsec = p_verb->totalNsec / p_verb->summary.count;
+            p_stats[i].p50Nsec = percentile(p_verb, 0.50);
+            p_stats[i].p90Nsec = percentile(p_verb, 0.90);
+            p_stats[i].p99Nsec = percentile(p_verb, 0.99);
+            p_stats[i].p999Nsec = percentile(p_verb, 0.999);
+        }
+    }
+
+    return count;
+}
+
+void statsReset(ATStats *stats)
+{
+    size_t i;
+
+    for (i = 0; i <= MAX_VERBS; i++) {
+        free(stats->verbs[i]);
+        stats->verbs[i] = NULL;
+    }
+    stats->verbCount = 0;
+}
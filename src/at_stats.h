@@ -0,0 +1,51 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_STATS_H
+#define AT_STATS_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "atchannel.h"
+
+/** per-verb latency histograms of a channel, not thread safe */
+typedef struct ATStats ATStats;
+
+/** returns empty statistics, NULL on allocation failure */
+ATStats *statsNew(void);
+void statsFree(ATStats *stats);
+
+/** accounts for a command that ended with "err" */
+void statsRecord(ATStats *stats, const char *command, ATReturn err,
+                 const ATResponse *p_response);
+
+/**
+ * fills up to "maxCount" entries of "p_stats"
+ * returns the number of verbs, which may be more
+ */
+size_t statsGet(const ATStats *stats, ATCommandStats *p_stats, size_t maxCount);
+
+void statsReset(ATStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_STATS_H */
@@ -0,0 +1,235 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "at_timer.h"
+
+/*
+ * Level l has 64 slots of 64^l ticks each. A timer goes to the lowest level
+ * its delay fits in, and moves down a level whenever the wheel reaches the
+ * start of its slot, until it expires from level 0.
+ */
+#define LEVEL_BITS  6
+#define LEVEL_SLOTS (1u << LEVEL_BITS)
+#define LEVEL_MASK  ((uint64_t)LEVEL_SLOTS - 1)
+#define LEVELS      6
+#define MAX_DELAY   (((uint64_t)1 << (LEVEL_BITS * LEVELS)) - 1)
+
+struct ATTimerWheel {
+    uint64_t now;               /* the last tick advanced to */
+    ATTimer *slots[LEVELS][LEVEL_SLOTS];
+    uint64_t occupied[LEVELS];  /* a bit per non-empty slot */
+    ATTimer *p_expired;
+    ATTimer **pp_expiredTail;
+};
+
+static void listInsert(ATTimer **pp_head, ATTimer *timer)
+{
+    timer->p_next = *pp_head;
+    if (timer->p_next != NULL) {
+        timer->p_next->pp_prev = &timer->p_next;
+    }
+    timer->pp_prev = pp_head;
+    *pp_head = timer;
+}
+
+static void place(ATTimerWheel *wheel, ATTimer *timer)
+{
+    uint64_t delay;
+    unsigned level = 0;
+    unsigned slot;
+
+    if (timer->expiry <= wheel->now) {
+        timer->expiry = wheel->now + 1;
+    }
+    delay = timer->expiry - wheel->now;
+    if (delay > MAX_DELAY) {
+        /* comes back around and is placed again */
+        delay = MAX_DELAY;
+    }
+
+    while (level + 1 < LEVELS && delay >> (LEVEL_BITS * (level + 1)) != 0) {
+        level++;
+    }
+
+    slot = (unsigned)(((wheel->now + delay) >> (LEVEL_BITS * level)) & LEVEL_MASK);
+    listInsert(&wheel->slots[level][slot], timer);
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+ATTimerWheel *timerWheelNew(uint64_t now)
+{
+    ATTimerWheel *wheel = calloc(1, sizeof(ATTimerWheel));
+
+    if (wheel == NULL) {
+        return NULL;
+    }
+
+    wheel->now = now;
+    wheel->p_expired = NULL;
+    wheel->pp_expiredTail = &wheel->p_expired;
+
+    return wheel;
+}
+
+void timerWheelFree(ATTimerWheel *wheel)
+{
+    free(wheel);
+}
+
+void timerWheelRemove(ATTimerWheel *wheel, ATTimer *timer)
+{
+    uintptr_t head = (uintptr_t)timer->pp_prev;
+    uintptr_t first = (uintptr_t)&wheel->slots[0][0];
+
+    if (timer->pp_prev == NULL) {
+        return;
+    }
+
+    if (wheel->pp_expiredTail == &timer->p_next) {
+        wheel->pp_expiredTail = timer->pp_prev;
+    }
+    *timer->pp_prev = timer->p_next;
+    if (timer->p_next != NULL) {
+        timer->p_next->pp_prev = timer->pp_prev;
+    }
+    timer->p_next = NULL;
+    timer->pp_prev = NULL;
+
+    /* the first of a slot, which may be empty now */
+    if (head >= first && head < first + sizeof(wheel->slots)
+        && *(ATTimer **)(void *)head == NULL
+    ) {
+        size_t index = (head - first) / sizeof(ATTimer *);
+
+        wheel->occupied[index / LEVEL_SLOTS] &= ~((uint64_t)1 << (index % LEVEL_SLOTS));
+    }
+}
+
+void timerWheelAdd(ATTimerWheel *wheel, ATTimer *timer, uint64_t expiry)
+{
+    timerWheelRemove(wheel, timer);
+    timer->expiry = expiry;
+    place(wheel, timer);
+}
+
+/** empties a slot, handing its timers to "place" or the expired list */
+static void processSlot(ATTimerWheel *wheel, unsigned level, unsigned slot)
+{
+    ATTimer *timer = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+
+    while (timer != NULL) {
+        ATTimer *p_next = timer->p_next;
+
+        if (timer->expiry <= wheel->now) {
+            timer->p_next = NULL;
+            timer->pp_prev = wheel->pp_expiredTail;
+            *wheel->pp_expiredTail = timer;
+            wheel->pp_expiredTail = &timer->p_next;
+        } else {
+            place(wheel, timer);
+        }
+        timer = p_next;
+    }
+}
+
+/** the first tick after "now" that slot "slot" of level "level" is reached at */
+static uint64_t slotTick(uint64_t now, unsigned level, unsigned slot)
+{
+    unsigned shift = LEVEL_BITS * level;
+    uint64_t index = ((now >> shift) & ~LEVEL_MASK) | slot;
+
+    if (index <= now >> shift) {
+        index += LEVEL_SLOTS;
+    }
+
+    return index << shift;
+}
+
+uint64_t timerWheelNext(const ATTimerWheel *wheel)
+{
+    uint64_t next = UINT64_MAX;
+    unsigned level;
+
+    for (level = 0; level < LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        unsigned current = (unsigned)((wheel->now >> (LEVEL_BITS * level)) & LEVEL_MASK);
+        uint64_t rotated;
+        unsigned slot;
+        uint64_t tick;
+
+        if (bits == 0) {
+            continue;
+        }
+
+        /* the first occupied slot after the current one, wrapping around */
+        rotated = current + 1 < LEVEL_SLOTS ? bits >> (current + 1) : 0;
+        if (rotated != 0) {
+            slot = current + 1 + (unsigned)__builtin_ctzll(rotated);
+        } else {
+            slot = (unsigned)__builtin_ctzll(bits);
+        }
+
+        tick = slotTick(wheel->now, level, slot);
+        if (tick < next) {
+            next = tick;
+        }
+    }
+
+    return next;
+}
+
+void timerWheelAdvance(ATTimerWheel *wheel, uint64_t now)
+{
+    unsigned level;
+
+    while (wheel->now < now) {
+        uint64_t next = timerWheelNext(wheel);
+
+        if (next > now) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now = next;
+
+        /* bring down the timers of the higher level slots starting here */
+        for (level = 1; level < LEVELS; level++) {
+            unsigned shift = LEVEL_BITS * level;
+
+            if ((next & ((((uint64_t)1) << shift) - 1)) != 0) {
+                break;
+            }
+            processSlot(wheel, level, (unsigned)((next >> shift) & LEVEL_MASK));
+        }
+        processSlot(wheel, 0, (unsigned)(next & LEVEL_MASK));
+    }
+}
+
+ATTimer *timerWheelPopExpired(ATTimerWheel *wheel)
+{
+    ATTimer *timer = wheel->p_expired;
+
+    if (timer != NULL) {
+        timerWheelRemove(wheel, timer);
+    }
+
+    return timer;
+}
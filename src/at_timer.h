@@ -0,0 +1,69 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_TIMER_H
+#define AT_TIMER_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * a timer of an ATTimerWheel, embedded in whatever it times
+ * "key" is for the owner, the rest belongs to the wheel
+ */
+typedef struct ATTimer {
+    struct ATTimer *p_next;
+    struct ATTimer **pp_prev;   /* NULL unless armed or expired */
+    uint64_t expiry;            /* in ticks */
+    uint64_t key;
+} ATTimer;
+
+/**
+ * a hierarchical timer wheel of 1 ms ticks: adding, removing and expiring
+ * a timer take constant time, however many there are
+ */
+typedef struct ATTimerWheel ATTimerWheel;
+
+ATTimerWheel *timerWheelNew(uint64_t now);
+void timerWheelFree(ATTimerWheel *wheel);
+
+/** arms "timer" to expire at tick "expiry", re-arming it if it is armed */
+void timerWheelAdd(ATTimerWheel *wheel, ATTimer *timer, uint64_t expiry);
+
+/** disarms "timer", whether armed, expired or neither */
+void timerWheelRemove(ATTimerWheel *wheel, ATTimer *timer);
+
+/** moves the timers due by tick "now" to the expired list */
+void timerWheelAdvance(ATTimerWheel *wheel, uint64_t now);
+
+/** removes and returns the first expired timer, NULL if there is none */
+ATTimer *timerWheelPopExpired(ATTimerWheel *wheel);
+
+/**
+ * returns the next tick timerWheelAdvance() has work to do at, which may be
+ * before any timer is due, or UINT64_MAX if no timer is armed
+ */
+uint64_t timerWheelNext(const ATTimerWheel *wheel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_TIMER_H */
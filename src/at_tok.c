@@ -15,10 +15,11 @@
 ** limitations under the License.
 */
 
-#include "at_tok.h"
 #define _DEFAULT_SOURCE
+#include "at_tok.h"
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 
 /**
@@ -187,3 +188,337 @@ bool at_tok_hasmore(char **p_cur)
 {
     return ! (*p_cur == NULL || **p_cur == '\0');
 }
+
+/**
+ * Returns the parameters of an AT response line, after the prefix up to
+ * the first ':', or NULL if there is no prefix. Unlike at_tok_start(),
+ * the line is left alone.
+ */
+const char *at_tok_params(const char *line)
+{
+    const char *p_colon;
+
+    if (line == NULL) {
+        return NULL;
+    }
+
+    p_colon = strchr(line, ':');
+
+    return p_colon != NULL ? p_colon + 1 : NULL;
+}
+
+static bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+/**
+ * Splits "s", eg the result of at_tok_params(), at the commas outside of
+ * quotes in one pass, without writing to it. The first "maxCount" tokens
+ * are stored in "p_tokens" without their surrounding whitespace; anything
+ * between a closing quote and the next comma is skipped, like at_tok_nextstr()
+ * does. An empty "s" has no tokens, "1," has two.
+ * returns the number of tokens, which may be more than "maxCount", or -1
+ * if "s" is NULL
+ */
+int at_tok_split(const char *s, ATToken *p_tokens, size_t maxCount)
+{
+    const char *p_end;
+    const char *cur;
+    size_t count = 0;
+
+    if (s == NULL || (p_tokens == NULL && maxCount > 0)) {
+        return -1;
+    }
+
+    if (*s == '\0') {
+        return 0;
+    }
+
+    p_end = s + strlen(s);
+    cur = s;
+
+    for (;;) {
+        const char *p_start;
+        const char *p_stop;
+        const char *p_comma;
+        bool quoted = false;
+
+        while (cur < p_end && isBlank(*cur)) {
+            cur++;
+        }
+
+        if (cur < p_end && *cur == '"') {
+            const char *p_quote;
+
+            quoted = true;
+            p_start = cur + 1;
+            p_quote = memchr(p_start, '"', (size_t)(p_end - p_start));
+            p_stop = p_quote != NULL ? p_quote : p_end;
+            p_comma = memchr(p_stop, ',', (size_t)(p_end - p_stop));
+        } else {
+            p_start = cur;
+            p_comma = memchr(cur, ',', (size_t)(p_end - cur));
+            p_stop = p_comma != NULL ? p_comma : p_end;
+            while (p_stop > p_start && isBlank(p_stop[-1])) {
+                p_stop--;
+            }
+        }
+
+        if (count < maxCount) {
+            p_tokens[count].p = p_start;
+            p_tokens[count].len = (size_t)(p_stop - p_start);
+            p_tokens[count].quoted = quoted;
+        }
+        count++;
+
+        if (p_comma == NULL) {
+            break;
+        }
+        cur = p_comma + 1;
+    }
+
+    return count > INT_MAX ? INT_MAX : (int)count;
+}
+
+/**
+ * Parses the digits of a whole token into "*p_out", without a sign, a base
+ * prefix or the locale, failing rather than wrapping above "max"
+ * returns 0 on success and -1 on fail
+ */
+static int parseUnsigned(const char *p, size_t len, unsigned base, uint64_t max, uint64_t *p_out)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    if (len == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)p[i];
+        unsigned digit;
+
+        if ((unsigned)(c - '0') <= 9u) {
+            digit = (unsigned)(c - '0');
+        } else if (base == 16 && (unsigned)((c | 0x20) - 'a') <= 5u) {
+            digit = (unsigned)((c | 0x20) - 'a') + 10;
+        } else {
+            return -1;
+        }
+
+        if (value > (max - digit) / base) {
+            return -1;
+        }
+        value = value * base + digit;
+    }
+
+    *p_out = value;
+
+    return 0;
+}
+
+/**
+ * Parses a whole token as a base 10 integer with an optional sign,
+ * failing on anything else and on overflow
+ * returns 0 on success and -1 on fail
+ */
+static int parseSigned(const ATToken *p_tok, int64_t min, int64_t max, int64_t *p_out)
+{
+    const char *p;
+    size_t len;
+    bool negative = false;
+    uint64_t magnitude;
+
+    if (p_tok == NULL) {
+        return -1;
+    }
+
+    p = p_tok->p;
+    len = p_tok->len;
+    if (len > 0 && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+        len--;
+    }
+
+    if (negative) {
+        if (parseUnsigned(p, len, 10, (uint64_t)-(min + 1) + 1, &magnitude) < 0) {
+            return -1;
+        }
+        *p_out = magnitude == 0 ? 0 : -(int64_t)(magnitude - 1) - 1;
+    } else {
+        if (parseUnsigned(p, len, 10, (uint64_t)max, &magnitude) < 0) {
+            return -1;
+        }
+        *p_out = (int64_t)magnitude;
+    }
+
+    return 0;
+}
+
+/**
+ * Parses a token as a base 10 int and places it in *p_out
+ * returns 0 on success and -1 on fail, including overflow
+ */
+int at_tok_toint(const ATToken *p_tok, int *p_out)
+{
+    int64_t value;
+
+    if (parseSigned(p_tok, INT_MIN, INT_MAX, &value) < 0) {
+        return -1;
+    }
+
+    *p_out = (int)value;
+
+    return 0;
+}
+
+int at_tok_toint64(const ATToken *p_tok, int64_t *p_out)
+{
+    return parseSigned(p_tok, INT64_MIN, INT64_MAX, p_out);
+}
+
+/**
+ * Parses a token as a base 16 unsigned int, eg "2F1C" without "0x",
+ * and places it in *p_out
+ * returns 0 on success and -1 on fail, including overflow
+ */
+int at_tok_tohexint(const ATToken *p_tok, unsigned int *p_out)
+{
+    uint64_t value;
+
+    if (p_tok == NULL || parseUnsigned(p_tok->p, p_tok->len, 16, UINT_MAX, &value) < 0) {
+        return -1;
+    }
+
+    *p_out = (unsigned int)value;
+
+    return 0;
+}
+
+int at_tok_tohexint64(const ATToken *p_tok, uint64_t *p_out)
+{
+    if (p_tok == NULL) {
+        return -1;
+    }
+
+    return parseUnsigned(p_tok->p, p_tok->len, 16, UINT64_MAX, p_out);
+}
+
+/** booleans should be 0 or 1 */
+int at_tok_tobool(const ATToken *p_tok, bool *p_out)
+{
+    int result;
+
+    if (at_tok_toint(p_tok, &result) < 0 || !(result == 0 || result == 1)) {
+        return -1;
+    }
+
+    if (p_out != NULL) {
+        *p_out = result == 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Copies a token into "p_out" of "size" bytes with a terminating NUL
+ * returns 0 on success and -1 if it does not fit
+ */
+int at_tok_tostr(const ATToken *p_tok, char *p_out, size_t size)
+{
+    if (p_tok == NULL || p_out == NULL || p_tok->len >= size) {
+        return -1;
+    }
+
+    memcpy(p_out, p_tok->p, p_tok->len);
+    p_out[p_tok->len] = '\0';
+
+    return 0;
+}
+
+/**
+ * Stores "p_tok" in row "row" of the column of "p_field"
+ * returns 0 on success and -1 if it is not of the field type
+ */
+static int decodeField(const ATField *p_field, const ATToken *p_tok, size_t row)
+{
+    switch (p_field->type) {
+        case AT_FIELD_SKIP:
+            return 0;
+        case AT_FIELD_INT:
+            return at_tok_toint(p_tok, (int *)p_field->p_column + row);
+        case AT_FIELD_INT64:
+            return at_tok_toint64(p_tok, (int64_t *)p_field->p_column + row);
+        case AT_FIELD_HEX:
+            return at_tok_tohexint(p_tok, (unsigned int *)p_field->p_column + row);
+        case AT_FIELD_STRING:
+            ((ATToken *)p_field->p_column)[row] = *p_tok;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Decodes the intermediate lines of a MULTILINE response, eg of AT+CMGL or
+ * AT+CPBR, into columns: field i of line n goes to row n of the column of
+ * "p_fields[i]", which must have room for "maxRows" values. Tokens beyond
+ * "fieldCount" are ignored.
+ * If "p_errors" is non-NULL, p_errors[n] is set to -1 when line n decoded,
+ * otherwise to the index of its first field that is missing or not of its
+ * type, in which case its other fields are still decoded.
+ * A line without a prefix, eg a PDU, fails at field 0.
+ * returns the number of lines, which may be more than "maxRows", or -1 on
+ * invalid arguments
+ */
+int at_tok_decode(const ATResponse *p_response, const ATField *p_fields, size_t fieldCount,
+                  size_t maxRows, int *p_errors)
+{
+    ATToken tokens[AT_TOK_MAX_FIELDS];
+    const ATLine *p_line;
+    size_t row = 0;
+
+    if (p_response == NULL || (p_fields == NULL && fieldCount > 0)
+        || fieldCount > AT_TOK_MAX_FIELDS
+    ) {
+        return -1;
+    }
+
+    for (p_line = p_response->p_intermediates; p_line != NULL; p_line = p_line->p_next, row++) {
+        const char *params;
+        int error = -1;
+        size_t count = 0;
+        size_t i;
+
+        if (row >= maxRows) {
+            continue;
+        }
+
+        params = at_tok_params(p_line->line);
+        if (params != NULL) {
+            int n = at_tok_split(params, tokens, fieldCount);
+
+            count = n < 0 ? 0 : (size_t)n;
+        }
+
+        for (i = 0; i < fieldCount; i++) {
+            if (i >= count) {
+                if (error < 0) {
+                    error = (int)i;
+                }
+                break;
+            }
+            if (decodeField(&p_fields[i], &tokens[i], row) < 0 && error < 0) {
+                error = (int)i;
+            }
+        }
+
+        if (p_errors != NULL) {
+            p_errors[row] = error;
+        }
+    }
+
+    return row > INT_MAX ? INT_MAX : (int)row;
+}
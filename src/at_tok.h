@@ -23,6 +23,10 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "atchannel.h"
 
 int at_tok_start(char **p_cur);
 int at_tok_nextint(char **p_cur, int *p_out);
@@ -33,6 +37,46 @@ int at_tok_nextstr(char **p_cur, char **out);
 
 bool at_tok_hasmore(char **p_cur);
 
+/**
+ * a parameter of a response line, see at_tok_split()
+ * "p" points into the line and is not NUL-terminated
+ */
+typedef struct {
+    const char *p;
+    size_t len;
+    bool quoted;                /* was "...", the quotes are not included */
+} ATToken;
+
+const char *at_tok_params(const char *line);
+int at_tok_split(const char *s, ATToken *p_tokens, size_t maxCount);
+
+int at_tok_toint(const ATToken *p_tok, int *p_out);
+int at_tok_toint64(const ATToken *p_tok, int64_t *p_out);
+int at_tok_tohexint(const ATToken *p_tok, unsigned int *p_out);
+int at_tok_tohexint64(const ATToken *p_tok, uint64_t *p_out);
+int at_tok_tobool(const ATToken *p_tok, bool *p_out);
+int at_tok_tostr(const ATToken *p_tok, char *p_out, size_t size);
+
+#define AT_TOK_MAX_FIELDS 32
+
+/** how a column of at_tok_decode() is stored */
+typedef enum {
+    AT_FIELD_SKIP,              /* no column */
+    AT_FIELD_INT,               /* int, base 10 */
+    AT_FIELD_INT64,             /* int64_t, base 10 */
+    AT_FIELD_HEX,               /* unsigned int, base 16 */
+    AT_FIELD_STRING,            /* ATToken, pointing into the response */
+} ATFieldType;
+
+/** a field of each line, "p_column" is an array of the type, one per row */
+typedef struct {
+    ATFieldType type;
+    void *p_column;
+} ATField;
+
+int at_tok_decode(const ATResponse *p_response, const ATField *p_fields, size_t fieldCount,
+                  size_t maxRows, int *p_errors);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,226 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_trace.h"
+#include "misc.h"
+
+#define MIN_CAPACITY ((size_t)4096)
+
+/* a record is a header word, a timestamp and the data padded to 8 bytes */
+#define RECORD_HEADER_SIZE (2 * sizeof(uint64_t))
+#define ALIGN8(x) (((x) + 7) & ~(size_t)7)
+
+/* the header word: length << 8 | direction << 1 | published */
+#define HEADER_PUBLISHED ((uint64_t)1)
+#define HEADER(len, direction) \
+    (((uint64_t)(len) << 8) | ((uint64_t)(direction) << 1) | HEADER_PUBLISHED)
+
+struct ATTrace {
+    ATTrace *p_prev;
+    size_t capacity;            /* a power of 2 */
+    unsigned char *ring;        /* zeroed wherever nothing is published */
+    char *scratch;              /* for the consumer, records wrapping around */
+
+    _Atomic uint64_t head;      /* reserved by producers up to here */
+    _Atomic uint64_t tail;      /* consumed up to here */
+    atomic_uint_fast64_t dropped;
+    uint64_t droppedReported;   /* consumer only */
+};
+
+static _Atomic uint64_t *headerAt(ATTrace *trace, uint64_t pos)
+{
+    return (_Atomic uint64_t *) (void *) (trace->ring + (pos & (trace->capacity - 1)));
+}
+
+/** copies "len" bytes into the ring at "pos", wrapping around its end */
+static void ringWrite(ATTrace *trace, uint64_t pos, const void *data, size_t len)
+{
+    size_t offset = (size_t) (pos & (trace->capacity - 1));
+    size_t first = trace->capacity - offset;
+
+    if (first >= len) {
+        memcpy(trace->ring + offset, data, len);
+    } else {
+        memcpy(trace->ring + offset, data, first);
+        memcpy(trace->ring, (const unsigned char *) data + first, len - first);
+    }
+}
+
+static void ringRead(ATTrace *trace, uint64_t pos, void *data, size_t len)
+{
+    size_t offset = (size_t) (pos & (trace->capacity - 1));
+    size_t first = trace->capacity - offset;
+
+    if (first >= len) {
+        memcpy(data, trace->ring + offset, len);
+    } else {
+        memcpy(data, trace->ring + offset, first);
+        memcpy((unsigned char *) data + first, trace->ring, len - first);
+    }
+}
+
+static void ringZero(ATTrace *trace, uint64_t pos, size_t len)
+{
+    size_t offset = (size_t) (pos & (trace->capacity - 1));
+    size_t first = trace->capacity - offset;
+
+    if (first >= len) {
+        memset(trace->ring + offset, 0, len);
+    } else {
+        memset(trace->ring + offset, 0, first);
+        memset(trace->ring, 0, len - first);
+    }
+}
+
+ATTrace *traceNew(size_t capacity, ATTrace *p_prev)
+{
+    ATTrace *trace;
+    size_t size = MIN_CAPACITY;
+
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    trace = calloc(1, sizeof(ATTrace));
+    if (trace == NULL) {
+        return NULL;
+    }
+
+    trace->ring = aligned_alloc(sizeof(uint64_t), size);
+    trace->scratch = malloc(size / 4);
+    if (trace->ring == NULL || trace->scratch == NULL) {
+        free(trace->ring);
+        free(trace->scratch);
+        free(trace);
+        return NULL;
+    }
+    memset(trace->ring, 0, size);
+
+    trace->p_prev = p_prev;
+    trace->capacity = size;
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->dropped, 0);
+    trace->droppedReported = 0;
+
+    return trace;
+}
+
+void traceFree(ATTrace *trace)
+{
+    while (trace != NULL) {
+        ATTrace *p_prev = trace->p_prev;
+
+        free(trace->ring);
+        free(trace->scratch);
+        free(trace);
+        trace = p_prev;
+    }
+}
+
+size_t traceCapacity(const ATTrace *trace)
+{
+    return trace->capacity;
+}
+
+bool traceAppend(ATTrace *trace, ATTraceDirection direction, const char *data, size_t len)
+{
+    uint64_t head;
+    uint64_t tail;
+    uint64_t now;
+    size_t size;
+
+    if (len > trace->capacity / 4 - RECORD_HEADER_SIZE) {
+        len = trace->capacity / 4 - RECORD_HEADER_SIZE;
+    }
+    size = RECORD_HEADER_SIZE + ALIGN8(len);
+
+    /* reserve room for the record */
+    head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    do {
+        tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+        if (head + size - tail > trace->capacity) {
+            atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+            return true;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&trace->head, &head, head + size,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    now = monotonicNsec();
+    ringWrite(trace, head + sizeof(uint64_t), &now, sizeof(now));
+    ringWrite(trace, head + RECORD_HEADER_SIZE, data, len);
+
+    /* the consumer stops at the first record not published yet */
+    atomic_store_explicit(headerAt(trace, head), HEADER(len, direction), memory_order_release);
+
+    return head + size - tail > trace->capacity / 2;
+}
+
+void traceDrain(ATTrace *trace, ATChannel* atch, ATTraceCallback callback, void *ctx)
+{
+    uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    uint_fast64_t dropped;
+
+    for (;;) {
+        uint64_t header = atomic_load_explicit(headerAt(trace, tail), memory_order_acquire);
+        ATTraceRecord record;
+        size_t offset;
+        size_t size;
+
+        if ((header & HEADER_PUBLISHED) == 0) {
+            break;
+        }
+
+        record.len = (size_t) (header >> 8);
+        record.direction = (ATTraceDirection) ((header >> 1) & 0x7f);
+        ringRead(trace, tail + sizeof(uint64_t), &record.timeNsec, sizeof(record.timeNsec));
+
+        offset = (size_t) ((tail + RECORD_HEADER_SIZE) & (trace->capacity - 1));
+        if (offset + record.len <= trace->capacity) {
+            record.data = (const char *) trace->ring + offset;
+        } else {
+            ringRead(trace, tail + RECORD_HEADER_SIZE, trace->scratch, record.len);
+            record.data = trace->scratch;
+        }
+
+        callback(atch, &record, ctx);
+
+        /* hand the room back zeroed, so that no stale header looks published */
+        size = RECORD_HEADER_SIZE + ALIGN8(record.len);
+        atomic_store_explicit(headerAt(trace, tail), 0, memory_order_relaxed);
+        ringZero(trace, tail + sizeof(uint64_t), size - sizeof(uint64_t));
+        tail += size;
+        atomic_store_explicit(&trace->tail, tail, memory_order_release);
+    }
+
+    dropped = atomic_load_explicit(&trace->dropped, memory_order_relaxed);
+    if (dropped != trace->droppedReported) {
+        ATTraceRecord record;
+
+        record.timeNsec = monotonicNsec();
+        record.direction = AT_TRACE_DROPPED;
+        record.data = NULL;
+        record.len = (size_t) (dropped - trace->droppedReported);
+        trace->droppedReported = dropped;
+
+        callback(atch, &record, ctx);
+    }
+}
@@ -0,0 +1,63 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_TRACE_H
+#define AT_TRACE_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "atchannel.h"
+
+/**
+ * a ring of binary traffic records, appended to without locks by any
+ * number of threads and drained by one at a time
+ */
+typedef struct ATTrace ATTrace;
+
+/**
+ * returns an empty ring of at least "capacity" bytes, NULL on allocation
+ * failure. "p_prev" is freed along with it, see traceFree()
+ */
+ATTrace *traceNew(size_t capacity, ATTrace *p_prev);
+
+/** frees a ring and all the rings it was created with */
+void traceFree(ATTrace *trace);
+
+size_t traceCapacity(const ATTrace *trace);
+
+/**
+ * appends a record, or counts it as dropped when the ring is full.
+ * records longer than a quarter of the ring are truncated
+ * returns true when the ring is more than half full
+ */
+bool traceAppend(ATTrace *trace, ATTraceDirection direction, const char *data, size_t len);
+
+/**
+ * calls "callback" for each record in order, and for the number of
+ * records dropped since the last call. Callers must serialize.
+ */
+void traceDrain(ATTrace *trace, ATChannel* atch, ATTraceCallback callback, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_TRACE_H */
@@ -0,0 +1,222 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#define _POSIX_C_SOURCE (200809L)
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "at_unsol.h"
+
+#define INITIAL_BUCKETS 16
+
+/* a line is hashed up to the end of its name, eg "+CREG" of "+CREG: 1" */
+#define NAME_DELIMITERS ": "
+
+typedef struct ATUnsolEntry {
+    struct ATUnsolEntry *p_next;    /* longer prefixes first */
+    uint32_t hash;
+    size_t nameLen;
+    size_t prefixLen;
+    ATUnsolCallback callback;
+    void *ctx;
+    char prefix[];
+} ATUnsolEntry;
+
+struct ATUnsolTable {
+    ATUnsolEntry **buckets;
+    size_t bucketCount;         /* a power of 2 */
+    size_t entryCount;
+};
+
+/** FNV-1a */
+static uint32_t hashName(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/** inserts an entry into its bucket, keeping longer prefixes first */
+static void insertEntry(ATUnsolEntry **buckets, size_t bucketCount, ATUnsolEntry *p_entry)
+{
+    ATUnsolEntry **pp_cur = &buckets[p_entry->hash & (bucketCount - 1)];
+
+    while (*pp_cur != NULL && (*pp_cur)->prefixLen > p_entry->prefixLen) {
+        pp_cur = &(*pp_cur)->p_next;
+    }
+    p_entry->p_next = *pp_cur;
+    *pp_cur = p_entry;
+}
+
+static bool grow(ATUnsolTable *table)
+{
+    size_t bucketCount = table->bucketCount * 2;
+    ATUnsolEntry **buckets;
+    size_t i;
+
+    buckets = calloc(bucketCount, sizeof(ATUnsolEntry *));
+    if (buckets == NULL) {
+        return false;
+    }
+
+    for (i = 0; i < table->bucketCount; i++) {
+        ATUnsolEntry *p_entry = table->buckets[i];
+
+        while (p_entry != NULL) {
+            ATUnsolEntry *p_next = p_entry->p_next;
+
+            insertEntry(buckets, bucketCount, p_entry);
+            p_entry = p_next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucketCount = bucketCount;
+
+    return true;
+}
+
+uint32_t unsolHashName(const char *line)
+{
+    return hashName(line, strcspn(line, NAME_DELIMITERS));
+}
+
+ATUnsolTable *unsolTableNew(void)
+{
+    ATUnsolTable *table;
+
+    table = calloc(1, sizeof(ATUnsolTable));
+    if (table == NULL) {
+        return NULL;
+    }
+
+    table->buckets = calloc(INITIAL_BUCKETS, sizeof(ATUnsolEntry *));
+    if (table->buckets == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->bucketCount = INITIAL_BUCKETS;
+
+    return table;
+}
+
+void unsolTableFree(ATUnsolTable *table)
+{
+    size_t i;
+
+    if (table == NULL) {
+        return;
+    }
+
+    for (i = 0; i < table->bucketCount; i++) {
+        ATUnsolEntry *p_entry = table->buckets[i];
+
+        while (p_entry != NULL) {
+            ATUnsolEntry *p_next = p_entry->p_next;
+
+            free(p_entry);
+            p_entry = p_next;
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+bool unsolTableSet(ATUnsolTable *table, const char *prefix, ATUnsolCallback callback, void *ctx)
+{
+    size_t nameLen = strcspn(prefix, NAME_DELIMITERS);
+    size_t prefixLen = strlen(prefix);
+    uint32_t hash = hashName(prefix, nameLen);
+    ATUnsolEntry **pp_cur;
+    ATUnsolEntry *p_entry;
+
+    for (pp_cur = &table->buckets[hash & (table->bucketCount - 1)];
+         *pp_cur != NULL; pp_cur = &(*pp_cur)->p_next) {
+        p_entry = *pp_cur;
+        if (p_entry->hash == hash && p_entry->prefixLen == prefixLen
+            && 0 == strcmp(p_entry->prefix, prefix)) {
+            if (callback == NULL) {
+                *pp_cur = p_entry->p_next;
+                free(p_entry);
+                table->entryCount--;
+            } else {
+                p_entry->callback = callback;
+                p_entry->ctx = ctx;
+            }
+            return true;
+        }
+    }
+
+    if (callback == NULL) {
+        return true;
+    }
+
+    if (table->entryCount >= table->bucketCount && !grow(table)) {
+        return false;
+    }
+
+    p_entry = malloc(sizeof(ATUnsolEntry) + prefixLen + 1);
+    if (p_entry == NULL) {
+        return false;
+    }
+    p_entry->hash = hash;
+    p_entry->nameLen = nameLen;
+    p_entry->prefixLen = prefixLen;
+    p_entry->callback = callback;
+    p_entry->ctx = ctx;
+    memcpy(p_entry->prefix, prefix, prefixLen + 1);
+
+    insertEntry(table->buckets, table->bucketCount, p_entry);
+    table->entryCount++;
+
+    return true;
+}
+
+bool unsolTableLookup(const ATUnsolTable *table, const char *line,
+                      ATUnsolCallback *p_callback, void **p_ctx)
+{
+    size_t nameLen;
+    uint32_t hash;
+    const ATUnsolEntry *p_entry;
+
+    if (table->entryCount == 0) {
+        return false;
+    }
+
+    nameLen = strcspn(line, NAME_DELIMITERS);
+    hash = hashName(line, nameLen);
+
+    for (p_entry = table->buckets[hash & (table->bucketCount - 1)];
+         p_entry != NULL; p_entry = p_entry->p_next) {
+        if (p_entry->hash == hash && p_entry->nameLen == nameLen
+            && 0 == strncmp(p_entry->prefix, line, p_entry->prefixLen)) {
+            *p_callback = p_entry->callback;
+            *p_ctx = p_entry->ctx;
+            return true;
+        }
+    }
+
+    return false;
+}
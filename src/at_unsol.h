@@ -0,0 +1,61 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef AT_UNSOL_H
+#define AT_UNSOL_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "atchannel.h"
+
+/**
+ * a hash table of unsolicited response handlers by prefix
+ * lines are hashed by their name, up to the first ':' or ' ', so that a
+ * lookup costs the same however many handlers are registered
+ */
+typedef struct ATUnsolTable ATUnsolTable;
+
+/** returns the hash of the name of "line", eg "+CREG" of "+CREG: 1" */
+uint32_t unsolHashName(const char *line);
+
+/** returns an empty table, NULL on allocation failure */
+ATUnsolTable *unsolTableNew(void);
+void unsolTableFree(ATUnsolTable *table);
+
+/**
+ * registers "callback" for the lines starting with "prefix", replacing
+ * any handler for the same prefix. A NULL "callback" removes it.
+ * returns false on allocation failure
+ */
+bool unsolTableSet(ATUnsolTable *table, const char *prefix, ATUnsolCallback callback, void *ctx);
+
+/**
+ * looks up the handler of the longest registered prefix of "line"
+ * returns false if there is none
+ */
+bool unsolTableLookup(const ATUnsolTable *table, const char *line,
+                      ATUnsolCallback *p_callback, void **p_ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AT_UNSOL_H */
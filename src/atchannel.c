@@ -25,13 +25,28 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdatomic.h>
 
 #include "atchannel.h"
 #include "at_tok.h"
+#include "at_cache.h"
+#include "at_classify.h"
+#include "at_response.h"
+#include "at_sched.h"
+#include "at_stats.h"
+#include "at_timer.h"
+#include "at_trace.h"
+#include "at_unsol.h"
+#include "memscan.h"
 #include "misc.h"
 
 
@@ -56,49 +71,206 @@ typedef enum {
 } ATCommandType;
 
 #define MAX_AT_RESPONSE ((size_t)(8 * 1024))
+#define DEFAULT_MAX_LINE_LENGTH ((size_t)(64 * 1024))
+#define DEFAULT_DISPATCH_QUEUE_LENGTH ((size_t)64)
+#define DEFAULT_TRACE_CAPACITY ((size_t)(64 * 1024))
+#define TRACE_DRAIN_INTERVAL_MSEC 100
+#define MAX_BATCH_LINE_LENGTH ((size_t)128)   /* well within what modems take */
+#define MAX_OVERTAKEN_NSEC (1000ULL * 1000 * 1000)  /* commands are not overtaken after */
+
+/**
+ * an entry of the per-channel submission queue
+ * the strings are copied into the same allocation, right after the struct
+ */
+typedef struct ATCommand ATCommand;
+
+typedef struct {
+    ATCommand *p_head;
+    ATCommand *p_tail;
+} ATCommandList;
+
+struct ATCommand {
+    ATCommand *p_next;
+
+    ATCommandType type;
+    const char *command;
+    size_t commandLen;
+    const char *responsePrefix;
+    const char *smsPDU;
+    size_t smsPDULen;
+    long long timeoutMsec;
+    uint64_t deadline;          /* CLOCK_MONOTONIC ns, valid once started */
+    ATPriority priority;
+    uint64_t queuedAt;          /* CLOCK_MONOTONIC ns */
+    uint64_t cacheGeneration;   /* of its cache rule when written, see cacheStore() */
+
+    ATResponse *p_response;
+    ATReturn err;
+    bool started;               /* written to the channel, awaiting response */
+    bool done;
+    bool reportTimeout;         /* the one of a timed out wire command to report it */
+
+    /* NULL for synchronous commands, whose issuer waits on commandcond */
+    ATCommandCallback callback;
+    void *ctx;
+
+    /* identical queries sharing the response, see at_set_coalescing() */
+    ATCommandList followers;
+
+    /* intermediate responses of a streamed MULTILINE command */
+    ATLineCallback lineCallback;
+    void *lineCtx;
+    size_t maxBufferedLines;
+    size_t lineCount;
+
+    /* raw payload announced by the intermediate response, see at_send_command_payload() */
+    bool hasPayload;
+    char *payload;
+    size_t payloadSize;
+    size_t payloadRead;
+    size_t *p_payloadLen;
+};
+
+/** an unsolicited response queued for a dispatcher thread */
+typedef struct ATUnsolItem {
+    struct ATUnsolItem *p_next;
+    char *sms_pdu;              /* NULL or right after line */
+    size_t lineLen;
+    char line[];
+} ATUnsolItem;
+
+typedef struct {
+    ATChannel *atch;
+    pthread_t tid;
+    pthread_cond_t cond;
+    ATUnsolItem *p_head;
+    ATUnsolItem *p_tail;
+    size_t count;
+    bool stopping;
+} ATDispatcher;
 
 struct ATChannelImpl {
     pthread_t tid_reader;
 
-    /* for input buffering */
-    char ATBuffer[MAX_AT_RESPONSE+1];
-    char *ATBufferCur;
+    /*
+     * for input buffering
+     * ATBuffer is a ring, complete lines are returned in place unless they
+     * wrap around its end or outgrow it, then they are gathered in spill
+     */
+    char ATBuffer[MAX_AT_RESPONSE+1];   /* one spare byte for a terminator */
+    size_t ATBufferStart;
+    size_t ATBufferLen;
+    size_t ATBufferScanned;     /* bytes of the partial line without EOL */
+
+    char *spill;
+    size_t spillLen;
+    size_t spillCapacity;
+    bool spillReturned;         /* spill holds the last line returned */
+    bool spillDiscarding;       /* dropping the rest of an oversized line */
+    atomic_size_t maxLineLength;
+    bool lineEndedCR;           /* the last line returned ended with \r */
+
+    /*
+     * raw payload following the last line, taken before any further line
+     * payloadCommand is protected by commandmutex, NULL once it is finished,
+     * which waits while payloadReading tells the reader is filling it
+     */
+    ATCommand *payloadCommand;
+    bool payloadReading;
+    bool payloadFinishing;      /* a command waits for payloadReading */
+    size_t payloadRemaining;
+    bool payloadSkipLF;         /* the \n of a \r\n line end comes first */
+
+    /* first line of a two-line SMS unsolicited response */
+    char *smsUnsolLine;
+    size_t smsUnsolLineLen;
+    _Atomic(ATClassifier *) classifier;   /* replaced, never changed */
+
+    pthread_mutex_t unsolmutex;
+    ATUnsolTable *unsolTable;   /* NULL until a handler is registered */
+
+    /*
+     * unsolicited responses queued for the dispatcher threads
+     * these are protected by dispatchmutex
+     */
+    pthread_mutex_t dispatchmutex;
+    pthread_cond_t dispatchcond;        /* room in a queue, or changed */
+    ATDispatcher *dispatchers;
+    size_t dispatcherCount;
+    size_t dispatchQueueLength;
+    bool dispatchChanging;
 
     /*
-     * for current pending command
+     * submission queue, the head is the command in flight
      * these are protected by commandmutex
      */
     pthread_mutex_t commandmutex;
     pthread_cond_t commandcond;
 
-    ATCommandType type;
-    const char *responsePrefix;
-    const char *smsPDU;
-    ATResponse *p_response;
+    ATCommandList queue;        /* by priority, see enqueueCommand() */
+    ATStats *stats;
+    ATScheduler *scheduler;
+    ATCache *cache;             /* NULL until at_cache_command() */
+    bool coalescing;
+    ATSmsStats smsStats;        /* sentPerSec is left to at_get_sms_stats() */
 
     bool readerClosed;
+    bool readerRunning;         /* until the reader thread exits */
+    bool readerStopping;        /* asked to exit by at_detach() */
+
+    /* recycles the arenas of the responses of this channel */
+    ATResponsePool *responsePool;
+
+    /* wakes up the reader when a command with a deadline is started */
+    int wakeupfd;
+
+    /* set when the channel is serviced by a shared ATEngine */
+    ATEngine *engine;
+    uint32_t engineSlot;
+    ATTimer deadlineTimer;      /* in the engine wheel, protected by its timermutex */
+
+    /*
+     * traffic tracing, see at_trace_enable()
+     * trace is appended to without a lock, the rest is protected by
+     * tracemutex
+     */
+    _Atomic(ATTrace *) trace;   /* NULL unless tracing */
+    ATTrace *traceRings;        /* the latest ring, with all the earlier ones */
+    pthread_mutex_t tracemutex;
+    pthread_cond_t tracecond;   /* records to drain, or stopping */
+    pthread_t traceThread;
+    bool traceThreadRunning;
+    bool traceStopping;
+    ATChannel *traceChannel;
+    ATTraceCallback traceCallback;
+    void *traceCtx;
+
+    /* detached while its reader was still using it, the reader frees it */
+    bool detached;
 };
 
-static void onReaderClosed(ATChannel* atch);
-static ATReturn writeCtrlZ(ATChannel* atch, const char *s);
-static ATReturn writeline(ATChannel* atch, const char *s);
-static void outputLog(ATChannel* atch, int level, const char* format, ...);
+struct ATFuture {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool done;
+    ATReturn err;
+    ATResponse *p_response;
+};
 
-static void setTimespecRelative(struct timespec *p_ts, long long msec)
-{
-    const int NS_PER_S = 1000 * 1000 * 1000;
-    struct timeval tv;
+/* the channel whose unsolicited responses this thread dispatches */
+static _Thread_local ATChannel *s_dispatchedChannel;
 
-    gettimeofday(&tv, (struct timezone *) NULL);
+/* the channel whose trace records this thread is handing out */
+static _Thread_local ATChannel *s_tracingChannel;
 
-    p_ts->tv_sec = tv.tv_sec + (msec / 1000);
-    p_ts->tv_nsec = (tv.tv_usec + (msec % 1000) * 1000L ) * 1000L;
-    /* assuming tv.tv_usec < 10^6 */
-    if (p_ts->tv_nsec >= NS_PER_S) {
-        p_ts->tv_sec++;
-        p_ts->tv_nsec -= NS_PER_S;
-    }
-}
+static void onReaderClosed(ATChannel* atch);
+static void freeImpl(ATChannelImpl *impl);
+static bool isReaderThread(ATChannel* atch);
+static ATReturn writeCtrlZ(ATChannel* atch, const char *s, size_t len);
+static ATReturn writeline(ATChannel* atch, const char *s, size_t len);
+static void outputLog(ATChannel* atch, int level, const char* format, ...);
+static void engineArmDeadline(ATChannel* atch, uint64_t deadline);
+static void engineDisarmDeadline(ATChannel* atch);
 
 static void sleepMsec(long long msec)
 {
@@ -113,962 +285,3947 @@ static void sleepMsec(long long msec)
     } while (err < 0 && errno == EINTR);
 }
 
-/** add an intermediate response to p_response*/
-static void addIntermediate(ATChannel* atch, const char *line)
+/** add an intermediate response to the response of the command in flight */
+static void addIntermediate(ATChannel* atch, const char *line, size_t len)
 {
-    ATLine *p_new;
+    ATResponse **pp_response = &atch->impl->queue.p_head->p_response;
 
-    p_new = (ATLine  *) calloc(1, sizeof(ATLine));
-
-    p_new->line = strdup(line);
-
-    /* note: this adds to the head of the list, so the list
-       will be in reverse order of lines received. the order is flipped
-       again before passing on to the command issuer */
-    p_new->p_next = atch->impl->p_response->p_intermediates;
-    atch->impl->p_response->p_intermediates = p_new;
+    if ((*pp_response)->timing.firstLine == 0) {
+        (*pp_response)->timing.firstLine = monotonicNsec();
+    }
+    if (!responseAddIntermediate(pp_response, line, len)) {
+        RLOGE(atch, "Dropping intermediate response: out of memory.");
+    }
 }
 
 /**
- * returns true if line is a final response indicating error
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * Hands an intermediate response of a streamed command to its callback,
+ * keeping it too while there is room
+ * assumes commandmutex is held
  */
-static const char * const s_finalResponsesError[] = {
-    "ERROR",
-    "+CMS ERROR:",
-    "+CME ERROR:",
-    "NO CARRIER", /* sometimes! */
-    "NO ANSWER",
-    "NO DIALTONE",
-};
-static bool isFinalResponseError(const char *line)
+static void streamIntermediate(ATChannel* atch, const char *line, size_t len)
 {
-    size_t i;
+    ATCommand *p_cmd = atch->impl->queue.p_head;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesError) ; i++) {
-        if (strStartsWith(line, s_finalResponsesError[i])) {
-            return true;
-        }
+    if (p_cmd->lineCount < p_cmd->maxBufferedLines) {
+        addIntermediate(atch, line, len);
+    } else if (p_cmd->p_response->timing.firstLine == 0) {
+        p_cmd->p_response->timing.firstLine = monotonicNsec();
     }
+    p_cmd->lineCount++;
 
-    return false;
+    p_cmd->lineCallback(atch, line, len, p_cmd->lineCtx);
 }
 
 /**
- * returns true if line is a final response indicating success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
+ * Keeps the intermediate response announcing the raw payload of the
+ * command in flight, and sets the reader to take as many bytes as the
+ * first number after the prefix before any further line
+ * assumes commandmutex is held
  */
-static const char * const s_finalResponsesSuccess[] = {
-    "OK",
-    "CONNECT"       /* some stacks start up data on another channel */
-};
-static bool isFinalResponseSuccess(const char *line)
+static void beginPayload(ATChannel* atch, const char *line, size_t lineLen)
 {
-    size_t i;
+    ATChannelImpl *impl = atch->impl;
+    ATCommand *p_cmd = impl->queue.p_head;
+    const char *cur = line + strlen(p_cmd->responsePrefix);
+    size_t len = 0;
 
-    for (i = 0 ; i < NUM_ELEMS(s_finalResponsesSuccess) ; i++) {
-        if (strStartsWith(line, s_finalResponsesSuccess[i])) {
-            return true;
+    addIntermediate(atch, line, lineLen);
+
+    while (*cur != '\0' && !isdigit(*cur)) {
+        cur++;
+    }
+    for (; isdigit(*cur); cur++) {
+        if (len > (SIZE_MAX - 9) / 10) {
+            RLOGE(atch, "Ignoring payload of invalid length: %s", line);
+            return;
         }
+        len = len * 10 + (size_t) (*cur - '0');
     }
 
-    return false;
-}
-
-#if 0   /* unused function. */
-/**
- * returns true if line is a final response, either  error or success
- * See 27.007 annex B
- * WARNING: NO CARRIER and others are sometimes unsolicited
- */
-static bool isFinalResponse(const char *line)
-{
-    return isFinalResponseSuccess(line) || isFinalResponseError(line);
+    *p_cmd->p_payloadLen = len;
+    if (len > 0) {
+        impl->payloadCommand = p_cmd;
+        impl->payloadRemaining = len;
+        impl->payloadSkipLF = impl->lineEndedCR;
+    }
 }
-#endif  /* 0 */
 
 /**
- * returns true if line is the first line in (what will be) a two-line
- * SMS unsolicited response
+ * Interrupts the reader waiting for input so that it picks up
+ * the deadline of a newly started command
  */
-static const char * const s_smsUnsoliciteds[] = {
-    "+CMT:",
-    "+CDS:",
-    "+CBM:"
-};
-static bool isSMSUnsolicited(const char *line)
+static void wakeReader(ATChannel* atch)
 {
-    size_t i;
+    uint64_t one = 1;
+    ssize_t written;
 
-    for (i = 0 ; i < NUM_ELEMS(s_smsUnsoliciteds) ; i++) {
-        if (strStartsWith(line, s_smsUnsoliciteds[i])) {
-            return true;
-        }
+    if (atch->impl->engine != NULL
+        || 0 != pthread_equal(atch->impl->tid_reader, pthread_self())) {
+        /* the reader will look at the deadline before waiting again */
+        return;
     }
 
-    return false;
+    do {
+        written = write(atch->impl->wakeupfd, &one, sizeof(one));
+    } while (written < 0 && errno == EINTR);
 }
 
-/** assumes commandmutex is held */
-static void handleFinalResponse(ATChannel* atch, const char *line)
+static void commandListAppend(ATCommandList *p_list, ATCommand *p_cmd)
 {
-    atch->impl->p_response->finalResponse = strdup(line);
-
-    pthread_cond_signal(&atch->impl->commandcond);
+    p_cmd->p_next = NULL;
+    if (p_list->p_tail == NULL) {
+        p_list->p_head = p_cmd;
+    } else {
+        p_list->p_tail->p_next = p_cmd;
+    }
+    p_list->p_tail = p_cmd;
 }
 
-static void handleUnsolicited(ATChannel* atch, const char *line)
+static ATCommand * commandListPop(ATCommandList *p_list)
 {
-    if (atch->unsolHandler != NULL) {
-        atch->unsolHandler(atch, line);
+    ATCommand *p_cmd = p_list->p_head;
+
+    if (p_cmd != NULL) {
+        p_list->p_head = p_cmd->p_next;
+        if (p_list->p_head == NULL) {
+            p_list->p_tail = NULL;
+        }
+        p_cmd->p_next = NULL;
     }
+
+    return p_cmd;
 }
 
-static void processLine(ATChannel* atch, const char *line)
+static ATCommand * newCommand(const char *command, size_t commandLen, ATCommandType type,
+                    const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATCommandCallback callback, void *ctx)
 {
-    pthread_mutex_lock(&atch->impl->commandmutex);
-
-    if (atch->impl->p_response == NULL) {
-        /* no command pending */
-        handleUnsolicited(atch, line);
-    } else if (isFinalResponseSuccess(line)) {
-        atch->impl->p_response->success = true;
-        handleFinalResponse(atch, line);
-    } else if (isFinalResponseError(line)) {
-        atch->impl->p_response->success = false;
-        handleFinalResponse(atch, line);
-    } else if (atch->impl->smsPDU != NULL && 0 == strcmp(line, "> ")) {
-        // See eg. TS 27.005 4.3
-        // Commands like AT+CMGS have a "> " prompt
-        writeCtrlZ(atch, atch->impl->smsPDU);
-        atch->impl->smsPDU = NULL;
-    } else switch (atch->impl->type) {
-        case NO_RESULT:
-            handleUnsolicited(atch, line);
-            break;
-        case NUMERIC:
-            if (atch->impl->p_response->p_intermediates == NULL
-                && isdigit(line[0])
-            ) {
-                addIntermediate(atch, line);
-            } else {
-                /* either we already have an intermediate response or
-                   the line doesn't begin with a digit */
-                handleUnsolicited(atch, line);
-            }
-            break;
-        case SINGLELINE:
-            if (atch->impl->p_response->p_intermediates == NULL
-                && strStartsWith(line, atch->impl->responsePrefix)
-            ) {
-                addIntermediate(atch, line);
-            } else {
-                /* we already have an intermediate response */
-                handleUnsolicited(atch, line);
-            }
-            break;
-        case MULTILINE:
-            if (strStartsWith(line, atch->impl->responsePrefix)) {
-                addIntermediate(atch, line);
-            } else {
-                handleUnsolicited(atch, line);
-            }
-            break;
+    size_t prefixSize = responsePrefix != NULL ? strlen(responsePrefix) + 1 : 0;
+    size_t pduLen = smspdu != NULL ? strlen(smspdu) : 0;
+    ATCommand *p_cmd;
+    char *p_str;
+
+    p_cmd = (ATCommand *) calloc(1, sizeof(ATCommand) + commandLen + 1 + prefixSize
+                                    + (smspdu != NULL ? pduLen + 1 : 0));
+    if (p_cmd == NULL) {
+        return NULL;
+    }
 
-        default: /* this should never be reached */
-            RLOGE(atch, "Unsupported AT command type %d.", atch->impl->type);
-            handleUnsolicited(atch, line);
-            break;
+    p_str = (char *) (p_cmd + 1);
+    p_cmd->command = memcpy(p_str, command, commandLen);
+    p_cmd->commandLen = commandLen;
+    p_str += commandLen + 1;
+    if (responsePrefix != NULL) {
+        p_cmd->responsePrefix = memcpy(p_str, responsePrefix, prefixSize);
+        p_str += prefixSize;
+    }
+    if (smspdu != NULL) {
+        p_cmd->smsPDU = memcpy(p_str, smspdu, pduLen + 1);
+        p_cmd->smsPDULen = pduLen;
     }
 
-    pthread_mutex_unlock(&atch->impl->commandmutex);
+    p_cmd->type = type;
+    p_cmd->timeoutMsec = timeoutMsec;
+    p_cmd->callback = callback;
+    p_cmd->ctx = ctx;
+
+    return p_cmd;
 }
 
 /**
- * Returns a pointer to the end of the next line
- * special-cases the "> " SMS prompt
- *
- * returns NULL if there is no complete line
+ * Hands a command its result. Synchronous issuers are woken up,
+ * asynchronous commands are put on "p_done" for completeCommands()
+ * assumes commandmutex is held
  */
-static char * findNextEOL(char *cur)
+static void notifyCommand(ATChannel* atch, ATCommand *p_cmd, ATReturn err,
+                    ATResponse *p_response, ATCommandList *p_done)
 {
-    if (cur[0] == '>' && cur[1] == ' ' && cur[2] == '\0') {
-        /* SMS prompt character...not \r terminated */
-        return cur+2;
-    }
+    p_cmd->p_response = p_response;
+    p_cmd->err = err;
+    p_cmd->done = true;
 
-    // Find next newline
-    while (*cur != '\0' && *cur != '\r' && *cur != '\n') cur++;
-
-    return *cur == '\0' ? NULL : cur;
+    if (p_cmd->callback == NULL) {
+        /* the issuer owns the command, see at_send_command_full_nolock() */
+        pthread_cond_broadcast(&atch->impl->commandcond);
+    } else {
+        commandListAppend(p_done, p_cmd);
+    }
 }
 
 /**
- * Reads a line from the AT channel, returns NULL on timeout.
- * Assumes it has exclusive read access to the FD
- *
- * This line is valid only until the next call to readline
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * Marks a command already taken off the submission queue as done, along
+ * with the commands coalesced into it
+ * assumes commandmutex is held
  */
-static const char *readline(ATChannel* atch)
+static void finishCommand(ATChannel* atch, ATCommand *p_cmd, ATReturn err,
+                    ATCommandList *p_done)
 {
-    ssize_t count;
+    ATResponse *p_response = p_cmd->p_response;
+    ATCommand *p_follower;
+    bool reported;
+
+    if (err == AT_SUCCESS && p_response != NULL
+        && (p_cmd->type == SINGLELINE || p_cmd->type == NUMERIC)
+        && p_response->success
+        && p_response->p_intermediates == NULL
+    ) {
+        /* successful command must have an intermediate response */
+        err = AT_ERROR_INVALID_RESPONSE;
+    }
 
-    char *p_read = NULL;
-    char *p_eol = NULL;
-    char *ret;
+    statsRecord(atch->impl->stats, p_cmd->command, err, p_response);
 
-    /* this is a little odd. I use *ATBufferCur == 0 to
-     * mean "buffer consumed completely". If it points to a character, than
-     * the buffer continues until a \0
-     */
-    if (*atch->impl->ATBufferCur == '\0') {
-        /* empty buffer */
-        atch->impl->ATBufferCur = atch->impl->ATBuffer;
-        *atch->impl->ATBufferCur = '\0';
-        p_read = atch->impl->ATBuffer;
-    } else {   /* *ATBufferCur != '\0' */
-        /* there's data in the buffer from the last read */
+    if (atch->impl->payloadCommand == p_cmd) {
+        /* the issuer may reuse the buffer once notified, so let a read end */
+        while (atch->impl->payloadReading) {
+            atch->impl->payloadFinishing = true;
+            pthread_cond_wait(&atch->impl->commandcond, &atch->impl->commandmutex);
+        }
+        /* the reader drops the rest of the payload */
+        atch->impl->payloadCommand = NULL;
+    }
+
+    if (atch->impl->cache != NULL && err == AT_SUCCESS && p_response->success
+        && p_cmd->lineCallback == NULL && !p_cmd->hasPayload) {
+        cacheStore(atch->impl->cache, p_cmd->command, p_cmd->commandLen, (int) p_cmd->type,
+                   p_cmd->responsePrefix, p_response, p_cmd->cacheGeneration, monotonicNsec());
+    }
 
-        // skip over leading newlines
-        while (*atch->impl->ATBufferCur == '\r' || *atch->impl->ATBufferCur == '\n')
-            atch->impl->ATBufferCur++;
+    if (err != AT_SUCCESS && p_response != NULL) {
+        at_response_free(p_response);
+        p_response = NULL;
+    }
 
-        p_eol = findNextEOL(atch->impl->ATBufferCur);
+    /* one timeout is reported per command written, by a synchronous issuer */
+    p_cmd->reportTimeout = err == AT_ERROR_TIMEOUT && p_cmd->callback == NULL;
+    reported = p_cmd->reportTimeout;
 
-        if (p_eol == NULL) {
-            /* a partial line. move it up and prepare to read more */
-            size_t len;
+    while ((p_follower = commandListPop(&p_cmd->followers)) != NULL) {
+        ATResponse *p_copy = NULL;
+        ATReturn followerErr = err;
 
-            len = strlen(atch->impl->ATBufferCur);
+        p_follower->reportTimeout = !reported && err == AT_ERROR_TIMEOUT
+                                    && p_follower->callback == NULL;
+        reported = reported || p_follower->reportTimeout;
 
-            memmove(atch->impl->ATBuffer, atch->impl->ATBufferCur, len + 1);
-            p_read = atch->impl->ATBuffer + len;
-            atch->impl->ATBufferCur = atch->impl->ATBuffer;
+        if (p_response != NULL) {
+            p_copy = responseCopy(p_response);
+            if (p_copy == NULL) {
+                followerErr = AT_ERROR_GENERIC;
+            }
         }
-        /* Otherwise, (p_eol !- NULL) there is a complete line  */
-        /* that will be returned the while () loop below        */
+        notifyCommand(atch, p_follower, followerErr, p_copy, p_done);
     }
 
-    while (p_eol == NULL) {
-        if (0 == MAX_AT_RESPONSE - (size_t)(p_read - atch->impl->ATBuffer)) {
-            RLOGE(atch, "ERROR: Input line exceeded buffer.");
-            /* ditch buffer and start over again */
-            atch->impl->ATBufferCur = atch->impl->ATBuffer;
-            *atch->impl->ATBufferCur = '\0';
-            p_read = atch->impl->ATBuffer;
-        }
+    notifyCommand(atch, p_cmd, err, p_response, p_done);
+}
 
-        do {
-            count = read(atch->fd, p_read,
-                            MAX_AT_RESPONSE - (size_t)(p_read - atch->impl->ATBuffer));
-        } while (count < 0 && errno == EINTR);
+/**
+ * Writes out the head of the submission queue unless it is already in flight.
+ * Commands that cannot be written are finished with the error and the next
+ * one is tried.
+ * assumes commandmutex is held
+ */
+static void startCommands(ATChannel* atch, ATCommandList *p_done)
+{
+    ATCommandList *p_queue = &atch->impl->queue;
+    ATCommand *p_cmd;
 
-        if (count > 0) {
-            AT_DUMP( atch, "<< ", p_read, count );
+    while ((p_cmd = p_queue->p_head) != NULL && !p_cmd->started) {
+        ATReturn err;
 
-            p_read[count] = '\0';
+        schedulerDequeued(atch->impl->scheduler, p_cmd->priority,
+                          monotonicNsec() - p_cmd->queuedAt);
 
-            // skip over leading newlines
-            while (*atch->impl->ATBufferCur == '\r' || *atch->impl->ATBufferCur == '\n')
-                atch->impl->ATBufferCur++;
-
-            p_eol = findNextEOL(atch->impl->ATBufferCur);
-            p_read += count;
-        } else if (count <= 0) {
-            /* read error encountered or EOF reached */
-            if(count == 0) {
-                RLOGD(atch, "atchannel: EOF reached.");
-            } else {
-                RLOGE(atch, "atchannel: read error %s.", strerror(errno));
+        p_cmd->p_response = responseNew(atch->impl->responsePool);
+        if (p_cmd->p_response == NULL) {
+            err = AT_ERROR_GENERIC;
+        } else {
+            if (atch->impl->cache != NULL) {
+                p_cmd->cacheGeneration = cacheGeneration(atch->impl->cache, p_cmd->command,
+                                                         p_cmd->commandLen);
             }
-            return NULL;
+            p_cmd->p_response->timing.writeStart = monotonicNsec();
+            err = writeline(atch, p_cmd->command, p_cmd->commandLen);
+            p_cmd->p_response->timing.writeEnd = monotonicNsec();
         }
-    }
 
-    /* a full line in the buffer. Place a \0 over the \r and return */
-
-    ret = atch->impl->ATBufferCur;
-    *p_eol = '\0';
-    atch->impl->ATBufferCur = p_eol + 1; /* this will always be <= p_read,    */
-                              /* and there will be a \0 at *p_read */
+        if (err == AT_SUCCESS) {
+            p_cmd->started = true;
+            if (p_cmd->timeoutMsec != 0) {
+                p_cmd->deadline = p_cmd->p_response->timing.writeEnd
+                                    + (uint64_t) p_cmd->timeoutMsec * 1000000ULL;
+                if (atch->impl->engine != NULL) {
+                    engineArmDeadline(atch, p_cmd->deadline);
+                } else {
+                    wakeReader(atch);
+                }
+            }
+            break;
+        }
 
-    RLOGD(atch, "AT< %s", ret);
-    return ret;
+        commandListPop(p_queue);
+        finishCommand(atch, p_cmd, err, p_done);
+    }
 }
 
-static void onReaderClosed(ATChannel* atch)
+/**
+ * returns true for the read-only forms of a command, that can share a
+ * response: a read or test command ending with "?"; not an action or set
+ * command, eg AT+CMGL marks the unread messages read
+ */
+static bool isQueryCommand(const char *command, size_t len)
 {
-    if (atch->onCloseHandler != NULL && !atch->impl->readerClosed) {
-
-        pthread_mutex_lock(&atch->impl->commandmutex);
-        atch->impl->readerClosed = true;
-        pthread_cond_signal(&atch->impl->commandcond);
-        pthread_mutex_unlock(&atch->impl->commandmutex);
+    return len > 0 && command[len - 1] == '?';
+}
 
-        atch->onCloseHandler(atch);
+/**
+ * returns true if "p_leader" is done by the time "p_cmd" would time out
+ * on its own: "p_cmd" would be written no earlier than now, and no
+ * earlier than "p_leader" if that one is not written yet
+ */
+static bool finishesInTime(const ATCommand *p_leader, const ATCommand *p_cmd, uint64_t now)
+{
+    if (p_cmd->timeoutMsec == 0) {
+        return true;
+    }
+    if (p_leader->timeoutMsec == 0) {
+        return false;
     }
+    if (!p_leader->started) {
+        return p_leader->timeoutMsec <= p_cmd->timeoutMsec;
+    }
+
+    return p_leader->deadline <= now + (uint64_t) p_cmd->timeoutMsec * 1000000ULL;
 }
 
-static void *readerLoop(void *arg)
+/**
+ * Returns the queued command "p_cmd" can share the response of, if any:
+ * an identical query, one that expects an intermediate response, has no
+ * SMS PDU, and times out no later than "p_cmd" would
+ * assumes commandmutex is held
+ */
+static ATCommand * findLeader(ATChannel* atch, const ATCommand *p_cmd)
 {
-    ATChannel* atch = (ATChannel*)arg;
+    ATCommand *p_queued;
+    uint64_t now;
 
-    for (;;) {
-        const char * line;
-
-        line = readline(atch);
+    if (p_cmd->type == NO_RESULT || p_cmd->smsPDU != NULL || p_cmd->lineCallback != NULL
+        || p_cmd->hasPayload || !isQueryCommand(p_cmd->command, p_cmd->commandLen)) {
+        return NULL;
+    }
 
-        if (line == NULL) {
-            break;
+    now = monotonicNsec();
+    for (p_queued = atch->impl->queue.p_head; p_queued != NULL; p_queued = p_queued->p_next) {
+        if (p_queued->type == p_cmd->type
+            && p_queued->smsPDU == NULL
+            && p_queued->lineCallback == NULL
+            && !p_queued->hasPayload
+            && p_queued->commandLen == p_cmd->commandLen
+            && 0 == memcmp(p_queued->command, p_cmd->command, p_cmd->commandLen)
+            && (p_cmd->responsePrefix == NULL
+                || 0 == strcmp(p_queued->responsePrefix, p_cmd->responsePrefix))
+            && finishesInTime(p_queued, p_cmd, now)
+        ) {
+            return p_queued;
         }
+    }
+
+    return NULL;
+}
+
+/**
+ * Queues a command behind those of its priority or higher, and behind
+ * those that have waited too long to be overtaken
+ * The queue is thus in priority order but for such commands, and a
+ * command before a higher one was not to be overtaken any more when that
+ * one was queued, so the tail tells when appending is all there is to do.
+ * assumes commandmutex is held
+ */
+static void enqueueCommand(ATChannel* atch, ATCommand *p_cmd)
+{
+    ATCommandList *p_queue = &atch->impl->queue;
+    ATCommand **pp_next;
+    uint64_t overtakenSince;
 
-        if(isSMSUnsolicited(line)) {
-            char *line1;
-            const char *line2;
+    if (p_queue->p_tail == NULL || p_queue->p_tail->priority >= p_cmd->priority) {
+        commandListAppend(p_queue, p_cmd);
+        return;
+    }
 
-            // The scope of string returned by 'readline()' is valid only
-            // till next call to 'readline()' hence making a copy of line
-            // before calling readline again.
-            line1 = strdup(line);
-            line2 = readline(atch);
+    overtakenSince = p_cmd->queuedAt > MAX_OVERTAKEN_NSEC
+                        ? p_cmd->queuedAt - MAX_OVERTAKEN_NSEC : 0;
 
-            if (line2 == NULL) {
-                free(line1);
-                break;
-            }
+    for (pp_next = &p_queue->p_head; *pp_next != NULL; pp_next = &(*pp_next)->p_next) {
+        const ATCommand *p_queued = *pp_next;
 
-            if (atch->unsolSmsHandler != NULL) {
-                atch->unsolSmsHandler(atch, line1, line2);
-            }
-            free(line1);
-        } else {
-            processLine(atch, line);
+        if (!p_queued->started && p_queued->priority < p_cmd->priority
+            && p_queued->queuedAt > overtakenSince) {
+            p_cmd->p_next = *pp_next;
+            *pp_next = p_cmd;
+            return;
         }
     }
 
-    onReaderClosed(atch);
-
-    return NULL;
+    commandListAppend(p_queue, p_cmd);
 }
 
 /**
- * Sends string s to the radio with a \r appended.
- * Returns AT_ERROR_* on error, AT_SUCCESS on success
- *
- * This function exists because as of writing, android libc does not
- * have buffered stdio.
+ * Queues a command and writes it out if the channel is idle, or has it
+ * share the response of an identical query when coalescing
+ * assumes commandmutex is held
  */
-static ATReturn writeline(ATChannel* atch, const char *s)
+static void submitCommand(ATChannel* atch, ATCommand *p_cmd, ATCommandList *p_done)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
+    ATCommand *p_leader = NULL;
 
-    if (atch->fd < 0 || atch->impl->readerClosed) {
-        return AT_ERROR_CHANNEL_CLOSED;
+    if (atch->impl->coalescing) {
+        p_leader = findLeader(atch, p_cmd);
+    }
+    if (p_leader != NULL) {
+        commandListAppend(&p_leader->followers, p_cmd);
+        return;
     }
 
-    RLOGD(atch, "AT> %s", s);
+    p_cmd->priority = schedulerClassify(atch->impl->scheduler, p_cmd->command);
+    p_cmd->queuedAt = monotonicNsec();
+    schedulerQueued(atch->impl->scheduler, p_cmd->priority);
 
-    AT_DUMP( atch, ">> ", s, strlen(s) );
+    enqueueCommand(atch, p_cmd);
+    startCommands(atch, p_done);
+}
 
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write(atch->fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+/**
+ * Queues the commands of a script as one run, in their order and all in
+ * the highest class among them, so that none overtakes another and no
+ * other command goes in between but one of a higher class; they are never
+ * coalesced
+ * assumes commandmutex is held
+ */
+static void submitBatch(ATChannel* atch, ATCommand **pp_cmds, size_t count,
+                        ATCommandList *p_done)
+{
+    ATCommandList *p_queue = &atch->impl->queue;
+    ATPriority priority = AT_PRIORITY_BULK;
+    uint64_t now = monotonicNsec();
+    size_t i;
 
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
-        }
+    for (i = 0; i < count; i++) {
+        ATPriority entryPriority = schedulerClassify(atch->impl->scheduler, pp_cmds[i]->command);
 
-        cur += (size_t)written;
+        if (entryPriority > priority) {
+            priority = entryPriority;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        pp_cmds[i]->priority = priority;
+        pp_cmds[i]->queuedAt = now;
+        schedulerQueued(atch->impl->scheduler, priority);
     }
 
-    /* the \r  */
-    do {
-        written = write(atch->fd, "\r" , 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+    /* the first finds the place of the run, the rest follow it */
+    enqueueCommand(atch, pp_cmds[0]);
+    for (i = 1; i < count; i++) {
+        ATCommand *p_prev = pp_cmds[i - 1];
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
+        pp_cmds[i]->p_next = p_prev->p_next;
+        p_prev->p_next = pp_cmds[i];
+        if (p_queue->p_tail == p_prev) {
+            p_queue->p_tail = pp_cmds[i];
+        }
     }
-
-    return AT_SUCCESS;
+    startCommands(atch, p_done);
 }
 
-static ATReturn writeCtrlZ(ATChannel* atch, const char *s)
+/**
+ * Finishes the command in flight and starts the next one
+ * assumes commandmutex is held
+ */
+static void finishHeadCommand(ATChannel* atch, ATReturn err, ATCommandList *p_done)
 {
-    size_t cur = 0;
-    size_t len = strlen(s);
-    ssize_t written;
+    ATCommand *p_cmd;
 
-    if (atch->fd < 0 || atch->impl->readerClosed) {
-        return AT_ERROR_CHANNEL_CLOSED;
+    p_cmd = commandListPop(&atch->impl->queue);
+    if (p_cmd->timeoutMsec != 0 && atch->impl->engine != NULL) {
+        engineDisarmDeadline(atch);
     }
+    finishCommand(atch, p_cmd, err, p_done);
+    startCommands(atch, p_done);
+}
 
-    RLOGD(atch, "AT> %s^Z", s);
-
-    AT_DUMP( atch, ">* ", s, strlen(s) );
-
-    /* the main string */
-    while (cur < len) {
-        do {
-            written = write(atch->fd, s + cur, len - cur);
-        } while (written < 0 && errno == EINTR);
+/**
+ * Finishes every queued command with "err"
+ * assumes commandmutex is held
+ */
+static void failPendingCommands(ATChannel* atch, ATReturn err, ATCommandList *p_done)
+{
+    ATCommand *p_cmd;
 
-        if (written < 0) {
-            return AT_ERROR_GENERIC;
+    while ((p_cmd = commandListPop(&atch->impl->queue)) != NULL) {
+        if (!p_cmd->started) {
+            schedulerDequeued(atch->impl->scheduler, p_cmd->priority,
+                              monotonicNsec() - p_cmd->queuedAt);
         }
-
-        cur += (size_t)written;
+        finishCommand(atch, p_cmd, err, p_done);
     }
+}
 
-    /* the ^Z  */
-    do {
-        written = write(atch->fd, "\032" , 1);
-    } while ((written < 0 && errno == EINTR) || (written == 0));
+/**
+ * Expires the command in flight if its deadline has passed
+ * assumes commandmutex is held
+ */
+static void expireCommands(ATChannel* atch, ATCommandList *p_done)
+{
+    ATCommand *p_cmd = atch->impl->queue.p_head;
 
-    if (written < 0) {
-        return AT_ERROR_GENERIC;
+    if (p_cmd == NULL || !p_cmd->started || p_cmd->timeoutMsec == 0) {
+        return;
     }
 
-    return AT_SUCCESS;
+    if (monotonicNsec() >= p_cmd->deadline) {
+        finishHeadCommand(atch, AT_ERROR_TIMEOUT, p_done);
+    }
 }
 
-static void clearPendingCommand(ATChannel* atch)
+/**
+ * Returns the milliseconds until the command in flight expires,
+ * or -1 if it never does
+ * assumes commandmutex is held
+ */
+static int nextTimeoutMsec(ATChannel* atch)
 {
-    if (atch->impl->p_response != NULL) {
-        at_response_free(atch->impl->p_response);
+    ATCommand *p_cmd = atch->impl->queue.p_head;
+    uint64_t now;
+    uint64_t msec;
+
+    if (p_cmd == NULL || !p_cmd->started || p_cmd->timeoutMsec == 0) {
+        return -1;
     }
 
-    atch->impl->p_response = NULL;
-    atch->impl->responsePrefix = NULL;
-    atch->impl->smsPDU = NULL;
-}
+    now = monotonicNsec();
+    if (now >= p_cmd->deadline) {
+        return 0;
+    }
+    msec = (p_cmd->deadline - now + 999999ULL) / 1000000ULL;
 
+    return msec > INT_MAX ? INT_MAX : (int) msec;
+}
 
-ATReturn at_open(ATChannel* atch)
+/**
+ * Invokes the callbacks of the finished asynchronous commands
+ * must be called without commandmutex held
+ */
+static void completeCommands(ATChannel* atch, ATCommandList *p_done)
+{
+    ATCommand *p_cmd;
+
+    while ((p_cmd = commandListPop(p_done)) != NULL) {
+        p_cmd->callback(atch, p_cmd->err, p_cmd->p_response, p_cmd->ctx);
+        free(p_cmd);
+    }
+}
+
+/** assumes commandmutex is held */
+static void handleFinalResponse(ATChannel* atch, const char *line, ATCommandList *p_done)
+{
+    ATReturn err = AT_SUCCESS;
+
+    atch->impl->queue.p_head->p_response->timing.finalLine = monotonicNsec();
+    if (!responseSetFinal(&atch->impl->queue.p_head->p_response, line)) {
+        err = AT_ERROR_GENERIC;
+    }
+
+    finishHeadCommand(atch, err, p_done);
+}
+
+/** calls the handler of an unsolicited response, "sms_pdu" as for ATUnsolSmsHandler */
+static void deliverUnsolicited(ATChannel* atch, const char *line, size_t len,
+                    const char *sms_pdu)
+{
+    ATChannelImpl *impl = atch->impl;
+    ATUnsolCallback callback = NULL;
+    void *ctx = NULL;
+
+    if (sms_pdu != NULL) {
+        if (atch->unsolSmsHandler != NULL) {
+            atch->unsolSmsHandler(atch, line, sms_pdu);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&impl->unsolmutex);
+    if (impl->unsolTable != NULL) {
+        unsolTableLookup(impl->unsolTable, line, &callback, &ctx);
+    }
+    pthread_mutex_unlock(&impl->unsolmutex);
+
+    if (callback != NULL) {
+        callback(atch, line, ctx);
+    } else if (atch->unsolHandlerN != NULL) {
+        atch->unsolHandlerN(atch, line, len);
+    } else if (atch->unsolHandler != NULL) {
+        atch->unsolHandler(atch, line);
+    }
+}
+
+/**
+ * Queues an unsolicited response for a dispatcher thread, the one chosen by
+ * its name so that the responses of one name keep their order. Waits for
+ * room while the queue is full.
+ *
+ * returns false if there are no dispatcher threads
+ */
+static bool queueUnsolicited(ATChannel* atch, const char *line, size_t len,
+                    const char *sms_pdu)
+{
+    ATChannelImpl *impl = atch->impl;
+    size_t lineLen = len + 1;
+    size_t pduLen = sms_pdu != NULL ? strlen(sms_pdu) + 1 : 0;
+    ATUnsolItem *p_item;
+    ATDispatcher *p_dispatcher;
+
+    pthread_mutex_lock(&impl->dispatchmutex);
+
+    for (;;) {
+        while (impl->dispatchChanging) {
+            pthread_cond_wait(&impl->dispatchcond, &impl->dispatchmutex);
+        }
+        if (impl->dispatcherCount == 0) {
+            pthread_mutex_unlock(&impl->dispatchmutex);
+            return false;
+        }
+
+        p_dispatcher = &impl->dispatchers[unsolHashName(line) % impl->dispatcherCount];
+        if (p_dispatcher->count < impl->dispatchQueueLength) {
+            break;
+        }
+        pthread_cond_wait(&impl->dispatchcond, &impl->dispatchmutex);
+    }
+
+    p_item = malloc(sizeof(ATUnsolItem) + lineLen + pduLen);
+    if (p_item == NULL) {
+        pthread_mutex_unlock(&impl->dispatchmutex);
+        RLOGE(atch, "Dropping unsolicited response: out of memory.");
+        return true;
+    }
+    p_item->p_next = NULL;
+    memcpy(p_item->line, line, lineLen);
+    p_item->lineLen = len;
+    p_item->sms_pdu = NULL;
+    if (sms_pdu != NULL) {
+        p_item->sms_pdu = p_item->line + lineLen;
+        memcpy(p_item->sms_pdu, sms_pdu, pduLen);
+    }
+
+    if (p_dispatcher->p_tail != NULL) {
+        p_dispatcher->p_tail->p_next = p_item;
+    } else {
+        p_dispatcher->p_head = p_item;
+    }
+    p_dispatcher->p_tail = p_item;
+    p_dispatcher->count++;
+    pthread_cond_signal(&p_dispatcher->cond);
+
+    pthread_mutex_unlock(&impl->dispatchmutex);
+
+    return true;
+}
+
+/** assumes commandmutex is NOT held */
+static void handleUnsolicited(ATChannel* atch, const char *line, size_t len,
+                    const char *sms_pdu)
+{
+    if (!queueUnsolicited(atch, line, len, sms_pdu)) {
+        deliverUnsolicited(atch, line, len, sms_pdu);
+    }
+}
+
+static void *dispatcherLoop(void *arg)
+{
+    ATDispatcher *p_dispatcher = arg;
+    ATChannel *atch = p_dispatcher->atch;
+    ATChannelImpl *impl = atch->impl;
+
+    s_dispatchedChannel = atch;
+
+    pthread_mutex_lock(&impl->dispatchmutex);
+
+    for (;;) {
+        ATUnsolItem *p_item;
+
+        while (p_dispatcher->p_head == NULL && !p_dispatcher->stopping) {
+            pthread_cond_wait(&p_dispatcher->cond, &impl->dispatchmutex);
+        }
+        /* deliver everything queued before stopping */
+        p_item = p_dispatcher->p_head;
+        if (p_item == NULL) {
+            break;
+        }
+
+        p_dispatcher->p_head = p_item->p_next;
+        if (p_dispatcher->p_head == NULL) {
+            p_dispatcher->p_tail = NULL;
+        }
+        p_dispatcher->count--;
+        pthread_cond_broadcast(&impl->dispatchcond);
+
+        pthread_mutex_unlock(&impl->dispatchmutex);
+        deliverUnsolicited(atch, p_item->line, p_item->lineLen, p_item->sms_pdu);
+        free(p_item);
+        pthread_mutex_lock(&impl->dispatchmutex);
+    }
+
+    pthread_mutex_unlock(&impl->dispatchmutex);
+
+    return NULL;
+}
+
+/**
+ * Stops the dispatcher threads after they deliver their queues
+ * Assumes dispatchmutex is held and dispatchChanging is set
+ */
+static void stopDispatchers(ATChannelImpl *impl)
+{
+    ATDispatcher *dispatchers = impl->dispatchers;
+    size_t count = impl->dispatcherCount;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        dispatchers[i].stopping = true;
+        pthread_cond_signal(&dispatchers[i].cond);
+    }
+    /* the reader may be waiting for room */
+    pthread_cond_broadcast(&impl->dispatchcond);
+
+    pthread_mutex_unlock(&impl->dispatchmutex);
+    for (i = 0; i < count; i++) {
+        pthread_join(dispatchers[i].tid, NULL);
+        pthread_cond_destroy(&dispatchers[i].cond);
+    }
+    pthread_mutex_lock(&impl->dispatchmutex);
+
+    free(dispatchers);
+    impl->dispatchers = NULL;
+    impl->dispatcherCount = 0;
+}
+
+/** delivers the queued unsolicited responses and stops the dispatchers */
+static void shutdownDispatch(ATChannelImpl *impl)
+{
+    pthread_mutex_lock(&impl->dispatchmutex);
+
+    while (impl->dispatchChanging) {
+        pthread_cond_wait(&impl->dispatchcond, &impl->dispatchmutex);
+    }
+    impl->dispatchChanging = true;
+    stopDispatchers(impl);
+    impl->dispatchChanging = false;
+    pthread_cond_broadcast(&impl->dispatchcond);
+
+    pthread_mutex_unlock(&impl->dispatchmutex);
+}
+
+/**
+ * Hands the trace records to the trace callback every
+ * TRACE_DRAIN_INTERVAL_MSEC, or sooner when the ring fills up
+ */
+static void *traceLoop(void *arg)
+{
+    ATChannelImpl *impl = arg;
+    struct timespec ts;
+
+    pthread_mutex_lock(&impl->tracemutex);
+    s_tracingChannel = impl->traceChannel;
+
+    for (;;) {
+        ATTrace *trace = atomic_load_explicit(&impl->trace, memory_order_acquire);
+
+        if (trace != NULL) {
+            traceDrain(trace, impl->traceChannel, impl->traceCallback, impl->traceCtx);
+        }
+        if (impl->traceStopping) {
+            break;
+        }
+
+        setTimespecRelative(&ts, TRACE_DRAIN_INTERVAL_MSEC);
+        pthread_cond_timedwait(&impl->tracecond, &impl->tracemutex, &ts);
+    }
+
+    pthread_mutex_unlock(&impl->tracemutex);
+
+    return NULL;
+}
+
+/**
+ * Waits for another thread stopping the trace thread, then stops it
+ * after it drains the ring
+ * Assumes tracemutex is held
+ */
+static void stopTraceThread(ATChannelImpl *impl)
+{
+    while (impl->traceStopping) {
+        pthread_cond_wait(&impl->tracecond, &impl->tracemutex);
+    }
+    if (!impl->traceThreadRunning) {
+        return;
+    }
+
+    impl->traceStopping = true;
+    pthread_cond_broadcast(&impl->tracecond);
+
+    pthread_mutex_unlock(&impl->tracemutex);
+    pthread_join(impl->traceThread, NULL);
+    pthread_mutex_lock(&impl->tracemutex);
+
+    impl->traceThreadRunning = false;
+    impl->traceStopping = false;
+    pthread_cond_broadcast(&impl->tracecond);
+}
+
+/** stops tracing, the trace thread drains the ring first */
+static void shutdownTrace(ATChannelImpl *impl)
+{
+    pthread_mutex_lock(&impl->tracemutex);
+    stopTraceThread(impl);
+    atomic_store_explicit(&impl->trace, NULL, memory_order_release);
+    pthread_mutex_unlock(&impl->tracemutex);
+}
+
+static void processLine(ATChannel* atch, const char *line, size_t len, ATLineClass lineClass)
+{
+    ATCommandList done = { NULL, NULL };
+    ATCommand *p_cmd;
+    bool unsolicited = false;
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+
+    p_cmd = atch->impl->queue.p_head;
+
+    if (p_cmd == NULL || !p_cmd->started) {
+        /* no command pending */
+        unsolicited = true;
+    } else if (p_cmd->hasPayload
+        && p_cmd->p_response->p_intermediates == NULL
+        && strStartsWith(line, p_cmd->responsePrefix)
+    ) {
+        /* before the classes, as eg "CONNECT <len>" may be a final response */
+        beginPayload(atch, line, len);
+    } else if (lineClass == AT_LINE_UNSOLICITED) {
+        unsolicited = true;
+    } else if (lineClass == AT_LINE_FINAL_SUCCESS) {
+        p_cmd->p_response->success = true;
+        handleFinalResponse(atch, line, &done);
+    } else if (lineClass == AT_LINE_FINAL_ERROR) {
+        p_cmd->p_response->success = false;
+        handleFinalResponse(atch, line, &done);
+    } else if (p_cmd->smsPDU != NULL && 0 == strcmp(line, "> ")) {
+        // See eg. TS 27.005 4.3
+        // Commands like AT+CMGS have a "> " prompt
+        writeCtrlZ(atch, p_cmd->smsPDU, p_cmd->smsPDULen);
+        p_cmd->smsPDU = NULL;
+    } else switch (p_cmd->type) {
+        case NO_RESULT:
+            unsolicited = true;
+            break;
+        case NUMERIC:
+            if (p_cmd->p_response->p_intermediates == NULL
+                && isdigit(line[0])
+            ) {
+                addIntermediate(atch, line, len);
+            } else {
+                /* either we already have an intermediate response or
+                   the line doesn't begin with a digit */
+                unsolicited = true;
+            }
+            break;
+        case SINGLELINE:
+            if (p_cmd->p_response->p_intermediates == NULL
+                && strStartsWith(line, p_cmd->responsePrefix)
+            ) {
+                addIntermediate(atch, line, len);
+            } else {
+                /* we already have an intermediate response */
+                unsolicited = true;
+            }
+            break;
+        case MULTILINE:
+            if (!strStartsWith(line, p_cmd->responsePrefix)) {
+                unsolicited = true;
+            } else if (p_cmd->lineCallback != NULL) {
+                streamIntermediate(atch, line, len);
+            } else {
+                addIntermediate(atch, line, len);
+            }
+            break;
+
+        default: /* this should never be reached */
+            RLOGE(atch, "Unsupported AT command type %d.", p_cmd->type);
+            unsolicited = true;
+            break;
+    }
+
+    if (unsolicited && atch->impl->cache != NULL) {
+        cacheInvalidateLine(atch->impl->cache, line);
+    }
+
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
+
+    /* the handlers never run under commandmutex */
+    if (unsolicited) {
+        handleUnsolicited(atch, line, len, NULL);
+    }
+}
+
+/**
+ * Returns a pointer to the first \r or \n in "len" bytes at "cur"
+ *
+ * returns NULL if there is none
+ */
+static char * findNextEOL(char *cur, size_t len)
+{
+    // Find next newline
+    return (char *) (uintptr_t) memchr2(cur, '\r', '\n', len);
+}
+
+/**
+ * Waits until the channel has input, expiring the command in flight
+ * when its deadline passes meanwhile.
+ *
+ * returns false on error, or once the channel is being detached
+ */
+static bool waitReadable(ATChannel* atch)
+{
+    ATChannelImpl *impl = atch->impl;
+    struct pollfd fds[2] = {
+        { .fd = atch->fd, .events = POLLIN, .revents = 0 },
+        { .fd = atch->impl->wakeupfd, .events = POLLIN, .revents = 0 },
+    };
+
+    for (;;) {
+        ATCommandList done = { NULL, NULL };
+        int timeoutMsec;
+        bool stopping;
+        int ret;
+
+        pthread_mutex_lock(&impl->commandmutex);
+        expireCommands(atch, &done);
+        timeoutMsec = nextTimeoutMsec(atch);
+        stopping = impl->readerStopping;
+        pthread_mutex_unlock(&impl->commandmutex);
+
+        completeCommands(atch, &done);
+
+        if (stopping || impl->detached) {
+            /* detached by another thread or by one of the callbacks */
+            errno = 0;
+            return false;
+        }
+
+        ret = poll(fds, NUM_ELEMS(fds), timeoutMsec);
+
+        if (ret < 0 && errno != EINTR) {
+            return false;
+        }
+        if (ret > 0 && fds[1].revents != 0) {
+            uint64_t count;
+            if (read(atch->impl->wakeupfd, &count, sizeof(count)) < 0) {
+                /* nothing to drain */
+            }
+        }
+        if (ret > 0 && fds[0].revents != 0) {
+            return true;
+        }
+    }
+}
+
+static void consumeInput(ATChannelImpl *impl, size_t len)
+{
+    impl->ATBufferScanned = 0;
+    impl->ATBufferLen -= len;
+    if (impl->ATBufferLen == 0) {
+        /* start over at the front for the largest contiguous read */
+        impl->ATBufferStart = 0;
+    } else {
+        impl->ATBufferStart = (impl->ATBufferStart + len) % MAX_AT_RESPONSE;
+    }
+}
+
+/**
+ * Appends a piece of a line to the spill buffer, growing it up to
+ * maxLineLength. The rest of a longer line is dropped.
+ */
+static void spillInput(ATChannel* atch, const char *data, size_t len)
+{
+    ATChannelImpl *impl = atch->impl;
+    size_t maxLineLength = atomic_load_explicit(&impl->maxLineLength, memory_order_relaxed);
+
+    if (impl->spillDiscarding) {
+        return;
+    }
+
+    if (impl->spillLen + len > maxLineLength) {
+        RLOGE(atch, "ERROR: Input line exceeded %zu bytes.", maxLineLength);
+        impl->spillDiscarding = true;
+        impl->spillLen = 0;
+        return;
+    }
+
+    if (impl->spillLen + len + 1 > impl->spillCapacity) {
+        size_t capacity = impl->spillCapacity > 0 ? impl->spillCapacity : MAX_AT_RESPONSE;
+        char *spill;
+
+        while (capacity < impl->spillLen + len + 1) {
+            capacity *= 2;
+        }
+        if (capacity > maxLineLength + 1) {
+            capacity = maxLineLength + 1;
+        }
+
+        spill = realloc(impl->spill, capacity);
+        if (spill == NULL) {
+            RLOGE(atch, "ERROR: Input line of %zu bytes: out of memory.", impl->spillLen + len);
+            impl->spillDiscarding = true;
+            impl->spillLen = 0;
+            return;
+        }
+        impl->spill = spill;
+        impl->spillCapacity = capacity;
+    }
+
+    memcpy(impl->spill + impl->spillLen, data, len);
+    impl->spillLen += len;
+}
+
+/**
+ * Appends a line read or written to the trace ring, or logs it right away
+ * when the channel is not being traced
+ */
+static void traceLine(ATChannel* atch, ATTraceDirection direction, const char *line, size_t len)
+{
+    ATChannelImpl *impl = atch->impl;
+    ATTrace *trace = atomic_load_explicit(&impl->trace, memory_order_acquire);
+    int printLen = len > INT_MAX ? INT_MAX : (int) len;
+
+    if (trace != NULL) {
+        if (traceAppend(trace, direction, line, len)) {
+            pthread_cond_signal(&impl->tracecond);
+        }
+    } else if (direction == AT_TRACE_OUT_SMS) {
+        RLOGD(atch, "AT> %.*s^Z", printLen, line);
+    } else if (direction == AT_TRACE_OUT) {
+        RLOGD(atch, "AT> %.*s", printLen, line);
+    } else {
+        RLOGD(atch, "AT< %.*s", printLen, line);
+    }
+}
+
+/**
+ * Moves payload bytes at the front of the input buffer to the command
+ * they belong to, or drops them once it is finished
+ *
+ * returns false if the input buffer is empty
+ */
+static bool drainPayload(ATChannel* atch)
+{
+    ATChannelImpl *impl = atch->impl;
+    const char *cur = impl->ATBuffer + impl->ATBufferStart;
+    size_t len = MAX_AT_RESPONSE - impl->ATBufferStart;
+    ATCommand *p_cmd;
+
+    if (impl->ATBufferLen == 0) {
+        return false;
+    }
+
+    if (impl->payloadSkipLF) {
+        impl->payloadSkipLF = false;
+        if (cur[0] == '\n') {
+            consumeInput(impl, 1);
+            return true;
+        }
+    }
+
+    if (len > impl->ATBufferLen) {
+        len = impl->ATBufferLen;
+    }
+    if (len > impl->payloadRemaining) {
+        len = impl->payloadRemaining;
+    }
+
+    pthread_mutex_lock(&impl->commandmutex);
+    p_cmd = impl->payloadCommand;
+    if (p_cmd != NULL) {
+        size_t stored = p_cmd->payloadSize - p_cmd->payloadRead;
+
+        if (stored > len) {
+            stored = len;
+        }
+        if (stored > 0) {
+            memcpy(p_cmd->payload + p_cmd->payloadRead, cur, stored);
+            p_cmd->payloadRead += stored;
+        }
+    }
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    consumeInput(impl, len);
+    impl->payloadRemaining -= len;
+
+    return true;
+}
+
+/**
+ * Returns the next complete line in the input buffer and sets *p_len to
+ * its length, or returns NULL if there is none yet. A partial line stays
+ * where it is until more input arrives.
+ *
+ * This line is valid only until the next call to nextLine or fillBuffer
+ */
+static const char *nextLine(ATChannel* atch, size_t *p_len)
+{
+    ATChannelImpl *impl = atch->impl;
+
+    if (impl->spillReturned) {
+        impl->spillReturned = false;
+        impl->spillLen = 0;
+    }
+
+    while (impl->payloadRemaining > 0) {
+        if (!drainPayload(atch)) {
+            return NULL;
+        }
+    }
+
+    while (impl->ATBufferLen > 0) {
+        char *cur = impl->ATBuffer + impl->ATBufferStart;
+        size_t len = MAX_AT_RESPONSE - impl->ATBufferStart;
+        bool inPlace = impl->spillLen == 0 && !impl->spillDiscarding;
+        char *p_eol;
+        size_t lineLen;
+
+        if (len > impl->ATBufferLen) {
+            len = impl->ATBufferLen;
+        }
+
+        if (inPlace) {
+            size_t skip = 0;
+
+            // skip over leading newlines
+            while (skip < len && (cur[skip] == '\r' || cur[skip] == '\n')) {
+                skip++;
+            }
+            if (skip > 0) {
+                consumeInput(impl, skip);
+                continue;
+            }
+
+            if (impl->ATBufferLen == 2 && len == 2 && cur[0] == '>' && cur[1] == ' ') {
+                /* SMS prompt character...not \r terminated */
+                cur[2] = '\0';
+                consumeInput(impl, 2);
+                impl->lineEndedCR = false;
+                traceLine(atch, AT_TRACE_IN, cur, 2);
+                *p_len = 2;
+                return cur;
+            }
+        }
+
+        /* never rescan the bytes of a partial line */
+        p_eol = findNextEOL(cur + impl->ATBufferScanned, len - impl->ATBufferScanned);
+
+        if (inPlace && p_eol != NULL) {
+            /* a full line in the buffer. Place a \0 over the \r and return */
+            impl->lineEndedCR = *p_eol == '\r';
+            *p_eol = '\0';
+            *p_len = (size_t)(p_eol - cur);
+            consumeInput(impl, *p_len + 1);
+            traceLine(atch, AT_TRACE_IN, cur, *p_len);
+            return cur;
+        }
+
+        if (inPlace && len == impl->ATBufferLen && len < MAX_AT_RESPONSE) {
+            /* a partial line, wait for the rest of it right here */
+            impl->ATBufferScanned = len;
+            return NULL;
+        }
+
+        /* the line wraps around or fills the ring, gather it in spill */
+        lineLen = p_eol != NULL ? (size_t)(p_eol - cur) : len;
+        spillInput(atch, cur, lineLen);
+        consumeInput(impl, p_eol != NULL ? lineLen + 1 : lineLen);
+
+        if (p_eol != NULL) {
+            if (impl->spillDiscarding) {
+                impl->spillDiscarding = false;
+                continue;
+            }
+
+            impl->spill[impl->spillLen] = '\0';
+            impl->spillReturned = true;
+            impl->lineEndedCR = *p_eol == '\r';
+            traceLine(atch, AT_TRACE_IN, impl->spill, impl->spillLen);
+            *p_len = impl->spillLen;
+            return impl->spill;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Reads payload bytes straight into the command they belong to, when none
+ * are buffered yet and it has room left for them
+ * The read is done unlocked; payloadReading keeps the command from being
+ * finished, and its buffer handed back, meanwhile.
+ *
+ * returns false if the input buffer is to be filled instead
+ */
+static bool readPayload(ATChannel* atch, ssize_t *p_count)
+{
+    ATChannelImpl *impl = atch->impl;
+    ATCommand *p_cmd;
+    char *dest;
+    size_t room;
+    ssize_t count;
+
+    if (impl->payloadRemaining == 0 || impl->ATBufferLen > 0 || impl->payloadSkipLF) {
+        return false;
+    }
+
+    pthread_mutex_lock(&impl->commandmutex);
+    p_cmd = impl->payloadCommand;
+    if (p_cmd == NULL || p_cmd->payloadRead == p_cmd->payloadSize) {
+        pthread_mutex_unlock(&impl->commandmutex);
+        return false;
+    }
+
+    dest = p_cmd->payload + p_cmd->payloadRead;
+    room = p_cmd->payloadSize - p_cmd->payloadRead;
+    if (room > impl->payloadRemaining) {
+        room = impl->payloadRemaining;
+    }
+    impl->payloadReading = true;
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    do {
+        count = read(atch->fd, dest, room);
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        AT_DUMP( atch, "<< ", dest, count );
+
+        impl->payloadRemaining -= (size_t) count;
+    }
+
+    pthread_mutex_lock(&impl->commandmutex);
+    impl->payloadReading = false;
+    if (count > 0) {
+        p_cmd->payloadRead += (size_t) count;
+    }
+    if (impl->payloadFinishing) {
+        impl->payloadFinishing = false;
+        pthread_cond_broadcast(&impl->commandcond);
+    }
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    *p_count = count;
+    return true;
+}
+
+/**
+ * Appends the result of a single read() to the input buffer, unless it
+ * goes to a payload right away
+ * Assumes it has exclusive read access to the FD
+ *
+ * returns the read() result, 0 on EOF
+ */
+static ssize_t fillBuffer(ATChannel* atch)
+{
+    ATChannelImpl *impl = atch->impl;
+    size_t writePos = impl->ATBufferStart + impl->ATBufferLen;
+    size_t room;
+    ssize_t count;
+
+    if (readPayload(atch, &count)) {
+        /* bypassed the input buffer */
+    } else {
+        if (writePos < MAX_AT_RESPONSE) {
+            room = MAX_AT_RESPONSE - writePos;
+        } else {
+            writePos -= MAX_AT_RESPONSE;
+            room = impl->ATBufferStart - writePos;
+        }
+
+        if (room == 0) {
+            /* nextLine() spills a full ring, so this should never be reached */
+            RLOGE(atch, "ERROR: Input line exceeded buffer.");
+            /* ditch buffer and start over again */
+            impl->ATBufferStart = 0;
+            impl->ATBufferLen = 0;
+            impl->ATBufferScanned = 0;
+            writePos = 0;
+            room = MAX_AT_RESPONSE;
+        }
+
+        do {
+            count = read(atch->fd, impl->ATBuffer + writePos, room);
+        } while (count < 0 && errno == EINTR);
+
+        if (count > 0) {
+            AT_DUMP( atch, "<< ", impl->ATBuffer + writePos, count );
+
+            impl->ATBufferLen += (size_t) count;
+        }
+    }
+
+    if (count <= 0) {
+        /* read error encountered or EOF reached */
+        if(count == 0) {
+            RLOGD(atch, "atchannel: EOF reached.");
+        } else {
+            RLOGE(atch, "atchannel: read error %s.", strerror(errno));
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Reads a line from the AT channel, returns NULL on EOF or error.
+ * Assumes it has exclusive read access to the FD
+ *
+ * This line is valid only until the next call to readline
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ */
+static const char *readline(ATChannel* atch, size_t *p_len)
+{
+    const char *line;
+
+    while ((line = nextLine(atch, p_len)) == NULL) {
+        if (!waitReadable(atch)) {
+            if (errno != 0) {
+                RLOGE(atch, "atchannel: poll error %s.", strerror(errno));
+            }
+            return NULL;
+        }
+
+        if (fillBuffer(atch) <= 0) {
+            return NULL;
+        }
+    }
+
+    return line;
+}
+
+/**
+ * Hands a line read from the channel to the command or unsolicited
+ * handling. The first line of a two-line SMS unsolicited response is kept
+ * until the PDU line arrives.
+ */
+static void dispatchLine(ATChannel* atch, const char *line, size_t len)
+{
+    ATChannelImpl *impl = atch->impl;
+    ATLineClass lineClass;
+
+    if (impl->smsUnsolLine != NULL) {
+        char *line1 = impl->smsUnsolLine;
+
+        impl->smsUnsolLine = NULL;
+        handleUnsolicited(atch, line1, impl->smsUnsolLineLen, line);
+        free(line1);
+        return;
+    }
+
+    lineClass = classifierMatch(atomic_load_explicit(&impl->classifier, memory_order_acquire), line);
+
+    if (lineClass == AT_LINE_SMS_UNSOLICITED) {
+        // The scope of the line is valid only till the next read
+        // hence making a copy of it before reading the PDU
+        impl->smsUnsolLine = malloc(len + 1);
+        if (impl->smsUnsolLine != NULL) {
+            memcpy(impl->smsUnsolLine, line, len + 1);
+            impl->smsUnsolLineLen = len;
+        }
+    } else {
+        processLine(atch, line, len, lineClass);
+    }
+}
+
+static void onReaderClosed(ATChannel* atch)
+{
+    ATCommandList done = { NULL, NULL };
+    bool wasClosed;
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    wasClosed = atch->impl->readerClosed;
+    atch->impl->readerClosed = true;
+    failPendingCommands(atch, AT_ERROR_CHANNEL_CLOSED, &done);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
+
+    if (atch->onCloseHandler != NULL && !wasClosed) {
+        atch->onCloseHandler(atch);
+    }
+}
+
+static void *readerLoop(void *arg)
+{
+    ATChannel* atch = (ATChannel*)arg;
+    ATChannelImpl *impl = atch->impl;
+    bool stopping;
+    bool detached;
+
+    for (;;) {
+        const char * line;
+        size_t len;
+
+        line = readline(atch, &len);
+
+        if (line == NULL) {
+            break;
+        }
+
+        dispatchLine(atch, line, len);
+
+        if (impl->detached) {
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&impl->commandmutex);
+    stopping = impl->readerStopping;
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    /* at_detach() fails the pending commands itself */
+    if (!stopping && !impl->detached) {
+        onReaderClosed(atch);
+    }
+
+    /* let at_detach() go on, or free the channel detached from a callback */
+    pthread_mutex_lock(&impl->commandmutex);
+    detached = impl->detached;
+    impl->readerRunning = false;
+    pthread_cond_broadcast(&impl->commandcond);
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    if (detached) {
+        freeImpl(impl);
+    }
+
+    return NULL;
+}
+
+/*
+ * Shared reader engine
+ *
+ * A fixed pool of threads waits on the fds of every attached channel with a
+ * single epoll instance. The fds are armed with EPOLLONESHOT, so a channel is
+ * serviced by one thread at a time and its lines are dispatched in order.
+ * The deadlines of the commands in flight are kept in a timer wheel, whose
+ * next tick a timerfd in the same epoll instance fires at.
+ */
+
+#define ENGINE_MAX_EVENTS   16
+#define ENGINE_WAKEUP_SLOT  UINT32_MAX
+#define ENGINE_TIMER_SLOT   (UINT32_MAX - 1)
+
+typedef struct {
+    ATChannel *atch;
+    ATChannelImpl *impl;
+    bool attached;
+    uint32_t gen;       /* bumped on detach, so that stale events are ignored */
+    int users;          /* threads currently servicing the channel */
+} ATEngineSlot;
+
+struct ATEngine {
+    int epollfd;
+    int wakeupfd;
+    int threadCount;
+    pthread_t *threads;
+
+    /* these are protected by mutex */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    ATEngineSlot *slots;
+    uint32_t slotCount;
+    uint32_t channelCount;
+    bool stopping;
+
+    /* these are protected by timermutex, taken after any commandmutex */
+    pthread_mutex_t timermutex;
+    int timerfd;
+    ATTimerWheel *wheel;        /* of the millisecond ticks of CLOCK_MONOTONIC */
+    uint64_t timerTick;         /* the tick timerfd is set to, UINT64_MAX if none */
+};
+
+/* the engine of the current thread, and the channel it is servicing */
+static _Thread_local ATEngine *s_engine;
+static _Thread_local ATChannel *s_servicedChannel;
+
+static void freeImpl(ATChannelImpl *impl)
+{
+    responsePoolRelease(impl->responsePool);
+    statsFree(impl->stats);
+    schedulerFree(impl->scheduler);
+    cacheFree(impl->cache);
+    if (impl->wakeupfd >= 0) {
+        close(impl->wakeupfd);
+    }
+    classifierFree(atomic_load_explicit(&impl->classifier, memory_order_relaxed));
+    traceFree(impl->traceRings);
+    pthread_cond_destroy(&impl->tracecond);
+    pthread_mutex_destroy(&impl->tracemutex);
+    unsolTableFree(impl->unsolTable);
+    pthread_mutex_destroy(&impl->unsolmutex);
+    pthread_cond_destroy(&impl->dispatchcond);
+    pthread_mutex_destroy(&impl->dispatchmutex);
+    free(impl->smsUnsolLine);
+    free(impl->spill);
+    free(impl);
+}
+
+/** returns true if called from a thread that reads "atch" */
+static bool isReaderThread(ATChannel* atch)
+{
+    if (s_engine != NULL) {
+        /* engine threads must never block */
+        return true;
+    }
+    if (s_dispatchedChannel != NULL) {
+        /* neither must dispatchers, the reader may wait for their queue */
+        return true;
+    }
+
+    return 0 != pthread_equal(atch->impl->tid_reader, pthread_self());
+}
+
+/** assumes engine->mutex is held */
+static int engineArm(ATEngine* engine, uint32_t index, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = ((uint64_t) engine->slots[index].gen << 32) | index;
+
+    return epoll_ctl(engine->epollfd, op, engine->slots[index].atch->fd, &ev);
+}
+
+/**
+ * Drops a reference to a slot, the last user of a detached channel frees it
+ * assumes engine->mutex is held
+ */
+static void engineReleaseSlot(ATEngine* engine, uint32_t index)
+{
+    ATEngineSlot *slot = &engine->slots[index];
+
+    if (--slot->users > 0) {
+        if (!slot->attached) {
+            /* at_detach() may be waiting for the other users to leave */
+            pthread_cond_broadcast(&engine->cond);
+        }
+        return;
+    }
+
+    if (!slot->attached && slot->impl != NULL) {
+        freeImpl(slot->impl);
+        slot->atch = NULL;
+        slot->impl = NULL;
+        engine->channelCount--;
+    }
+
+    pthread_cond_broadcast(&engine->cond);
+}
+
+/**
+ * Reads once from a readable channel and dispatches the complete lines
+ * returns false once the channel is closed or detached
+ */
+static bool serviceChannel(ATChannel* atch)
+{
+    ATChannelImpl *impl = atch->impl;
+    const char *line;
+    size_t len;
+
+    if (fillBuffer(atch) <= 0) {
+        onReaderClosed(atch);
+        return false;
+    }
+
+    while (!impl->detached && (line = nextLine(atch, &len)) != NULL) {
+        dispatchLine(atch, line, len);
+    }
+
+    return !impl->detached;
+}
+
+static void engineServiceSlot(ATEngine* engine, uint32_t index, uint32_t gen)
+{
+    ATChannel *atch;
+    bool watching;
+
+    pthread_mutex_lock(&engine->mutex);
+    if (index >= engine->slotCount
+        || !engine->slots[index].attached
+        || engine->slots[index].gen != gen
+    ) {
+        /* detached since the event was reported */
+        pthread_mutex_unlock(&engine->mutex);
+        return;
+    }
+    atch = engine->slots[index].atch;
+    engine->slots[index].users++;
+    pthread_mutex_unlock(&engine->mutex);
+
+    s_servicedChannel = atch;
+    watching = serviceChannel(atch);
+    s_servicedChannel = NULL;
+
+    pthread_mutex_lock(&engine->mutex);
+    if (engine->slots[index].attached && engine->slots[index].gen == gen) {
+        engineArm(engine, index, watching ? EPOLL_CTL_MOD : EPOLL_CTL_DEL);
+    }
+    engineReleaseSlot(engine, index);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+/**
+ * Sets timerfd to the next tick of the wheel
+ * assumes timermutex is held
+ */
+static void engineSetTimer(ATEngine* engine)
+{
+    uint64_t tick = timerWheelNext(engine->wheel);
+    struct itimerspec its;
+
+    if (tick == engine->timerTick) {
+        return;
+    }
+
+    memset(&its, 0, sizeof(its));
+    if (tick != UINT64_MAX) {
+        its.it_value.tv_sec = (time_t) (tick / 1000);
+        its.it_value.tv_nsec = (long) (tick % 1000) * 1000000L;
+    }
+    timerfd_settime(engine->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    engine->timerTick = tick;
+}
+
+/**
+ * Arms the deadline of the command in flight
+ * assumes commandmutex is held
+ */
+static void engineArmDeadline(ATChannel* atch, uint64_t deadline)
+{
+    ATEngine *engine = atch->impl->engine;
+    uint64_t tick = (deadline + 999999ULL) / 1000000ULL;
+
+    pthread_mutex_lock(&engine->timermutex);
+    timerWheelAdd(engine->wheel, &atch->impl->deadlineTimer, tick);
+    if (tick < engine->timerTick) {
+        engineSetTimer(engine);
+    }
+    pthread_mutex_unlock(&engine->timermutex);
+}
+
+/**
+ * Disarms the deadline of the command in flight, timerfd may still fire
+ * for nothing
+ */
+static void engineDisarmDeadline(ATChannel* atch)
+{
+    ATEngine *engine = atch->impl->engine;
+
+    pthread_mutex_lock(&engine->timermutex);
+    timerWheelRemove(engine->wheel, &atch->impl->deadlineTimer);
+    pthread_mutex_unlock(&engine->timermutex);
+}
+
+/** Expires the command in flight on a channel if it is still attached */
+static void engineExpireSlot(ATEngine* engine, uint32_t index, uint32_t gen)
+{
+    ATCommandList done = { NULL, NULL };
+    ATChannel *atch;
+
+    pthread_mutex_lock(&engine->mutex);
+    if (index >= engine->slotCount
+        || !engine->slots[index].attached
+        || engine->slots[index].gen != gen
+    ) {
+        pthread_mutex_unlock(&engine->mutex);
+        return;
+    }
+    atch = engine->slots[index].atch;
+    engine->slots[index].users++;
+    pthread_mutex_unlock(&engine->mutex);
+
+    s_servicedChannel = atch;
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    expireCommands(atch, &done);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+    completeCommands(atch, &done);
+    s_servicedChannel = NULL;
+
+    pthread_mutex_lock(&engine->mutex);
+    engineReleaseSlot(engine, index);
+    pthread_mutex_unlock(&engine->mutex);
+}
+
+/**
+ * Expires the commands whose deadlines have passed, when timerfd fires
+ * Only one thread at a time gets here, until the timerfd is armed again
+ */
+static void engineExpireTimers(ATEngine* engine)
+{
+    struct epoll_event ev;
+    uint64_t expirations;
+    ATTimer *timer;
+
+    if (read(engine->timerfd, &expirations, sizeof(expirations)) < 0) {
+        /* set again since it fired */
+    }
+
+    pthread_mutex_lock(&engine->timermutex);
+    timerWheelAdvance(engine->wheel, monotonicNsec() / 1000000ULL);
+    while ((timer = timerWheelPopExpired(engine->wheel)) != NULL) {
+        uint64_t key = timer->key;
+
+        pthread_mutex_unlock(&engine->timermutex);
+        engineExpireSlot(engine, (uint32_t) key, (uint32_t) (key >> 32));
+        pthread_mutex_lock(&engine->timermutex);
+    }
+    /* fired, so whatever it was set to has passed */
+    engine->timerTick = 0;
+    engineSetTimer(engine);
+    pthread_mutex_unlock(&engine->timermutex);
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = ENGINE_TIMER_SLOT;
+    epoll_ctl(engine->epollfd, EPOLL_CTL_MOD, engine->timerfd, &ev);
+}
+
+static void *engineLoop(void *arg)
+{
+    ATEngine *engine = (ATEngine *) arg;
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    bool stopping = false;
+
+    s_engine = engine;
+
+    while (!stopping) {
+        int count;
+        int i;
+
+        count = epoll_wait(engine->epollfd, events, ENGINE_MAX_EVENTS, -1);
+
+        for (i = 0; i < count; i++) {
+            uint32_t index = (uint32_t) events[i].data.u64;
+            uint32_t gen = (uint32_t) (events[i].data.u64 >> 32);
+
+            if (index == ENGINE_TIMER_SLOT) {
+                engineExpireTimers(engine);
+            } else if (index != ENGINE_WAKEUP_SLOT) {
+                engineServiceSlot(engine, index, gen);
+            }
+        }
+
+        pthread_mutex_lock(&engine->mutex);
+        stopping = engine->stopping;
+        pthread_mutex_unlock(&engine->mutex);
+    }
+
+    s_engine = NULL;
+
+    return NULL;
+}
+
+static void engineStop(ATEngine* engine, int threadCount)
+{
+    uint64_t one = 1;
+    int i;
+
+    pthread_mutex_lock(&engine->mutex);
+    engine->stopping = true;
+    pthread_mutex_unlock(&engine->mutex);
+
+    /* level triggered, wakes up every thread */
+    if (write(engine->wakeupfd, &one, sizeof(one)) < 0) {
+        /* only if the counter overflowed, then it is readable anyway */
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        pthread_join(engine->threads[i], NULL);
+    }
+}
+
+/**
+ * Creates a reader engine with "threadCount" threads,
+ * 0 means one thread per online CPU
+ * returns NULL on error
+ */
+ATEngine* at_engine_create(int threadCount)
+{
+    ATEngine *engine;
+    struct epoll_event ev;
+    int i;
+
+    if (threadCount < 0) {
+        return NULL;
+    }
+    if (threadCount == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = cpus > 0 ? (int) cpus : 1;
+    }
+
+    engine = (ATEngine *) calloc(1, sizeof(ATEngine));
+    if (engine == NULL) {
+        return NULL;
+    }
+    engine->threads = (pthread_t *) calloc((size_t) threadCount, sizeof(pthread_t));
+    engine->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    engine->wakeupfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    engine->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    engine->wheel = timerWheelNew(monotonicNsec() / 1000000ULL);
+    engine->timerTick = UINT64_MAX;
+    pthread_mutex_init(&engine->mutex, NULL);
+    pthread_cond_init(&engine->cond, NULL);
+    pthread_mutex_init(&engine->timermutex, NULL);
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = ENGINE_WAKEUP_SLOT;
+    if (engine->threads == NULL || engine->epollfd < 0 || engine->wakeupfd < 0
+        || engine->timerfd < 0 || engine->wheel == NULL
+        || epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, engine->wakeupfd, &ev) < 0
+    ) {
+        threadCount = 0;
+        goto error;
+    }
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.u64 = ENGINE_TIMER_SLOT;
+    if (epoll_ctl(engine->epollfd, EPOLL_CTL_ADD, engine->timerfd, &ev) < 0) {
+        threadCount = 0;
+        goto error;
+    }
+
+    for (i = 0; i < threadCount; i++) {
+        if (0 != pthread_create(&engine->threads[i], NULL, engineLoop, engine)) {
+            threadCount = i;
+            goto error;
+        }
+    }
+    engine->threadCount = threadCount;
+
+    return engine;
+
+error:
+    engineStop(engine, threadCount);
+    if (engine->timerfd >= 0) {
+        close(engine->timerfd);
+    }
+    if (engine->wakeupfd >= 0) {
+        close(engine->wakeupfd);
+    }
+    if (engine->epollfd >= 0) {
+        close(engine->epollfd);
+    }
+    timerWheelFree(engine->wheel);
+    pthread_mutex_destroy(&engine->timermutex);
+    pthread_cond_destroy(&engine->cond);
+    pthread_mutex_destroy(&engine->mutex);
+    free(engine->threads);
+    free(engine);
+    return NULL;
+}
+
+/**
+ * Stops the engine threads and frees the engine
+ * every channel must have been detached
+ */
+ATReturn at_engine_destroy(ATEngine* engine)
+{
+    if (!engine) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (s_engine == engine) {
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    pthread_mutex_lock(&engine->mutex);
+    if (engine->channelCount > 0) {
+        pthread_mutex_unlock(&engine->mutex);
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    pthread_mutex_unlock(&engine->mutex);
+
+    engineStop(engine, engine->threadCount);
+
+    close(engine->timerfd);
+    close(engine->wakeupfd);
+    close(engine->epollfd);
+    timerWheelFree(engine->wheel);
+    pthread_mutex_destroy(&engine->timermutex);
+    pthread_cond_destroy(&engine->cond);
+    pthread_mutex_destroy(&engine->mutex);
+    free(engine->slots);
+    free(engine->threads);
+    free(engine);
+
+    return AT_SUCCESS;
+}
+
+static ATReturn engineAttach(ATEngine* engine, ATChannel* atch)
+{
+    uint32_t index;
+
+    pthread_mutex_lock(&engine->mutex);
+
+    for (index = 0; index < engine->slotCount; index++) {
+        if (engine->slots[index].atch == NULL) {
+            break;
+        }
+    }
+
+    if (index == engine->slotCount) {
+        uint32_t slotCount = engine->slotCount > 0 ? engine->slotCount * 2 : 16;
+        ATEngineSlot *slots;
+
+        slots = (ATEngineSlot *) realloc(engine->slots, slotCount * sizeof(ATEngineSlot));
+        if (slots == NULL) {
+            pthread_mutex_unlock(&engine->mutex);
+            return AT_ERROR_GENERIC;
+        }
+        memset(slots + engine->slotCount, 0,
+                (slotCount - engine->slotCount) * sizeof(ATEngineSlot));
+        engine->slots = slots;
+        engine->slotCount = slotCount;
+    }
+
+    engine->slots[index].atch = atch;
+    engine->slots[index].impl = atch->impl;
+    engine->slots[index].attached = true;
+    engine->slots[index].users = 0;
+    atch->impl->engine = engine;
+    atch->impl->engineSlot = index;
+    atch->impl->deadlineTimer.key = ((uint64_t) engine->slots[index].gen << 32) | index;
+
+    if (engineArm(engine, index, EPOLL_CTL_ADD) < 0) {
+        RLOGE(atch, "Watching fd %d has failed: %s.", atch->fd, strerror(errno));
+        engine->slots[index].atch = NULL;
+        engine->slots[index].impl = NULL;
+        engine->slots[index].attached = false;
+        pthread_mutex_unlock(&engine->mutex);
+        return AT_ERROR_GENERIC;
+    }
+    engine->channelCount++;
+
+    pthread_mutex_unlock(&engine->mutex);
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Detaches a channel from its engine. When called from a callback of the
+ * channel itself, the servicing thread frees the channel when it returns.
+ */
+static ATReturn engineDetach(ATChannel* atch)
+{
+    ATChannelImpl *impl = atch->impl;
+    ATEngine *engine = impl->engine;
+    uint32_t index = impl->engineSlot;
+    int self = s_servicedChannel == atch ? 1 : 0;
+
+    pthread_mutex_lock(&engine->mutex);
+    epoll_ctl(engine->epollfd, EPOLL_CTL_DEL, atch->fd, NULL);
+    /* a reference of our own, so that the last other user does not free it */
+    engine->slots[index].users++;
+    engine->slots[index].attached = false;
+    engine->slots[index].gen++;
+    /* no new users from now on, wait for the other ones to leave */
+    while (engine->slots[index].users > self + 1) {
+        pthread_cond_wait(&engine->cond, &engine->mutex);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+
+    /* fails every queued command with AT_ERROR_CHANNEL_CLOSED */
+    onReaderClosed(atch);
+    shutdownDispatch(impl);
+    shutdownTrace(impl);
+
+    /* the wheel must not point into the channel once it is freed */
+    pthread_mutex_lock(&engine->timermutex);
+    timerWheelRemove(engine->wheel, &impl->deadlineTimer);
+    pthread_mutex_unlock(&engine->timermutex);
+
+    impl->detached = true;
+    atch->impl = NULL;
+
+    /* the slot is released by whoever drops the last reference */
+    pthread_mutex_lock(&engine->mutex);
+    engineReleaseSlot(engine, index);
+    pthread_mutex_unlock(&engine->mutex);
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Writes "s" and the one byte "terminator" in a single writev(), and the
+ * rest of them with more if it is cut short, so that a command does not
+ * go out as separate packets on eg USB-CDC modems
+ * Returns AT_ERROR_* on error, AT_SUCCESS on success
+ */
+static ATReturn writeTerminated(ATChannel* atch, const char *s, size_t len, char terminator)
+{
+    struct iovec iov[2];
+    struct iovec *p_iov = iov;
+    int iovcnt = 2;
+    ssize_t written;
+
+    iov[0].iov_base = (void *)(uintptr_t) s;
+    iov[0].iov_len = len;
+    iov[1].iov_base = &terminator;
+    iov[1].iov_len = 1;
+
+    while (iovcnt > 0) {
+        do {
+            written = writev(atch->fd, p_iov, iovcnt);
+        } while (written < 0 && errno == EINTR);
+
+        if (written < 0) {
+            return AT_ERROR_GENERIC;
+        }
+
+        /* skip what went out */
+        while (iovcnt > 0 && (size_t)written >= p_iov->iov_len) {
+            written -= (ssize_t)p_iov->iov_len;
+            p_iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            p_iov->iov_base = (char *)p_iov->iov_base + written;
+            p_iov->iov_len -= (size_t)written;
+        }
+    }
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Sends string s to the radio with a \r appended.
+ * Returns AT_ERROR_* on error, AT_SUCCESS on success
+ *
+ * This function exists because as of writing, android libc does not
+ * have buffered stdio.
+ */
+static ATReturn writeline(ATChannel* atch, const char *s, size_t len)
+{
+    if (atch->fd < 0 || atch->impl->readerClosed) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    traceLine(atch, AT_TRACE_OUT, s, len);
+
+    AT_DUMP( atch, ">> ", s, len );
+
+    return writeTerminated(atch, s, len, '\r');
+}
+
+static ATReturn writeCtrlZ(ATChannel* atch, const char *s, size_t len)
+{
+    if (atch->fd < 0 || atch->impl->readerClosed) {
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    traceLine(atch, AT_TRACE_OUT_SMS, s, len);
+
+    AT_DUMP( atch, ">* ", s, len );
+
+    return writeTerminated(atch, s, len, '\032');
+}
+
+/**
+ * Opens and configures the serial port at "path", then attaches to it
+ * with a reader thread of its own or, if "engine" is non-NULL, on "engine"
+ */
+static ATReturn at_open_full(ATChannel* atch, ATEngine* engine)
+{
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (!atch->path) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if ((atch->logLevel < 0) || (LOG_DEBUG < atch->logLevel)) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    struct bitrate_value {
+        int bitrate;
+        speed_t value;
+    };
+
+    static const struct bitrate_value bitrateValues[] = {
+        {      0,       B0},
+        {     50,      B50},
+        {     75,      B75},
+        {    110,     B110},
+        {    134,     B134},
+        {    150,     B150},
+        {    200,     B200},
+        {    300,     B300},
+        {    600,     B600},
+        {   1200,    B1200},
+        {   1800,    B1800},
+        {   2400,    B2400},
+        {   4800,    B4800},
+        {   9600,    B9600},
+        {  19200,   B19200},
+        {  38400,   B38400},
+        {  57600,   B57600},
+        { 115200,  B115200},
+        { 230400,  B230400},
+        { 460800,  B460800},
+        { 500000,  B500000},
+        { 576000,  B576000},
+        { 921600,  B921600},
+        {1000000, B1000000},
+        {1152000, B1152000},
+        {1500000, B1500000},
+        {2000000, B2000000},
+        {2500000, B2500000},
+        {3000000, B3000000},
+        {3500000, B3500000},
+        {4000000, B4000000},
+    };
+
+    speed_t speed = (speed_t)-1;
+    for (unsigned int i = 0; i < NUM_ELEMS(bitrateValues); i++) {
+        if (atch->bitrate == bitrateValues[i].bitrate) {
+            speed = bitrateValues[i].value;
+        }
+    }
+    if (speed == (speed_t)-1) {
+        RLOGE(atch, "specified bitrate %d is invalid value.", atch->bitrate);
+        return AT_ERROR_GENERIC;
+    }
+
+    int fd = 0;
+    fd = open(atch->path, O_RDWR);
+    if (fd < 0) {
+        RLOGE(atch, "opening port %s failed: %s.", atch->path, strerror(errno));
+        return AT_ERROR_GENERIC;
+    }
+    atch->fd = fd;
+
+    struct termios ios;
+    tcgetattr(fd, &ios);
+    cfsetispeed(&ios, speed);
+    cfsetospeed(&ios, speed);
+    ios.c_lflag = atch->lflag;
+    tcsetattr(fd, TCSANOW, &ios);
+
+    ATReturn ret = 0;
+    if (engine != NULL) {
+        ret = at_attach_to_engine(atch, engine);
+    } else {
+        ret = at_attach(atch);
+    }
+    if (ret < 0) {
+        close(atch->fd);
+    }
+
+    return ret;
+}
+
+ATReturn at_open(ATChannel* atch)
+{
+    return at_open_full(atch, NULL);
+}
+
+ATReturn at_open_on_engine(ATChannel* atch, ATEngine* engine)
+{
+    if (!engine) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    return at_open_full(atch, engine);
+}
+
+static ATReturn checkAttachable(ATChannel* atch)
+{
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (atch->fd < 0) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if ((atch->logLevel < 0) || (LOG_DEBUG < atch->logLevel)) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    return AT_SUCCESS;
+}
+
+static ATChannelImpl * newImpl(void)
+{
+    ATChannelImpl *impl;
+    pthread_condattr_t condattr;
+
+    impl = calloc(1, sizeof(*impl));
+    if (impl == NULL) {
+        return NULL;
+    }
+
+    atomic_init(&impl->classifier, classifierDefault());
+    if (atomic_load_explicit(&impl->classifier, memory_order_relaxed) == NULL) {
+        free(impl);
+        return NULL;
+    }
+
+    impl->responsePool = responsePoolNew();
+    if (impl->responsePool == NULL) {
+        free(impl);
+        return NULL;
+    }
+
+    impl->stats = statsNew();
+    if (impl->stats == NULL) {
+        responsePoolRelease(impl->responsePool);
+        free(impl);
+        return NULL;
+    }
+
+    impl->scheduler = schedulerNew();
+    if (impl->scheduler == NULL) {
+        statsFree(impl->stats);
+        responsePoolRelease(impl->responsePool);
+        free(impl);
+        return NULL;
+    }
+
+    impl->tid_reader = 0;
+    impl->ATBufferStart = 0;
+    impl->ATBufferLen = 0;
+    impl->ATBufferScanned = 0;
+    impl->spill = NULL;
+    impl->spillLen = 0;
+    impl->spillCapacity = 0;
+    impl->spillReturned = false;
+    impl->spillDiscarding = false;
+    atomic_init(&impl->maxLineLength, DEFAULT_MAX_LINE_LENGTH);
+    impl->lineEndedCR = false;
+    impl->payloadCommand = NULL;
+    impl->payloadReading = false;
+    impl->payloadFinishing = false;
+    impl->payloadRemaining = 0;
+    impl->payloadSkipLF = false;
+    impl->smsUnsolLine = NULL;
+    impl->smsUnsolLineLen = 0;
+    pthread_mutex_init(&impl->unsolmutex, NULL);
+    impl->unsolTable = NULL;
+    pthread_mutex_init(&impl->dispatchmutex, NULL);
+    pthread_cond_init(&impl->dispatchcond, NULL);
+    impl->dispatchers = NULL;
+    impl->dispatcherCount = 0;
+    impl->dispatchQueueLength = 0;
+    impl->dispatchChanging = false;
+    pthread_mutex_init(&impl->commandmutex, NULL);
+    pthread_cond_init(&impl->commandcond, NULL);
+    impl->queue.p_head = NULL;
+    impl->queue.p_tail = NULL;
+    impl->readerClosed = false;
+    impl->readerRunning = false;
+    impl->readerStopping = false;
+    impl->wakeupfd = -1;
+    impl->engine = NULL;
+    atomic_init(&impl->trace, NULL);
+    impl->traceRings = NULL;
+    pthread_mutex_init(&impl->tracemutex, NULL);
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&impl->tracecond, &condattr);
+    pthread_condattr_destroy(&condattr);
+    impl->traceThreadRunning = false;
+    impl->traceStopping = false;
+    impl->traceChannel = NULL;
+    impl->traceCallback = NULL;
+    impl->traceCtx = NULL;
+    impl->detached = false;
+
+    return impl;
+}
+
+/**
+ * Starts AT handler on stream "fd'
+ * returns AT_SUCCESS on success, AT_ERROR_* on error
+ */
+ATReturn at_attach(ATChannel* atch)
+{
+    ATReturn err = checkAttachable(atch);
+    if (err != AT_SUCCESS) {
+        return err;
+    }
+
+    int ret;
+    pthread_attr_t attr;
+
+    atch->impl = newImpl();
+    if (atch->impl == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+    atch->impl->wakeupfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (atch->impl->wakeupfd < 0) {
+        RLOGE(atch, "Creating wakeup event has failed: %s.", strerror(errno));
+        freeImpl(atch->impl);
+        atch->impl = NULL;
+        return AT_ERROR_GENERIC;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    atch->impl->readerRunning = true;
+    ret = pthread_create(&atch->impl->tid_reader, &attr, readerLoop, atch);
+
+    if (ret != 0) {
+        freeImpl(atch->impl);
+        atch->impl = NULL;
+        RLOGE(atch, "Creating reader thread has failed: %s.", strerror(ret));
+        return AT_ERROR_GENERIC;
+    }
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Starts AT handler on stream "fd" without a reader thread of its own,
+ * the input is read by the threads of "engine"
+ * returns AT_SUCCESS on success, AT_ERROR_* on error
+ */
+ATReturn at_attach_to_engine(ATChannel* atch, ATEngine* engine)
+{
+    ATReturn err = checkAttachable(atch);
+    if (err != AT_SUCCESS) {
+        return err;
+    }
+    if (!engine) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    atch->impl = newImpl();
+    if (atch->impl == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    err = engineAttach(engine, atch);
+    if (err != AT_SUCCESS) {
+        freeImpl(atch->impl);
+        atch->impl = NULL;
+    }
+
+    return err;
+}
+
+/**
+ * Sets the length of the longest input line delivered, longer lines are
+ * dropped. Lines longer than the 8 KB input ring are gathered in a buffer
+ * growing up to this limit.
+ * 0 restores the default of 64 KB
+ */
+ATReturn at_set_max_line_length(ATChannel* atch, size_t maxLength)
+{
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    if (maxLength == 0) {
+        maxLength = DEFAULT_MAX_LINE_LENGTH;
+    }
+    atomic_store_explicit(&atch->impl->maxLineLength, maxLength, memory_order_relaxed);
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Takes the lines starting with "prefix" for "lineClass" on this channel,
+ * eg vendor final responses like "SEND OK". The longest matching prefix
+ * wins, so a longer prefix may also override a default one.
+ */
+ATReturn at_add_line_prefix(ATChannel* atch, const char *prefix, ATLineClass lineClass)
+{
+    ATChannelImpl *impl;
+    ATClassifier *classifier;
+
+    if (!atch || !prefix || prefix[0] == '\0') {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    switch (lineClass) {
+        case AT_LINE_OTHER:
+        case AT_LINE_FINAL_SUCCESS:
+        case AT_LINE_FINAL_ERROR:
+        case AT_LINE_SMS_UNSOLICITED:
+        case AT_LINE_UNSOLICITED:
+            break;
+        default:
+            return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    impl = atch->impl;
+    pthread_mutex_lock(&impl->commandmutex);
+
+    /* the reader may still be matching against the old classifier */
+    classifier = classifierAdd(atomic_load_explicit(&impl->classifier, memory_order_relaxed),
+                               prefix, lineClass);
+    if (classifier != NULL) {
+        atomic_store_explicit(&impl->classifier, classifier, memory_order_release);
+    }
+
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    return classifier != NULL ? AT_SUCCESS : AT_ERROR_GENERIC;
+}
+
+/**
+ * Calls "callback" instead of unsolHandler for the unsolicited responses
+ * starting with "prefix", which begins with a whole response name, eg
+ * "+CREG", "RING" or "+QIURC: \"recv\"". The longest registered prefix
+ * wins. A NULL "callback" removes the handler of "prefix".
+ * Two-line SMS responses still go to unsolSmsHandler.
+ */
+ATReturn at_register_unsol_handler(ATChannel* atch, const char *prefix,
+                                   ATUnsolCallback callback, void *ctx)
+{
+    ATChannelImpl *impl;
+    ATReturn ret = AT_SUCCESS;
+
+    if (!atch || !prefix || prefix[0] == '\0') {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    impl = atch->impl;
+    pthread_mutex_lock(&impl->unsolmutex);
+
+    if (impl->unsolTable == NULL && callback != NULL) {
+        impl->unsolTable = unsolTableNew();
+    }
+    if (impl->unsolTable != NULL) {
+        if (!unsolTableSet(impl->unsolTable, prefix, callback, ctx)) {
+            ret = AT_ERROR_GENERIC;
+        }
+    } else if (callback != NULL) {
+        ret = AT_ERROR_GENERIC;
+    }
+
+    pthread_mutex_unlock(&impl->unsolmutex);
+
+    return ret;
+}
+
+/**
+ * Calls the unsolicited response handlers from "threadCount" dispatcher
+ * threads instead of the reader, so that slow handlers do not hold up
+ * command responses. Responses of the same name, eg "+CREG", are handled
+ * in order by the same thread. The reader waits when "queueLength"
+ * responses are queued for a thread, 0 means 64.
+ * The handlers must not block, like on the reader.
+ * A "threadCount" of 0 calls the handlers from the reader again.
+ */
+ATReturn at_set_unsol_dispatch(ATChannel* atch, int threadCount, size_t queueLength)
+{
+    ATChannelImpl *impl;
+    ATDispatcher *dispatchers = NULL;
+    size_t count;
+    size_t i;
+
+    if (!atch || threadCount < 0) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (s_dispatchedChannel != NULL) {
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    impl = atch->impl;
+    count = (size_t) threadCount;
+
+    pthread_mutex_lock(&impl->dispatchmutex);
+
+    while (impl->dispatchChanging) {
+        pthread_cond_wait(&impl->dispatchcond, &impl->dispatchmutex);
+    }
+    impl->dispatchChanging = true;
+
+    /* the queued responses are delivered before any later ones */
+    stopDispatchers(impl);
+
+    if (count > 0) {
+        dispatchers = calloc(count, sizeof(ATDispatcher));
+        if (dispatchers == NULL) {
+            impl->dispatchChanging = false;
+            pthread_cond_broadcast(&impl->dispatchcond);
+            pthread_mutex_unlock(&impl->dispatchmutex);
+            return AT_ERROR_GENERIC;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        dispatchers[i].atch = atch;
+        pthread_cond_init(&dispatchers[i].cond, NULL);
+        if (0 != pthread_create(&dispatchers[i].tid, NULL, dispatcherLoop, &dispatchers[i])) {
+            pthread_cond_destroy(&dispatchers[i].cond);
+            break;
+        }
+    }
+
+    impl->dispatchers = dispatchers;
+    impl->dispatcherCount = i;
+    impl->dispatchQueueLength = queueLength > 0 ? queueLength : DEFAULT_DISPATCH_QUEUE_LENGTH;
+    if (i < count) {
+        /* keep none rather than fewer threads than asked for */
+        stopDispatchers(impl);
+    }
+
+    impl->dispatchChanging = false;
+    pthread_cond_broadcast(&impl->dispatchcond);
+    pthread_mutex_unlock(&impl->dispatchmutex);
+
+    return i == count ? AT_SUCCESS : AT_ERROR_GENERIC;
+}
+
+ATReturn at_detach(ATChannel* atch)
+{
+    ATChannelImpl *impl;
+
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (s_dispatchedChannel == atch || s_tracingChannel == atch) {
+        /* the dispatchers and the trace thread are joined below */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    fdatasync(atch->fd);
+
+    if (atch->impl->engine != NULL) {
+        return engineDetach(atch);
+    }
+
+    impl = atch->impl;
+
+    if (0 != pthread_equal(impl->tid_reader, pthread_self())) {
+        /* detached from a handler, the reader frees the channel on its way out */
+        onReaderClosed(atch);
+        shutdownDispatch(impl);
+        shutdownTrace(impl);
+        impl->detached = true;
+        atch->impl = NULL;
+        return AT_SUCCESS;
+    }
+
+    /* the reader exits the next time it waits for input */
+    pthread_mutex_lock(&impl->commandmutex);
+    impl->readerStopping = true;
+    pthread_mutex_unlock(&impl->commandmutex);
+    wakeReader(atch);
+
+    pthread_mutex_lock(&impl->commandmutex);
+    while (impl->readerRunning) {
+        pthread_cond_wait(&impl->commandcond, &impl->commandmutex);
+    }
+    pthread_mutex_unlock(&impl->commandmutex);
+
+    /* fails every queued command with AT_ERROR_CHANNEL_CLOSED */
+    onReaderClosed(atch);
+    shutdownDispatch(impl);
+    shutdownTrace(impl);
+
+    freeImpl(impl);
+    atch->impl = NULL;
+
+    return AT_SUCCESS;
+}
+
+/* FIXME is it ok to call this from the reader and the command thread? */
+ATReturn at_close(ATChannel* atch)
 {
     if (!atch) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
-    if (atch->impl) {
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    ATReturn ret = 0;
+    ret = at_detach(atch);
+    if (ret != AT_SUCCESS) {
+        return ret;
+    }
+    if (atch->fd >= 0) {
+        close(atch->fd);
+    }
+    atch->fd = -1;
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Submits a synchronous command and waits for it, then frees it
+ * *p_reportTimeout tells whether the issuer is to call onTimeoutHandler
+ * assumes commandmutex is held
+ */
+static ATReturn runCommand(ATChannel* atch, ATCommand *p_cmd, ATResponse **pp_outResponse,
+                    bool *p_reportTimeout, ATCommandList *p_done)
+{
+    ATReturn err;
+
+    submitCommand(atch, p_cmd, p_done);
+
+    /* the reader finishes the command, see finishCommand() */
+    while (!p_cmd->done) {
+        pthread_cond_wait(&atch->impl->commandcond, &atch->impl->commandmutex);
+    }
+
+    err = p_cmd->err;
+    *p_reportTimeout = p_cmd->reportTimeout;
+
+    if (pp_outResponse == NULL) {
+        if (p_cmd->p_response != NULL) {
+            at_response_free(p_cmd->p_response);
+        }
+    } else {
+        *pp_outResponse = p_cmd->p_response;
+    }
+
+    free(p_cmd);
+
+    return err;
+}
+
+/**
+ * Internal send_command implementation
+ * Doesn't lock or call the timeout callback
+ * Finished asynchronous commands are put on "p_done"
+ *
+ * timeoutMsec == 0 means infinite timeout
+ */
+static ATReturn at_send_command_full_nolock(ATChannel* atch, const char *command,
+                    size_t commandLen, ATCommandType type, const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATResponse **pp_outResponse,
+                    bool *p_reportTimeout, ATCommandList *p_done)
+{
+    ATCommand *p_cmd;
+
+    *p_reportTimeout = false;
+
+    if (pp_outResponse) {
+        *pp_outResponse = NULL;
+    }
+
+    p_cmd = newCommand(command, commandLen, type, responsePrefix, smspdu, timeoutMsec,
+                       NULL, NULL);
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    return runCommand(atch, p_cmd, pp_outResponse, p_reportTimeout, p_done);
+}
+
+/**
+ * Internal send_command implementation
+ *
+ * timeoutMsec == 0 means infinite timeout
+ */
+static ATReturn at_send_command_full(ATChannel* atch, const char *command, size_t commandLen,
+                    ATCommandType type, const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    ATCommandList done = { NULL, NULL };
+    bool reportTimeout = false;
+    ATReturn err;
+
+    if (isReaderThread(atch)) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+
+    if (atch->impl->cache != NULL && smspdu == NULL && pp_outResponse != NULL) {
+        *pp_outResponse = cacheLookup(atch->impl->cache, command, commandLen, (int) type,
+                                      responsePrefix, monotonicNsec());
+        if (*pp_outResponse != NULL) {
+            pthread_mutex_unlock(&atch->impl->commandmutex);
+            return AT_SUCCESS;
+        }
+    }
+
+    err = at_send_command_full_nolock(atch, command, commandLen, type,
+                    responsePrefix, smspdu,
+                    timeoutMsec, pp_outResponse, &reportTimeout, &done);
+
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
+
+    if (reportTimeout && atch->onTimeoutHandler != NULL) {
+        atch->onTimeoutHandler(atch);
+    }
+
+    return err;
+}
+
+/**
+ * Internal send_command_async implementation
+ *
+ * timeoutMsec == 0 means infinite timeout
+ */
+static ATReturn at_send_command_async_full(ATChannel* atch, const char *command,
+                    ATCommandType type, const char *responsePrefix, const char *smspdu,
+                    long long timeoutMsec, ATCommandCallback callback, void *ctx)
+{
+    ATCommandList done = { NULL, NULL };
+    ATCommand *p_cmd;
+    ATResponse *p_cached = NULL;
+
+    p_cmd = newCommand(command, strlen(command), type, responsePrefix, smspdu, timeoutMsec,
+                       callback, ctx);
+    if (p_cmd == NULL) {
+        return AT_ERROR_GENERIC;
+    }
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+
+    if (atch->impl->readerClosed) {
+        pthread_mutex_unlock(&atch->impl->commandmutex);
+        free(p_cmd);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    if (atch->impl->cache != NULL && smspdu == NULL) {
+        p_cached = cacheLookup(atch->impl->cache, command, p_cmd->commandLen, (int) type,
+                               responsePrefix, monotonicNsec());
+    }
+    if (p_cached != NULL) {
+        pthread_mutex_unlock(&atch->impl->commandmutex);
+        free(p_cmd);
+        callback(atch, AT_SUCCESS, p_cached, ctx);
+        return AT_SUCCESS;
+    }
+
+    submitCommand(atch, p_cmd, &done);
+
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Issue a single normal AT command with no intermediate response expected
+ *
+ * "command" should not include \r
+ * pp_outResponse can be NULL
+ *
+ * if non-NULL, the resulting ATResponse * must be eventually freed with
+ * at_response_free
+ */
+ATReturn at_send_command(ATChannel* atch, const char *command, ATResponse **pp_outResponse)
+{
+    return at_send_command_timeout(atch, command, 0, pp_outResponse);
+}
+
+ATReturn at_send_command_timeout(ATChannel* atch, const char *command, long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    if (!command) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    return at_send_command_timeout_n(atch, command, strlen(command), timeoutMsec,
+                                     pp_outResponse);
+}
+
+/**
+ * Like at_send_command(), but "command" is "len" bytes long, so it is
+ * never scanned for its end and may hold NULs
+ */
+ATReturn at_send_command_n(ATChannel* atch, const char *command, size_t len,
+                                ATResponse **pp_outResponse)
+{
+    return at_send_command_timeout_n(atch, command, len, 0, pp_outResponse);
+}
+
+ATReturn at_send_command_timeout_n(ATChannel* atch, const char *command, size_t len,
+                                long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    if (!atch || !command || !pp_outResponse) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
-    if (!atch->path) {
+
+    ATReturn err;
+
+    err = at_send_command_full(atch, command, len, NO_RESULT, NULL,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+ATReturn at_send_command_singleline(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                ATResponse **pp_outResponse)
+{
+    return at_send_command_singleline_timeout(atch, command, responsePrefix, 0, pp_outResponse);
+}
+
+ATReturn at_send_command_singleline_timeout(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    if (!atch || !command || !responsePrefix || !pp_outResponse) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
-    if ((atch->logLevel < 0) || (LOG_DEBUG < atch->logLevel)) {
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    ATReturn err;
+
+    err = at_send_command_full(atch, command, strlen(command), SINGLELINE, responsePrefix,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+ATReturn at_send_command_numeric(ATChannel* atch, const char *command,
+                                ATResponse **pp_outResponse)
+{
+    return at_send_command_numeric_timeout(atch, command, 0, pp_outResponse);
+}
+
+ATReturn at_send_command_numeric_timeout(ATChannel* atch, const char *command,
+                                long long timeoutMsec, ATResponse **pp_outResponse)
+{
+    if (!atch || !command || !pp_outResponse) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
 
-    struct bitrate_value {
-        int bitrate;
-        speed_t value;
-    };
+    ATReturn err;
 
-    static const struct bitrate_value bitrateValues[] = {
-        {      0,       B0},
-        {     50,      B50},
-        {     75,      B75},
-        {    110,     B110},
-        {    134,     B134},
-        {    150,     B150},
-        {    200,     B200},
-        {    300,     B300},
-        {    600,     B600},
-        {   1200,    B1200},
-        {   1800,    B1800},
-        {   2400,    B2400},
-        {   4800,    B4800},
-        {   9600,    B9600},
-        {  19200,   B19200},
-        {  38400,   B38400},
-        {  57600,   B57600},
-        { 115200,  B115200},
-        { 230400,  B230400},
-        { 460800,  B460800},
-        { 500000,  B500000},
-        { 576000,  B576000},
-        { 921600,  B921600},
-        {1000000, B1000000},
-        {1152000, B1152000},
-        {1500000, B1500000},
-        {2000000, B2000000},
-        {2500000, B2500000},
-        {3000000, B3000000},
-        {3500000, B3500000},
-        {4000000, B4000000},
-    };
+    err = at_send_command_full(atch, command, strlen(command), NUMERIC, NULL,
+                                    NULL, timeoutMsec, pp_outResponse);
 
-    speed_t speed = (speed_t)-1;
-    for (unsigned int i = 0; i < NUM_ELEMS(bitrateValues); i++) {
-        if (atch->bitrate == bitrateValues[i].bitrate) {
-            speed = bitrateValues[i].value;
-        }
+    return err;
+}
+
+ATReturn at_send_command_sms(ATChannel* atch, const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                ATResponse **pp_outResponse)
+{
+    return at_send_command_sms_timeout(atch, command, pdu, responsePrefix, 0, pp_outResponse);
+}
+
+ATReturn at_send_command_sms_timeout(ATChannel* atch, const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    if (!atch || !command || !pdu || !responsePrefix || !pp_outResponse) {
+        return AT_ERROR_INVALID_ARGUMENT;
     }
-    if (speed == (speed_t)-1) {
-        RLOGE(atch, "specified bitrate %d is invalid value.", atch->bitrate);
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    ATReturn err;
+
+    err = at_send_command_full(atch, command, strlen(command), SINGLELINE, responsePrefix,
+                                    pdu, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+ATReturn at_send_command_multiline(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                ATResponse **pp_outResponse)
+{
+    return at_send_command_multiline_timeout(atch, command, responsePrefix, 0, pp_outResponse);
+}
+
+ATReturn at_send_command_multiline_timeout(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATResponse **pp_outResponse)
+{
+    if (!atch || !command || !responsePrefix || !pp_outResponse) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    ATReturn err;
+
+    err = at_send_command_full(atch, command, strlen(command), MULTILINE, responsePrefix,
+                                    NULL, timeoutMsec, pp_outResponse);
+
+    return err;
+}
+
+/**
+ * Like at_send_command_multiline_timeout(), but hands each intermediate
+ * response to "callback" as it arrives instead of only once the final
+ * response is in. Only the first "maxBufferedLines" of them are kept in
+ * the response too, so 0 keeps memory flat however long the listing.
+ * The command is neither cached nor coalesced.
+ */
+ATReturn at_send_command_multiline_stream(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATLineCallback callback, void *ctx,
+                                size_t maxBufferedLines,
+                                ATResponse **pp_outResponse)
+{
+    ATCommandList done = { NULL, NULL };
+    ATCommand *p_cmd;
+    bool reportTimeout = false;
+    ATReturn err;
+
+    if (!atch || !command || !responsePrefix || !callback || !pp_outResponse) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (isReaderThread(atch)) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    *pp_outResponse = NULL;
+
+    p_cmd = newCommand(command, strlen(command), MULTILINE, responsePrefix, NULL, timeoutMsec,
+                       NULL, NULL);
+    if (p_cmd == NULL) {
         return AT_ERROR_GENERIC;
     }
+    p_cmd->lineCallback = callback;
+    p_cmd->lineCtx = ctx;
+    p_cmd->maxBufferedLines = maxBufferedLines;
 
-    int fd = 0;
-    fd = open(atch->path, O_RDWR);
-    if (fd < 0) {
-        RLOGE(atch, "opening port %s failed: %s.", atch->path, strerror(errno));
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    err = runCommand(atch, p_cmd, pp_outResponse, &reportTimeout, &done);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
+
+    if (reportTimeout && atch->onTimeoutHandler != NULL) {
+        atch->onTimeoutHandler(atch);
+    }
+
+    return err;
+}
+
+/**
+ * Like at_send_command_singleline_timeout(), but the intermediate response
+ * announces a raw payload following it, eg "+QIRD: <len>" or
+ * "CONNECT <len>": the first number after "responsePrefix" is its length
+ * in bytes. The payload is read straight into "payload", bytes past
+ * "payloadSize" being dropped, and "*p_payloadLen" is set to the length
+ * announced, 0 if there is none.
+ * The command is neither cached nor coalesced.
+ */
+ATReturn at_send_command_payload(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                void *payload, size_t payloadSize,
+                                size_t *p_payloadLen,
+                                ATResponse **pp_outResponse)
+{
+    ATCommandList done = { NULL, NULL };
+    ATCommand *p_cmd;
+    bool reportTimeout = false;
+    ATReturn err;
+
+    if (!atch || !command || !responsePrefix || (!payload && payloadSize > 0)
+        || !p_payloadLen || !pp_outResponse) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (isReaderThread(atch)) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
+
+    *pp_outResponse = NULL;
+    *p_payloadLen = 0;
+
+    p_cmd = newCommand(command, strlen(command), SINGLELINE, responsePrefix, NULL, timeoutMsec,
+                       NULL, NULL);
+    if (p_cmd == NULL) {
         return AT_ERROR_GENERIC;
     }
-    atch->fd = fd;
+    p_cmd->hasPayload = true;
+    p_cmd->payload = payload;
+    p_cmd->payloadSize = payloadSize;
+    p_cmd->p_payloadLen = p_payloadLen;
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    err = runCommand(atch, p_cmd, pp_outResponse, &reportTimeout, &done);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
+
+    if (err != AT_SUCCESS) {
+        *p_payloadLen = 0;
+    }
+    if (reportTimeout && atch->onTimeoutHandler != NULL) {
+        atch->onTimeoutHandler(atch);
+    }
+
+    return err;
+}
+
+/**
+ * Queue a single normal AT command with no intermediate response expected
+ * and return without waiting for the response
+ *
+ * "callback" is invoked with "ctx" once the final response arrives, the
+ * command times out or the channel closes. It is usually called on the
+ * reader thread, but may be called from the current thread before this
+ * returns if the command cannot be written.
+ * Commands are written one by one in submission order, "timeoutMsec" counts
+ * from the moment the command is written.
+ * onTimeoutHandler is not called for asynchronous commands.
+ */
+ATReturn at_send_command_async(ATChannel* atch, const char *command, long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx)
+{
+    if (!atch || !command || !callback) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    return at_send_command_async_full(atch, command, NO_RESULT, NULL,
+                                    NULL, timeoutMsec, callback, ctx);
+}
+
+ATReturn at_send_command_singleline_async(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx)
+{
+    if (!atch || !command || !responsePrefix || !callback) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
 
-    struct termios ios;
-    tcgetattr(fd, &ios);
-    cfsetispeed(&ios, speed);
-    cfsetospeed(&ios, speed);
-    ios.c_lflag = atch->lflag;
-    tcsetattr(fd, TCSANOW, &ios);
+    return at_send_command_async_full(atch, command, SINGLELINE, responsePrefix,
+                                    NULL, timeoutMsec, callback, ctx);
+}
 
-    ATReturn ret = 0;
-    ret = at_attach(atch);
-    if (ret < 0) {
-        close(atch->fd);
+ATReturn at_send_command_numeric_async(ATChannel* atch, const char *command,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx)
+{
+    if (!atch || !command || !callback) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
     }
 
-    return ret;
+    return at_send_command_async_full(atch, command, NUMERIC, NULL,
+                                    NULL, timeoutMsec, callback, ctx);
 }
 
-/**
- * Starts AT handler on stream "fd'
- * returns AT_SUCCESS on success, AT_ERROR_* on error
- */
-ATReturn at_attach(ATChannel* atch)
+ATReturn at_send_command_sms_async(ATChannel* atch, const char *command,
+                                const char *pdu,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx)
 {
-    if (!atch) {
+    if (!atch || !command || !pdu || !responsePrefix || !callback) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
-    if (atch->impl) {
+    if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
-    if (atch->fd < 0) {
+
+    return at_send_command_async_full(atch, command, SINGLELINE, responsePrefix,
+                                    pdu, timeoutMsec, callback, ctx);
+}
+
+ATReturn at_send_command_multiline_async(ATChannel* atch, const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx)
+{
+    if (!atch || !command || !responsePrefix || !callback) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
-    if ((atch->logLevel < 0) || (LOG_DEBUG < atch->logLevel)) {
-        return AT_ERROR_INVALID_ARGUMENT;
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
     }
 
-    int ret;
-    pthread_attr_t attr;
+    return at_send_command_async_full(atch, command, MULTILINE, responsePrefix,
+                                    NULL, timeoutMsec, callback, ctx);
+}
 
-    atch->impl = calloc(1, sizeof(*atch->impl));
-    atch->impl->tid_reader = 0;
-    atch->impl->ATBufferCur = atch->impl->ATBuffer;
-    pthread_mutex_init(&atch->impl->commandmutex, NULL);
-    pthread_cond_init(&atch->impl->commandcond, NULL);
-    atch->impl->type = 0;
-    atch->impl->responsePrefix = NULL;
-    atch->impl->smsPDU = NULL;
-    atch->impl->p_response = NULL;
-    atch->impl->readerClosed = false;
+/** returns true if a batch entry may share a command line with its neighbours */
+static bool isConcatenable(const ATBatchEntry *p_entry)
+{
+    const char *command = p_entry->command;
 
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    return p_entry->type == AT_BATCH_NO_RESULT
+        && (command[0] == 'A' || command[0] == 'a')
+        && (command[1] == 'T' || command[1] == 't')
+        && command[2] != '\0' && strchr("+^$%*#", command[2]) != NULL
+        && strchr(command, ';') == NULL;
+}
 
-    ret = pthread_create(&atch->impl->tid_reader, &attr, readerLoop, atch);
+static ATCommandType batchCommandType(ATBatchType type)
+{
+    switch (type) {
+        case AT_BATCH_NUMERIC:
+            return NUMERIC;
+        case AT_BATCH_SINGLELINE:
+            return SINGLELINE;
+        case AT_BATCH_MULTILINE:
+            return MULTILINE;
+        case AT_BATCH_NO_RESULT:
+        default:
+            return NO_RESULT;
+    }
+}
 
-    if (ret < 0) {
-        free(atch->impl);
-        atch->impl = NULL;
-        RLOGE(atch, "Creating reader thread has failed: %s.", strerror(errno));
-        return AT_ERROR_GENERIC;
+/**
+ * Makes the command of the line starting at entries[first], concatenating
+ * what follows if allowed; *p_next is set to the entry after the line
+ */
+static ATCommand * newBatchCommand(const ATBatchEntry *entries, size_t count, size_t first,
+                    unsigned int flags, size_t *p_next)
+{
+    const ATBatchEntry *p_entry = &entries[first];
+    const char *command = p_entry->command;
+    long long timeoutMsec = p_entry->timeoutMsec;
+    char line[MAX_BATCH_LINE_LENGTH + 1];
+    size_t len = strlen(command);
+    size_t next = first + 1;
+
+    if ((flags & AT_BATCH_CONCATENATE) && isConcatenable(p_entry)) {
+        while (len <= MAX_BATCH_LINE_LENGTH && next < count
+               && isConcatenable(&entries[next])) {
+            /* ";+CREG=2" for "AT+CREG=2" */
+            size_t more = strlen(entries[next].command) - 2;
+
+            if (len + 1 + more > MAX_BATCH_LINE_LENGTH) {
+                break;
+            }
+            if (next == first + 1) {
+                memcpy(line, command, len);
+                command = line;
+            }
+            line[len++] = ';';
+            memcpy(line + len, entries[next].command + 2, more + 1);
+            len += more;
+
+            /* the commands of a line run one after the other */
+            if (timeoutMsec != 0) {
+                timeoutMsec = entries[next].timeoutMsec == 0
+                                ? 0 : timeoutMsec + entries[next].timeoutMsec;
+            }
+            next++;
+        }
     }
 
-    return AT_SUCCESS;
+    *p_next = next;
+
+    return newCommand(command, len, batchCommandType(p_entry->type), p_entry->responsePrefix,
+                    NULL, timeoutMsec, NULL, NULL);
 }
 
-ATReturn at_detach(ATChannel* atch)
+/**
+ * Issue a script of commands, eg an init sequence, and wait for them all
+ *
+ * The commands are queued back to back under one lock acquisition, in the
+ * highest priority class among them, so they run in order and no other
+ * command goes in between but one of a higher class. Each entry gets its
+ * own "err" and "p_response" like the at_send_command_* of its type would
+ * return.
+ * A failing entry does not stop the ones after it.
+ *
+ * With AT_BATCH_CONCATENATE, runs of extended commands expecting no
+ * intermediate response are sent on one line, saving round trips; their
+ * entries each get a copy of the response of the line. As the modem stops
+ * at the first failing command of a line and does not tell which one it
+ * was, this is for commands that may be repeated, like settings.
+ *
+ * Returns AT_SUCCESS once every entry is done, or an error if none was
+ * issued
+ */
+ATReturn at_send_command_batch(ATChannel* atch, ATBatchEntry *entries, size_t count,
+                                unsigned int flags)
 {
-    if (!atch) {
+    ATCommandList done = { NULL, NULL };
+    ATCommand **pp_cmds;
+    size_t *p_firsts;           /* the first entry of each command */
+    size_t cmdCount = 0;
+    bool timedOut = false;
+    size_t i;
+
+    if (!atch || (!entries && count > 0)) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
+    for (i = 0; i < count; i++) {
+        ATBatchEntry *p_entry = &entries[i];
+        bool prefixed = (p_entry->type == AT_BATCH_SINGLELINE
+                         || p_entry->type == AT_BATCH_MULTILINE);
+
+        if (!p_entry->command || (prefixed && !p_entry->responsePrefix)
+            || p_entry->type < AT_BATCH_NO_RESULT || p_entry->type > AT_BATCH_MULTILINE) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        p_entry->err = AT_ERROR_GENERIC;
+        p_entry->p_response = NULL;
+    }
+    if (count == 0) {
+        return AT_SUCCESS;
+    }
+    if (isReaderThread(atch)) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
 
-    fdatasync(atch->fd);
-    pthread_cancel(atch->impl->tid_reader);
-    onReaderClosed(atch);
+    pp_cmds = (ATCommand **) calloc(count, sizeof(ATCommand *));
+    p_firsts = (size_t *) calloc(count, sizeof(size_t));
+    if (pp_cmds == NULL || p_firsts == NULL) {
+        free(pp_cmds);
+        free(p_firsts);
+        return AT_ERROR_GENERIC;
+    }
+
+    for (i = 0; i < count; cmdCount++) {
+        p_firsts[cmdCount] = i;
+        pp_cmds[cmdCount] = newBatchCommand(entries, count, i, flags, &i);
+        if (pp_cmds[cmdCount] == NULL) {
+            while (cmdCount > 0) {
+                free(pp_cmds[--cmdCount]);
+            }
+            free(pp_cmds);
+            free(p_firsts);
+            return AT_ERROR_GENERIC;
+        }
+    }
 
     pthread_mutex_lock(&atch->impl->commandmutex);
-    atch->impl->readerClosed = true;
-    pthread_cond_signal(&atch->impl->commandcond);
+
+    if (atch->impl->readerClosed) {
+        pthread_mutex_unlock(&atch->impl->commandmutex);
+        for (i = 0; i < cmdCount; i++) {
+            free(pp_cmds[i]);
+        }
+        free(pp_cmds);
+        free(p_firsts);
+        return AT_ERROR_CHANNEL_CLOSED;
+    }
+
+    submitBatch(atch, pp_cmds, cmdCount, &done);
+
+    /* the reader finishes the commands, see finishCommand() */
+    for (i = 0; i < cmdCount; i++) {
+        while (!pp_cmds[i]->done) {
+            pthread_cond_wait(&atch->impl->commandcond, &atch->impl->commandmutex);
+        }
+    }
+
     pthread_mutex_unlock(&atch->impl->commandmutex);
 
-    free(atch->impl);
-    atch->impl = NULL;
+    completeCommands(atch, &done);
+
+    for (i = 0; i < cmdCount; i++) {
+        ATCommand *p_cmd = pp_cmds[i];
+        size_t end = i + 1 < cmdCount ? p_firsts[i + 1] : count;
+        size_t j;
+
+        for (j = p_firsts[i]; j < end; j++) {
+            entries[j].err = p_cmd->err;
+            if (p_cmd->p_response == NULL) {
+                continue;
+            }
+            /* the last entry of a line takes the original */
+            entries[j].p_response = (j + 1 == end)
+                                    ? p_cmd->p_response : responseCopy(p_cmd->p_response);
+            if (entries[j].p_response == NULL) {
+                entries[j].err = AT_ERROR_GENERIC;
+            }
+        }
+        if (p_cmd->err == AT_ERROR_TIMEOUT) {
+            timedOut = true;
+        }
+        free(p_cmd);
+    }
+    free(pp_cmds);
+    free(p_firsts);
 
-    /* the reader thread should eventually die */
+    if (timedOut && atch->onTimeoutHandler != NULL) {
+        atch->onTimeoutHandler(atch);
+    }
 
     return AT_SUCCESS;
 }
 
-/* FIXME is it ok to call this from the reader and the command thread? */
-ATReturn at_close(ATChannel* atch)
+/**
+ * Returns the first number of a response line starting with "prefix",
+ * eg the <mr> of "+CMGS: <mr>", or -1 if there is none
+ */
+static int responseNumber(char *line, const char *prefix)
 {
-    if (!atch) {
+    char *p_cur = line;
+    int value;
+
+    if (line == NULL || !strStartsWith(line, prefix)
+        || at_tok_start(&p_cur) < 0 || at_tok_nextint(&p_cur, &value) < 0) {
+        return -1;
+    }
+
+    return value;
+}
+
+/**
+ * returns true for the +CMS ERROR codes of a submission that was not
+ * sent and may go through later: the temporary network causes of
+ * 3GPP TS 24.011 (network out of order, temporary failure, congestion,
+ * resources unavailable), SIM busy and no network service
+ * Not network timeout (332) nor unknown error (500), which may follow a
+ * delivery.
+ */
+static bool isTransientCmsError(int cmsError)
+{
+    switch (cmsError) {
+        case 38:
+        case 41:
+        case 42:
+        case 47:
+        case 314:
+        case 331:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Fills in an entry of at_send_command_sms_batch() from its finished
+ * command, which is freed
+ *
+ * returns true if it is worth another attempt: the modem refused it with
+ * a transient +CMS ERROR
+ */
+static bool finishSmsEntry(ATSmsEntry *p_entry, ATCommand *p_cmd)
+{
+    ATResponse *p_response = p_cmd->p_response;
+    bool refused = false;
+
+    p_entry->attempts++;
+    p_entry->err = p_cmd->err;
+    p_entry->success = false;
+    p_entry->messageRef = -1;
+    p_entry->cmsError = -1;
+
+    if (p_response != NULL) {
+        p_entry->success = p_response->success;
+        if (p_response->success) {
+            p_entry->messageRef = responseNumber(p_response->p_intermediates->line, "+CMGS:");
+        } else {
+            p_entry->cmsError = responseNumber(p_response->finalResponse, "+CMS ERROR:");
+            refused = isTransientCmsError(p_entry->cmsError);
+        }
+        at_response_free(p_response);
+    }
+    free(p_cmd);
+
+    return refused;
+}
+
+/**
+ * Issue a batch of SMS submissions, eg AT+CMGS=<length> with a PDU
+ * each, and wait for them all
+ *
+ * The commands are queued back to back under one lock acquisition, so the
+ * reader writes the next one as soon as the final response of the last
+ * one is in, and each PDU goes out from the reader as soon as its "> "
+ * prompt arrives; nothing waits on the issuing thread in between.
+ * Each entry gets its own result, message reference and +CMS ERROR code.
+ * Those the modem refuses with a transient +CMS ERROR, eg congestion or
+ * SIM busy, are queued again after the others, up to "maxRetries" times.
+ * Permanent errors, a plain ERROR, and the codes that may follow a
+ * delivery, eg network timeout, are not retried, nor is a timed out
+ * entry, as it may have been sent.
+ * Giving AT+CMGS the AT_PRIORITY_BULK class keeps the other commands of
+ * the channel from waiting behind the batch.
+ *
+ * Returns AT_SUCCESS once every entry is done, or an error if none was
+ * issued
+ */
+ATReturn at_send_command_sms_batch(ATChannel* atch, ATSmsEntry *entries, size_t count,
+                                unsigned int maxRetries)
+{
+    ATCommandList done = { NULL, NULL };
+    ATCommand **pp_cmds;
+    size_t *p_pending;          /* the entries of the next round */
+    size_t pendingCount = count;
+    uint64_t start;
+    uint64_t attempts = 0;
+    uint64_t retries = 0;
+    uint64_t sent = 0;
+    bool timedOut = false;
+    unsigned int round;
+    size_t i;
+
+    if (!atch || (!entries && count > 0)) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
+    for (i = 0; i < count; i++) {
+        if (!entries[i].command || !entries[i].pdu) {
+            return AT_ERROR_INVALID_ARGUMENT;
+        }
+        entries[i].err = AT_ERROR_GENERIC;
+        entries[i].success = false;
+        entries[i].messageRef = -1;
+        entries[i].cmsError = -1;
+        entries[i].attempts = 0;
+    }
+    if (count == 0) {
+        return AT_SUCCESS;
+    }
+    if (isReaderThread(atch)) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
+    }
 
-    ATReturn ret = 0;
-    ret = at_detach(atch);
-    if (ret != AT_SUCCESS) {
-        return ret;
+    pp_cmds = (ATCommand **) calloc(count, sizeof(ATCommand *));
+    p_pending = (size_t *) calloc(count, sizeof(size_t));
+    if (pp_cmds == NULL || p_pending == NULL) {
+        free(pp_cmds);
+        free(p_pending);
+        return AT_ERROR_GENERIC;
     }
-    if (atch->fd >= 0) {
-        close(atch->fd);
+    for (i = 0; i < count; i++) {
+        p_pending[i] = i;
+    }
+
+    start = monotonicNsec();
+
+    for (round = 0; pendingCount > 0 && round <= maxRetries; round++) {
+        size_t refusedCount = 0;
+
+        for (i = 0; i < pendingCount; i++) {
+            const ATSmsEntry *p_entry = &entries[p_pending[i]];
+
+            /* an entry left without a command keeps AT_ERROR_GENERIC */
+            pp_cmds[i] = newCommand(p_entry->command, strlen(p_entry->command), SINGLELINE,
+                                    "+CMGS:", p_entry->pdu, p_entry->timeoutMsec, NULL, NULL);
+        }
+
+        pthread_mutex_lock(&atch->impl->commandmutex);
+
+        if (atch->impl->readerClosed) {
+            pthread_mutex_unlock(&atch->impl->commandmutex);
+            for (i = 0; i < pendingCount; i++) {
+                entries[p_pending[i]].err = AT_ERROR_CHANNEL_CLOSED;
+                free(pp_cmds[i]);
+            }
+            break;
+        }
+
+        for (i = 0; i < pendingCount; i++) {
+            if (pp_cmds[i] != NULL) {
+                submitCommand(atch, pp_cmds[i], &done);
+            }
+        }
+
+        /*
+         * the reader finishes the commands, see finishCommand(); their
+         * responses go back to the pool while the rest are in flight
+         */
+        for (i = 0; i < pendingCount; i++) {
+            ATSmsEntry *p_entry = &entries[p_pending[i]];
+
+            if (pp_cmds[i] == NULL) {
+                continue;
+            }
+            while (!pp_cmds[i]->done) {
+                pthread_cond_wait(&atch->impl->commandcond, &atch->impl->commandmutex);
+            }
+
+            attempts++;
+            if (pp_cmds[i]->err == AT_ERROR_TIMEOUT) {
+                timedOut = true;
+            }
+            if (finishSmsEntry(p_entry, pp_cmds[i])) {
+                p_pending[refusedCount++] = p_pending[i];
+            } else if (p_entry->success) {
+                sent++;
+            }
+        }
+
+        pthread_mutex_unlock(&atch->impl->commandmutex);
+
+        completeCommands(atch, &done);
+
+        if (round < maxRetries) {
+            retries += refusedCount;
+        }
+        pendingCount = refusedCount;
+    }
+
+    free(pp_cmds);
+    free(p_pending);
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    atch->impl->smsStats.messages += count;
+    atch->impl->smsStats.sent += sent;
+    atch->impl->smsStats.failed += count - sent;
+    atch->impl->smsStats.attempts += attempts;
+    atch->impl->smsStats.retries += retries;
+    atch->impl->smsStats.busyNsec += monotonicNsec() - start;
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    if (timedOut && atch->onTimeoutHandler != NULL) {
+        atch->onTimeoutHandler(atch);
     }
-    atch->fd = -1;
 
     return AT_SUCCESS;
 }
 
-static ATResponse * at_response_new(void)
+ATFuture* at_future_new(void)
+{
+    ATFuture *future;
+
+    future = (ATFuture *) calloc(1, sizeof(ATFuture));
+    if (future == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&future->mutex, NULL);
+    pthread_cond_init(&future->cond, NULL);
+
+    return future;
+}
+
+/**
+ * An ATCommandCallback that resolves the ATFuture passed as "ctx"
+ */
+void at_future_complete(ATChannel* atch, ATReturn err, ATResponse *p_response, void *ctx)
 {
-    return (ATResponse *) calloc(1, sizeof(ATResponse));
+    ATFuture *future = (ATFuture *) ctx;
+
+    (void) atch;
+
+    pthread_mutex_lock(&future->mutex);
+    future->err = err;
+    future->p_response = p_response;
+    future->done = true;
+    pthread_cond_broadcast(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
 }
 
-ATReturn at_response_free(ATResponse *p_response)
+/**
+ * Waits until the command bound to the future completes
+ * Must not be called from the reader thread
+ *
+ * on return *pp_outResponse is owned by the caller, the future may be
+ * waited on only once
+ */
+ATReturn at_future_wait(ATFuture* future, ATResponse **pp_outResponse)
 {
-    ATLine *p_line;
+    ATReturn err;
 
-    if (p_response == NULL) {
+    if (!future) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
 
-    p_line = p_response->p_intermediates;
+    pthread_mutex_lock(&future->mutex);
+    while (!future->done) {
+        pthread_cond_wait(&future->cond, &future->mutex);
+    }
+    err = future->err;
+    if (pp_outResponse != NULL) {
+        *pp_outResponse = future->p_response;
+    } else if (future->p_response != NULL) {
+        at_response_free(future->p_response);
+    }
+    future->p_response = NULL;
+    pthread_mutex_unlock(&future->mutex);
 
-    while (p_line != NULL) {
-        ATLine *p_toFree;
+    return err;
+}
 
-        p_toFree = p_line;
-        p_line = p_line->p_next;
+/** returns true if the command bound to the future has completed */
+bool at_future_is_done(ATFuture* future)
+{
+    bool done;
 
-        free(p_toFree->line);
-        free(p_toFree);
+    if (!future) {
+        return false;
     }
 
-    free(p_response->finalResponse);
-    free(p_response);
+    pthread_mutex_lock(&future->mutex);
+    done = future->done;
+    pthread_mutex_unlock(&future->mutex);
 
-    return AT_SUCCESS;
+    return done;
 }
 
-/**
- * The line reader places the intermediate responses in reverse order
- * here we flip them back
- */
-static void reverseIntermediates(ATResponse *p_response)
+void at_future_free(ATFuture* future)
 {
-    ATLine *pcur,*pnext;
-
-    pcur = p_response->p_intermediates;
-    p_response->p_intermediates = NULL;
+    if (future == NULL) {
+        return;
+    }
 
-    while (pcur != NULL) {
-        pnext = pcur->p_next;
-        pcur->p_next = p_response->p_intermediates;
-        p_response->p_intermediates = pcur;
-        pcur = pnext;
+    if (future->p_response != NULL) {
+        at_response_free(future->p_response);
     }
+    pthread_cond_destroy(&future->cond);
+    pthread_mutex_destroy(&future->mutex);
+    free(future);
 }
 
 /**
- * Internal send_command implementation
- * Doesn't lock or call the timeout callback
- *
- * timeoutMsec == 0 means infinite timeout
+ * Periodically issue an AT command and wait for a response.
+ * Used to ensure channel has start up and is active
  */
-static ATReturn at_send_command_full_nolock(ATChannel* atch, const char *command,
-                    ATCommandType type, const char *responsePrefix, const char *smspdu,
-                    long long timeoutMsec, ATResponse **pp_outResponse)
+ATReturn at_handshake(ATChannel* atch, const char* command, int retryCount, long long timeoutMsec)
 {
+    const char* HANDSHAKE_DEFAULT_COMMAND = "ATE0Q0V1";
+    const int HANDSHAKE_DEFAULT_RETRY_COUNT = 8;
+    const int HANDSHAKE_DEFAULT_TIMEOUT_MSEC = 250;
+
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (retryCount < 0) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (timeoutMsec < 0) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+
+    int i;
+    size_t commandLen;
     ATReturn err = 0;
-    struct timespec ts;
+    ATCommandList done = { NULL, NULL };
+    bool reportTimeout;
 
-    if (pp_outResponse) {
-        *pp_outResponse = NULL;
+    if (!command) {
+        command = HANDSHAKE_DEFAULT_COMMAND;
     }
-    if(atch->impl->p_response != NULL) {
-        err = AT_ERROR_COMMAND_PENDING;
-        goto error;
+    if (retryCount == 0) {
+        retryCount = HANDSHAKE_DEFAULT_RETRY_COUNT;
+    }
+    if (timeoutMsec == 0) {
+        timeoutMsec = HANDSHAKE_DEFAULT_TIMEOUT_MSEC;
     }
 
-    err = writeline(atch, command);
-
-    if (err < 0) {
-        goto error;
+    if (isReaderThread(atch)) {
+        /* cannot be called from reader thread */
+        return AT_ERROR_INVALID_THREAD;
     }
 
-    atch->impl->type = type;
-    atch->impl->responsePrefix = responsePrefix;
-    atch->impl->smsPDU = smspdu;
-    atch->impl->p_response = at_response_new();
+    commandLen = strlen(command);
 
-    if (timeoutMsec != 0) {
-        setTimespecRelative(&ts, timeoutMsec);
-    }
+    pthread_mutex_lock(&atch->impl->commandmutex);
 
-    while (atch->impl->p_response->finalResponse == NULL && !atch->impl->readerClosed) {
-        if (timeoutMsec != 0) {
-            err = pthread_cond_timedwait(&atch->impl->commandcond, &atch->impl->commandmutex, &ts);
-        } else {
-            err = pthread_cond_wait(&atch->impl->commandcond, &atch->impl->commandmutex);
-        }
+    for (i = 0 ; i < retryCount; i++) {
+        /* some stacks start with verbose off */
+        err = at_send_command_full_nolock(atch, command, commandLen, NO_RESULT,
+                    NULL, NULL, timeoutMsec, NULL, &reportTimeout, &done);
 
-        if (err == ETIMEDOUT) {
-            err = AT_ERROR_TIMEOUT;
-            goto error;
+        if (err == 0) {
+            break;
         }
     }
 
-    if (pp_outResponse == NULL) {
-        at_response_free(atch->impl->p_response);
-    } else {
-        /* line reader stores intermediate responses in reverse order */
-        reverseIntermediates(atch->impl->p_response);
-        *pp_outResponse = atch->impl->p_response;
-    }
-
-    atch->impl->p_response = NULL;
+    if (err == 0) {
+        /* pause for a bit to let the input buffer drain any unmatched OK's
+           (they will appear as extraneous unsolicited responses) */
 
-    if(atch->impl->readerClosed) {
-        err = AT_ERROR_CHANNEL_CLOSED;
-        goto error;
+        sleepMsec(timeoutMsec);
     }
 
-    err = AT_SUCCESS;
-error:
-    clearPendingCommand(atch);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    completeCommands(atch, &done);
 
     return err;
 }
 
 /**
- * Internal send_command implementation
- *
- * timeoutMsec == 0 means infinite timeout
+ * Answers "command" from a cache for "ttlMsec" after a successful response,
+ * without writing it, as long as it is issued with the same function
+ * "command" is compared as is, so it suits queries like AT+CGSN or AT+CSQ.
+ * An unsolicited response starting with "invalidatingPrefix", unless it
+ * is NULL, drops the cached response, eg "+CREG:" for AT+CREG?, so the
+ * next query is written; it does not refresh it, as an unsolicited
+ * response differs from the query's, eg it lacks the <n> of +CREG:.
+ * A response to a query in flight when it arrives is not cached either.
+ * The response prefix is part of the key.
+ * A "ttlMsec" of 0 or less stops caching "command".
+ * Cache hits are copies of the response, with the timing of the original.
  */
-static ATReturn at_send_command_full(ATChannel* atch, const char *command, ATCommandType type,
-                    const char *responsePrefix, const char *smspdu,
-                    long long timeoutMsec, ATResponse **pp_outResponse)
+ATReturn at_cache_command(ATChannel* atch, const char *command, long long ttlMsec,
+                          const char *invalidatingPrefix)
 {
-    ATReturn err;
+    ATReturn err = AT_SUCCESS;
 
-    if (0 != pthread_equal(atch->impl->tid_reader, pthread_self())) {
-        /* cannot be called from reader thread */
-        return AT_ERROR_INVALID_THREAD;
+    if (!atch || !command) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
     }
 
     pthread_mutex_lock(&atch->impl->commandmutex);
-
-    err = at_send_command_full_nolock(atch, command, type,
-                    responsePrefix, smspdu,
-                    timeoutMsec, pp_outResponse);
-
-    pthread_mutex_unlock(&atch->impl->commandmutex);
-
-    if (err == AT_ERROR_TIMEOUT && atch->onTimeoutHandler != NULL) {
-        atch->onTimeoutHandler(atch);
+    if (atch->impl->cache == NULL) {
+        atch->impl->cache = cacheNew();
     }
+    if (atch->impl->cache == NULL
+        || !cacheSetRule(atch->impl->cache, command,
+                         ttlMsec > 0 ? (uint64_t) ttlMsec * 1000000ULL : 0,
+                         invalidatingPrefix)) {
+        err = AT_ERROR_GENERIC;
+    }
+    pthread_mutex_unlock(&atch->impl->commandmutex);
 
     return err;
 }
 
 /**
- * Issue a single normal AT command with no intermediate response expected
- *
- * "command" should not include \r
- * pp_outResponse can be NULL
- *
- * if non-NULL, the resulting ATResponse * must be eventually freed with
- * at_response_free
+ * Lets a query identical to one already queued on the channel, that is
+ * the same command expecting the same intermediate response, wait for that
+ * one instead of being written again, then get a copy of its response.
+ * Only read and test commands, ending with "?", are coalesced, so that an
+ * action or set command, eg AT+CMGL or AT+CMGR=1, is always written.
+ * Commands expecting no intermediate response and SMS commands never are.
+ * A query only waits for one that times out no later than it would on
+ * its own; when that one times out, onTimeoutHandler is called once.
  */
-ATReturn at_send_command(ATChannel* atch, const char *command, ATResponse **pp_outResponse)
-{
-    return at_send_command_timeout(atch, command, 0, pp_outResponse);
-}
-
-ATReturn at_send_command_timeout(ATChannel* atch, const char *command, long long timeoutMsec,
-                                ATResponse **pp_outResponse)
+ATReturn at_set_coalescing(ATChannel* atch, bool enabled)
 {
-    if (!atch || !command || !pp_outResponse) {
+    if (!atch) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
 
-    ATReturn err;
-
-    err = at_send_command_full(atch, command, NO_RESULT, NULL,
-                                    NULL, timeoutMsec, pp_outResponse);
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    atch->impl->coalescing = enabled;
+    pthread_mutex_unlock(&atch->impl->commandmutex);
 
-    return err;
+    return AT_SUCCESS;
 }
 
-ATReturn at_send_command_singleline(ATChannel* atch, const char *command,
-                                const char *responsePrefix,
-                                ATResponse **pp_outResponse)
+/**
+ * Puts the commands starting with "prefix" in scheduling class "priority",
+ * the longest matching prefix decides and AT_PRIORITY_NORMAL is the default
+ * A queued command is written before those of lower classes, unless they
+ * have waited for a second already; the command in flight always finishes
+ * first. So commands submitted one after the other, eg asynchronously,
+ * may be written in another order when their classes differ; the
+ * commands of at_send_command_batch() share one class to keep theirs.
+ */
+ATReturn at_set_command_priority(ATChannel* atch, const char *prefix, ATPriority priority)
 {
-    return at_send_command_singleline_timeout(atch, command, responsePrefix, 0, pp_outResponse);
-}
+    ATReturn err = AT_SUCCESS;
 
-ATReturn at_send_command_singleline_timeout(ATChannel* atch, const char *command,
-                                const char *responsePrefix,
-                                long long timeoutMsec,
-                                ATResponse **pp_outResponse)
-{
-    if (!atch || !command || !responsePrefix || !pp_outResponse) {
+    if (!atch || !prefix || priority < AT_PRIORITY_BULK || priority > AT_PRIORITY_URGENT) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
 
-    ATReturn err;
-
-    err = at_send_command_full(atch, command, SINGLELINE, responsePrefix,
-                                    NULL, timeoutMsec, pp_outResponse);
-
-    if (err == AT_SUCCESS && pp_outResponse != NULL
-        && (*pp_outResponse)->success
-        && (*pp_outResponse)->p_intermediates == NULL
-    ) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    if (!schedulerSetRule(atch->impl->scheduler, prefix, priority)) {
+        err = AT_ERROR_GENERIC;
     }
+    pthread_mutex_unlock(&atch->impl->commandmutex);
 
     return err;
 }
 
-ATReturn at_send_command_numeric(ATChannel* atch, const char *command,
-                                ATResponse **pp_outResponse)
+/**
+ * Copies the queueing counters of the AT_PRIORITY_COUNT classes into
+ * "p_stats", indexed by ATPriority; at_reset_stats() resets them
+ */
+ATReturn at_get_priority_stats(ATChannel* atch, ATPriorityStats *p_stats)
 {
-    return at_send_command_numeric_timeout(atch, command, 0, pp_outResponse);
+    if (!atch || !p_stats) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    schedulerGetStats(atch->impl->scheduler, p_stats);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    return AT_SUCCESS;
 }
 
-ATReturn at_send_command_numeric_timeout(ATChannel* atch, const char *command,
-                                long long timeoutMsec, ATResponse **pp_outResponse)
+/**
+ * Copies the counters of at_send_command_sms_batch() into "p_stats";
+ * at_reset_stats() resets them
+ */
+ATReturn at_get_sms_stats(ATChannel* atch, ATSmsStats *p_stats)
 {
-    if (!atch || !command || !pp_outResponse) {
+    if (!atch || !p_stats) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
 
-    ATReturn err;
-
-    err = at_send_command_full(atch, command, NUMERIC, NULL,
-                                    NULL, timeoutMsec, pp_outResponse);
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    *p_stats = atch->impl->smsStats;
+    pthread_mutex_unlock(&atch->impl->commandmutex);
 
-    if (err == AT_SUCCESS && pp_outResponse != NULL
-        && (*pp_outResponse)->success
-        && (*pp_outResponse)->p_intermediates == NULL
-    ) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
+    if (p_stats->busyNsec > 0) {
+        p_stats->sentPerSec = (uint64_t) ((double) p_stats->sent * 1e9
+                                          / (double) p_stats->busyNsec);
     }
 
-    return err;
+    return AT_SUCCESS;
 }
 
-ATReturn at_send_command_sms(ATChannel* atch, const char *command,
-                                const char *pdu,
-                                const char *responsePrefix,
-                                ATResponse **pp_outResponse)
+/**
+ * Drops the cached response to "command", or all of them if it is NULL,
+ * eg after the SIM has changed
+ */
+ATReturn at_cache_invalidate(ATChannel* atch, const char *command)
 {
-    return at_send_command_sms_timeout(atch, command, pdu, responsePrefix, 0, pp_outResponse);
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    if (atch->impl->cache != NULL) {
+        cacheInvalidate(atch->impl->cache, command);
+    }
+    pthread_mutex_unlock(&atch->impl->commandmutex);
+
+    return AT_SUCCESS;
 }
 
-ATReturn at_send_command_sms_timeout(ATChannel* atch, const char *command,
-                                const char *pdu,
-                                const char *responsePrefix,
-                                long long timeoutMsec,
-                                ATResponse **pp_outResponse)
+/**
+ * Copies the latency statistics of up to "maxCount" command verbs into
+ * "p_stats", "*p_count" is set to the number of verbs, which may be more
+ */
+ATReturn at_get_stats(ATChannel* atch, ATCommandStats *p_stats, size_t maxCount, size_t *p_count)
 {
-    if (!atch || !command || !pdu || !responsePrefix || !pp_outResponse) {
+    size_t count;
+
+    if (!atch || (!p_stats && maxCount > 0)) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
 
-    ATReturn err;
-
-    err = at_send_command_full(atch, command, SINGLELINE, responsePrefix,
-                                    pdu, timeoutMsec, pp_outResponse);
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    count = statsGet(atch->impl->stats, p_stats, maxCount);
+    pthread_mutex_unlock(&atch->impl->commandmutex);
 
-    if (err == AT_SUCCESS && pp_outResponse != NULL
-        && (*pp_outResponse)->success
-        && (*pp_outResponse)->p_intermediates == NULL
-    ) {
-        /* successful command must have an intermediate response */
-        at_response_free(*pp_outResponse);
-        *pp_outResponse = NULL;
-        return AT_ERROR_INVALID_RESPONSE;
+    if (p_count != NULL) {
+        *p_count = count;
     }
 
-    return err;
-}
-
-ATReturn at_send_command_multiline(ATChannel* atch, const char *command,
-                                const char *responsePrefix,
-                                ATResponse **pp_outResponse)
-{
-    return at_send_command_multiline_timeout(atch, command, responsePrefix, 0, pp_outResponse);
+    return AT_SUCCESS;
 }
 
-ATReturn at_send_command_multiline_timeout(ATChannel* atch, const char *command,
-                                const char *responsePrefix,
-                                long long timeoutMsec,
-                                ATResponse **pp_outResponse)
+ATReturn at_reset_stats(ATChannel* atch)
 {
-    if (!atch || !command || !responsePrefix || !pp_outResponse) {
+    if (!atch) {
         return AT_ERROR_INVALID_ARGUMENT;
     }
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
 
-    ATReturn err;
-
-    err = at_send_command_full(atch, command, MULTILINE, responsePrefix,
-                                    NULL, timeoutMsec, pp_outResponse);
+    pthread_mutex_lock(&atch->impl->commandmutex);
+    statsReset(atch->impl->stats);
+    schedulerResetStats(atch->impl->scheduler);
+    memset(&atch->impl->smsStats, 0, sizeof(atch->impl->smsStats));
+    pthread_mutex_unlock(&atch->impl->commandmutex);
 
-    return err;
+    return AT_SUCCESS;
 }
 
 /**
- * Periodically issue an AT command and wait for a response.
- * Used to ensure channel has start up and is active
+ * Records the lines read and written in a ring of at least "capacity"
+ * bytes instead of logging them as they go, 0 means 64 KiB.
+ * If "callback" is non-NULL, a thread of the channel hands it the records
+ * every 100 ms or so, otherwise call at_trace_drain() for them.
+ * Lines arriving while the ring is full are dropped and counted.
+ * The ring is reused if it is large enough, along with its records.
  */
-ATReturn at_handshake(ATChannel* atch, const char* command, int retryCount, long long timeoutMsec)
+ATReturn at_trace_enable(ATChannel* atch, size_t capacity, ATTraceCallback callback, void *ctx)
 {
-    const char* HANDSHAKE_DEFAULT_COMMAND = "ATE0Q0V1";
-    const int HANDSHAKE_DEFAULT_RETRY_COUNT = 8;
-    const int HANDSHAKE_DEFAULT_TIMEOUT_MSEC = 250;
+    ATChannelImpl *impl;
+    ATTrace *trace;
+    int ret;
 
     if (!atch) {
         return AT_ERROR_INVALID_ARGUMENT;
@@ -1076,53 +4233,129 @@ ATReturn at_handshake(ATChannel* atch, const char* command, int retryCount, long
     if (!atch->impl) {
         return AT_ERROR_INVALID_OPERATION;
     }
-    if (retryCount < 0) {
-        return AT_ERROR_INVALID_ARGUMENT;
+    if (s_tracingChannel != NULL) {
+        return AT_ERROR_INVALID_THREAD;
     }
-    if (timeoutMsec < 0) {
-        return AT_ERROR_INVALID_ARGUMENT;
+
+    impl = atch->impl;
+    if (capacity == 0) {
+        capacity = DEFAULT_TRACE_CAPACITY;
     }
 
-    int i;
-    ATReturn err = 0;
+    pthread_mutex_lock(&impl->tracemutex);
 
-    if (!command) {
-        command = HANDSHAKE_DEFAULT_COMMAND;
-    }
-    if (retryCount == 0) {
-        retryCount = HANDSHAKE_DEFAULT_RETRY_COUNT;
+    stopTraceThread(impl);
+
+    trace = impl->traceRings;
+    if (trace == NULL || traceCapacity(trace) < capacity) {
+        /* the old rings may still be appended to, they go with the channel */
+        trace = traceNew(capacity, impl->traceRings);
+        if (trace == NULL) {
+            pthread_mutex_unlock(&impl->tracemutex);
+            return AT_ERROR_GENERIC;
+        }
+        impl->traceRings = trace;
     }
-    if (timeoutMsec == 0) {
-        timeoutMsec = HANDSHAKE_DEFAULT_TIMEOUT_MSEC;
+
+    impl->traceChannel = atch;
+    impl->traceCallback = callback;
+    impl->traceCtx = ctx;
+    atomic_store_explicit(&impl->trace, trace, memory_order_release);
+
+    if (callback != NULL) {
+        ret = pthread_create(&impl->traceThread, NULL, traceLoop, impl);
+        if (ret != 0) {
+            RLOGE(atch, "ERROR: Unable to create trace thread: %s", strerror(ret));
+            atomic_store_explicit(&impl->trace, NULL, memory_order_release);
+            pthread_mutex_unlock(&impl->tracemutex);
+            return AT_ERROR_GENERIC;
+        }
+        impl->traceThreadRunning = true;
     }
 
-    if (0 != pthread_equal(atch->impl->tid_reader, pthread_self())) {
-        /* cannot be called from reader thread */
+    pthread_mutex_unlock(&impl->tracemutex);
+
+    return AT_SUCCESS;
+}
+
+/**
+ * Logs the lines read and written as they go again, the trace callback
+ * gets the records left in the ring first, if there is one
+ */
+ATReturn at_trace_disable(ATChannel* atch)
+{
+    if (!atch) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (s_tracingChannel != NULL) {
         return AT_ERROR_INVALID_THREAD;
     }
 
-    pthread_mutex_lock(&atch->impl->commandmutex);
+    shutdownTrace(atch->impl);
 
-    for (i = 0 ; i < retryCount; i++) {
-        /* some stacks start with verbose off */
-        err = at_send_command_full_nolock(atch, command, NO_RESULT,
-                    NULL, NULL, timeoutMsec, NULL);
+    return AT_SUCCESS;
+}
 
-        if (err == 0) {
-            break;
-        }
+/**
+ * Hands the records in the trace ring to "callback" from this thread,
+ * including those left after at_trace_disable()
+ */
+ATReturn at_trace_drain(ATChannel* atch, ATTraceCallback callback, void *ctx)
+{
+    ATChannelImpl *impl;
+
+    if (!atch || !callback) {
+        return AT_ERROR_INVALID_ARGUMENT;
+    }
+    if (!atch->impl) {
+        return AT_ERROR_INVALID_OPERATION;
+    }
+    if (s_tracingChannel != NULL) {
+        return AT_ERROR_INVALID_THREAD;
     }
 
-    if (err == 0) {
-        /* pause for a bit to let the input buffer drain any unmatched OK's
-           (they will appear as extraneous unsolicited responses) */
+    impl = atch->impl;
 
-        sleepMsec(timeoutMsec);
+    pthread_mutex_lock(&impl->tracemutex);
+    if (impl->traceRings != NULL) {
+        s_tracingChannel = atch;
+        traceDrain(impl->traceRings, atch, callback, ctx);
+        s_tracingChannel = NULL;
     }
+    pthread_mutex_unlock(&impl->tracemutex);
 
-    pthread_mutex_unlock(&atch->impl->commandmutex);
+    return AT_SUCCESS;
+}
 
-    return err;
+/** an ATTraceCallback formatting the records into the channel log */
+void at_trace_log(ATChannel* atch, const ATTraceRecord *record, void *ctx)
+{
+    unsigned long long usec = record->timeNsec / 1000;
+    unsigned long long sec = usec / 1000000;
+    int len = record->len > INT_MAX ? INT_MAX : (int) record->len;
+
+    (void) ctx;
+    usec %= 1000000;
+
+    switch (record->direction) {
+        case AT_TRACE_IN:
+            RLOGD(atch, "%llu.%06llu AT< %.*s", sec, usec, len, record->data);
+            break;
+        case AT_TRACE_OUT:
+            RLOGD(atch, "%llu.%06llu AT> %.*s", sec, usec, len, record->data);
+            break;
+        case AT_TRACE_OUT_SMS:
+            RLOGD(atch, "%llu.%06llu AT> %.*s^Z", sec, usec, len, record->data);
+            break;
+        case AT_TRACE_DROPPED:
+            RLOGD(atch, "%llu.%06llu atchannel: %zu trace records dropped", sec, usec, record->len);
+            break;
+        default:
+            break;
+    }
 }
 
 /**
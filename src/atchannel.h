@@ -23,6 +23,7 @@ extern "C" {
 #endif
 
 #include <termios.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <syslog.h>
@@ -57,17 +58,83 @@ typedef enum {
 typedef struct ATLine  {
     struct ATLine *p_next;
     char *line;
+    size_t len;                 /* of line, which may hold NULs */
 } ATLine;
 
+/** CLOCK_MONOTONIC times of a command in nanoseconds, 0 if not reached */
+typedef struct {
+    uint64_t writeStart;
+    uint64_t writeEnd;
+    uint64_t firstLine;         /* the first intermediate response */
+    uint64_t finalLine;
+} ATTiming;
+
 /** Free this with at_response_free() */
 typedef struct {
     bool success;               /* true if final response indicates success (eg "OK") */
     char *finalResponse;        /* eg OK, ERROR */
     ATLine *p_intermediates;    /* any intermediate responses */
+    ATTiming timing;
 } ATResponse;
 
+/**
+ * the latencies, from writing to the final response, of the commands
+ * of one verb, eg "+CSQ" or "D" for ATD, see at_get_stats()
+ * the percentiles are accurate to about 3 %
+ */
+typedef struct {
+    char verb[16];              /* "*" for verbs beyond the first 64 */
+    uint64_t count;             /* final responses received */
+    uint64_t errors;            /* of these, the ones not indicating success */
+    uint64_t timeouts;
+    uint64_t minNsec;
+    uint64_t maxNsec;
+    uint64_t meanNsec;
+    uint64_t p50Nsec;
+    uint64_t p90Nsec;
+    uint64_t p99Nsec;
+    uint64_t p999Nsec;
+} ATCommandStats;
+
+/**
+ * the scheduling classes of commands, see at_set_command_priority()
+ * a queued command is written before those of lower classes, unless they
+ * have waited for a second already
+ */
+typedef enum {
+    AT_PRIORITY_BULK =   0,     /* eg sending a batch of SMS */
+    AT_PRIORITY_NORMAL = 1,     /* the default */
+    AT_PRIORITY_HIGH =   2,
+    AT_PRIORITY_URGENT = 3,     /* eg ATH, AT+CHUP */
+} ATPriority;
+
+#define AT_PRIORITY_COUNT 4
+
+/** the queueing of the commands of a class, see at_get_priority_stats() */
+typedef struct {
+    uint64_t submitted;         /* commands queued, not counting coalesced ones */
+    uint64_t dequeued;          /* of these, the ones written or failed */
+    size_t depth;               /* queued and not written yet */
+    size_t maxDepth;
+    uint64_t meanWaitNsec;      /* from queueing to writing */
+    uint64_t maxWaitNsec;
+} ATPriorityStats;
+
 typedef struct ATChannel ATChannel;
 
+/**
+ * what a line is taken for, by the longest of the default or
+ * at_add_line_prefix() prefixes it starts with
+ */
+typedef enum {
+    AT_LINE_OTHER =           0, /* intermediate or unsolicited, depending
+                                    on the command in flight */
+    AT_LINE_FINAL_SUCCESS =   1, /* eg OK */
+    AT_LINE_FINAL_ERROR =     2, /* eg ERROR */
+    AT_LINE_SMS_UNSOLICITED = 3, /* first of two lines, eg +CMT: */
+    AT_LINE_UNSOLICITED =     4, /* never an intermediate response */
+} ATLineClass;
+
 /**
  * a user-provided unsolicited response handler function
  * this will be called from the reader thread, so do not block
@@ -77,6 +144,18 @@ typedef struct ATChannel ATChannel;
 typedef void (*ATUnsolHandler)(ATChannel* atch, const char *s);
 typedef void (*ATUnsolSmsHandler)(ATChannel* atch, const char *s, const char *sms_pdu);
 
+/**
+ * like ATUnsolHandler, with the length of the line, which may hold NULs
+ * called instead of unsolHandler when set
+ */
+typedef void (*ATUnsolHandlerN)(ATChannel* atch, const char *s, size_t len);
+
+/**
+ * a handler for the unsolicited responses starting with a registered
+ * prefix, see at_register_unsol_handler(), called like ATUnsolHandler
+ */
+typedef void (*ATUnsolCallback)(ATChannel* atch, const char *s, void *ctx);
+
 /* This callback is invoked on the command thread.
    You should reset or handshake here to avoid getting out of sync */
 typedef void (*ATOnTimeoutHandler)(ATChannel* atch);
@@ -91,8 +170,166 @@ typedef void (*ATOnCloseHandler)(ATChannel* atch);
 
 typedef void (*ATLog)(ATChannel* atch, int level, const char* message);
 
+typedef enum {
+    AT_TRACE_IN =      0,       /* a line read, without its line end */
+    AT_TRACE_OUT =     1,       /* a command written, without its \r */
+    AT_TRACE_OUT_SMS = 2,       /* an SMS PDU written, without its ^Z */
+    AT_TRACE_DROPPED = 3,       /* "len" records lost to a full ring */
+} ATTraceDirection;
+
+/** a line of traffic, "data" is not NUL-terminated and only valid during the callback */
+typedef struct {
+    uint64_t timeNsec;          /* CLOCK_MONOTONIC */
+    ATTraceDirection direction;
+    const char *data;           /* NULL for AT_TRACE_DROPPED */
+    size_t len;
+} ATTraceRecord;
+
+/**
+ * a user-provided consumer of trace records, see at_trace_enable()
+ * this must not call the at_trace_* functions
+ */
+typedef void (*ATTraceCallback)(ATChannel* atch, const ATTraceRecord *record, void *ctx);
+
+/**
+ * a user-provided completion callback for the asynchronous commands
+ * this will usually be called from the reader thread, so do not block
+ * "err" is AT_SUCCESS or AT_ERROR_*, "p_response" is NULL unless
+ * "err" is AT_SUCCESS and must be eventually freed with at_response_free
+ */
+typedef void (*ATCommandCallback)(ATChannel* atch, ATReturn err, ATResponse *p_response, void *ctx);
+
+/**
+ * a user-provided consumer of the intermediate responses of
+ * at_send_command_multiline_stream(), called on the reader thread as each
+ * one arrives, with the channel locked: it must not block nor call the
+ * at_* functions of the channel
+ * "len" is the length of the line, which may hold NULs
+ */
+typedef void (*ATLineCallback)(ATChannel* atch, const char *line, size_t len, void *ctx);
+
+/** the intermediate response an entry of at_send_command_batch() expects */
+typedef enum {
+    AT_BATCH_NO_RESULT =  0,
+    AT_BATCH_NUMERIC =    1,    /* a single line starting with 0-9 */
+    AT_BATCH_SINGLELINE = 2,    /* a single line starting with responsePrefix */
+    AT_BATCH_MULTILINE =  3,    /* lines starting with responsePrefix */
+} ATBatchType;
+
+/** an entry of at_send_command_batch(), "err" and "p_response" are filled in */
+typedef struct {
+    const char *command;        /* without \r */
+    ATBatchType type;
+    const char *responsePrefix; /* NULL unless SINGLELINE or MULTILINE */
+    long long timeoutMsec;      /* 0 for none */
+
+    ATReturn err;
+    ATResponse *p_response;     /* NULL unless "err" is AT_SUCCESS */
+} ATBatchEntry;
+
+/** an entry of at_send_command_sms_batch(), the fields after "timeoutMsec" are filled in */
+typedef struct {
+    const char *command;        /* eg AT+CMGS=23, without \r */
+    const char *pdu;            /* without ^Z */
+    long long timeoutMsec;      /* 0 for none */
+
+    ATReturn err;               /* of the last attempt */
+    bool success;               /* the final response indicates success */
+    int messageRef;             /* of +CMGS: <mr>, -1 if none */
+    int cmsError;               /* of +CMS ERROR: <err>, -1 if none */
+    unsigned int attempts;
+} ATSmsEntry;
+
+/** the bulk SMS submissions of a channel, see at_get_sms_stats() */
+typedef struct {
+    uint64_t messages;          /* entries given to at_send_command_sms_batch() */
+    uint64_t sent;              /* of these, the ones the modem accepted */
+    uint64_t failed;
+    uint64_t attempts;          /* commands written, retries included */
+    uint64_t retries;
+    uint64_t busyNsec;          /* spent in at_send_command_sms_batch() */
+    uint64_t sentPerSec;        /* sent over busyNsec */
+} ATSmsStats;
+
+/* 3GPP TS 23.040 limits, the text is UTF-8 of up to 160 GSM 7 bit characters */
+#define AT_SMS_MAX_PDU          176     /* octets, SMSC address included */
+#define AT_SMS_MAX_USER_DATA    160     /* septets or octets */
+#define AT_SMS_ADDRESS_SIZE     36
+#define AT_SMS_TEXT_SIZE        484
+
+typedef enum {
+    AT_SMS_DELIVER =        0,  /* received, eg of +CMT: */
+    AT_SMS_SUBMIT =         1,  /* sent, eg with AT+CMGS */
+    AT_SMS_STATUS_REPORT =  2,  /* decoded up to its service centre time stamp */
+} ATSmsType;
+
+typedef enum {
+    AT_SMS_GSM7 =   0,          /* the GSM 7 bit default alphabet */
+    AT_SMS_8BIT =   1,          /* binary, only in "userData" */
+    AT_SMS_UCS2 =   2,
+} ATSmsAlphabet;
+
+/** a service centre time stamp, as sent */
+typedef struct {
+    uint8_t year;               /* 0-99 */
+    uint8_t month;
+    uint8_t day;
+    uint8_t hour;
+    uint8_t minute;
+    uint8_t second;
+    int8_t tzQuarters;          /* the offset from GMT in quarters of an hour */
+} ATSmsTime;
+
+/** an SMS TPDU, see at_sms_decode() and at_sms_encode() */
+typedef struct {
+    ATSmsType type;
+    char smsc[AT_SMS_ADDRESS_SIZE];     /* "" for the default one */
+    char address[AT_SMS_ADDRESS_SIZE];  /* originator, destination or recipient */
+    uint8_t addressType;                /* type of address octet, eg 0x91 */
+    uint8_t messageRef;                 /* SMS-SUBMIT and SMS-STATUS-REPORT */
+    uint8_t pid;
+    uint8_t dcs;
+    ATSmsAlphabet alphabet;
+    ATSmsTime timestamp;                /* SMS-DELIVER and SMS-STATUS-REPORT */
+
+    /* of a concatenated message, concatTotal is 0 otherwise */
+    uint16_t concatRef;
+    uint8_t concatTotal;
+    uint8_t concatSeq;
+
+    uint8_t udh[AT_SMS_MAX_USER_DATA];  /* the user data header, without its length */
+    size_t udhLen;
+    uint8_t userData[AT_SMS_MAX_USER_DATA]; /* after the header, septets for GSM 7 bit */
+    size_t userDataLen;
+    char text[AT_SMS_TEXT_SIZE];        /* UTF-8, "" for 8 bit data */
+    size_t textLen;
+} ATSmsPdu;
+
+/*
+ * flags of at_send_command_batch(): puts runs of extended commands that
+ * expect no intermediate response on one line, eg AT+CMEE=1;+CREG=2
+ */
+#define AT_BATCH_CONCATENATE 0x1u
+
+/** a one-shot completion handle, pass at_future_complete and the future */
+typedef struct ATFuture ATFuture;
+
 typedef struct ATChannelImpl ATChannelImpl;
 
+/**
+ * a pool of reader threads shared by many channels
+ * the handlers of channels attached to an engine are called from the
+ * engine threads, which must never block
+ */
+typedef struct ATEngine ATEngine;
+
+/**
+ * a 3GPP TS 27.010 multiplexer: one port whose DLCs each carry an
+ * ATChannel of their own, with framing and flow control done by a
+ * thread of the mux
+ */
+typedef struct ATMux ATMux;
+
 struct ATChannel {
     const char* path;
     int bitrate;
@@ -106,6 +343,7 @@ struct ATChannel {
     int logLevel;
     uintptr_t param;
     ATChannelImpl* impl;
+    ATUnsolHandlerN unsolHandlerN;
 };
 
 ATReturn at_open(ATChannel* atch);
@@ -113,11 +351,30 @@ ATReturn at_attach(ATChannel* atch);
 ATReturn at_detach(ATChannel* atch);
 ATReturn at_close(ATChannel* atch);
 
+ATReturn at_set_max_line_length(ATChannel* atch, size_t maxLength);
+ATReturn at_add_line_prefix(ATChannel* atch, const char *prefix, ATLineClass lineClass);
+ATReturn at_register_unsol_handler(ATChannel* atch, const char *prefix,
+                                   ATUnsolCallback callback, void *ctx);
+ATReturn at_set_unsol_dispatch(ATChannel* atch, int threadCount, size_t queueLength);
+
+ATEngine* at_engine_create(int threadCount);
+ATReturn at_engine_destroy(ATEngine* engine);
+ATReturn at_open_on_engine(ATChannel* atch, ATEngine* engine);
+ATReturn at_attach_to_engine(ATChannel* atch, ATEngine* engine);
+
+ATMux* at_mux_create(int fd, size_t frameSize);
+ATReturn at_mux_open_channel(ATMux* mux, int dlci, ATChannel* atch);
+ATReturn at_mux_destroy(ATMux* mux);
+
 ATReturn at_handshake(ATChannel* atch, const char* command, int retryCount, long long timeoutMsec);
 
 ATReturn at_send_command(ATChannel* atch, const char *command, ATResponse **pp_outResponse);
 ATReturn at_send_command_timeout(ATChannel* atch, const char *command, long long timeoutMsec,
                             ATResponse **pp_outResponse);
+ATReturn at_send_command_n(ATChannel* atch, const char *command, size_t len,
+                            ATResponse **pp_outResponse);
+ATReturn at_send_command_timeout_n(ATChannel* atch, const char *command, size_t len,
+                            long long timeoutMsec, ATResponse **pp_outResponse);
 
 ATReturn at_send_command_singleline(ATChannel* atch,
                                 const char *command,
@@ -139,6 +396,22 @@ ATReturn at_send_command_multiline_timeout(ATChannel* atch,
                                 long long timeoutMsec,
                                 ATResponse **pp_outResponse);
 
+ATReturn at_send_command_multiline_stream(ATChannel* atch,
+                                const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATLineCallback callback, void *ctx,
+                                size_t maxBufferedLines,
+                                ATResponse **pp_outResponse);
+
+ATReturn at_send_command_payload(ATChannel* atch,
+                                const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                void *payload, size_t payloadSize,
+                                size_t *p_payloadLen,
+                                ATResponse **pp_outResponse);
+
 ATReturn at_send_command_numeric(ATChannel* atch,
                                 const char *command,
                                 ATResponse **pp_outResponse);
@@ -155,8 +428,60 @@ ATReturn at_send_command_sms_timeout(ATChannel* atch, const char *command, const
                             long long timeoutMsec,
                             ATResponse **pp_outResponse);
 
+ATReturn at_send_command_async(ATChannel* atch, const char *command, long long timeoutMsec,
+                            ATCommandCallback callback, void *ctx);
+ATReturn at_send_command_singleline_async(ATChannel* atch,
+                                const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx);
+ATReturn at_send_command_multiline_async(ATChannel* atch,
+                                const char *command,
+                                const char *responsePrefix,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx);
+ATReturn at_send_command_numeric_async(ATChannel* atch,
+                                const char *command,
+                                long long timeoutMsec,
+                                ATCommandCallback callback, void *ctx);
+ATReturn at_send_command_sms_async(ATChannel* atch, const char *command, const char *pdu,
+                            const char *responsePrefix,
+                            long long timeoutMsec,
+                            ATCommandCallback callback, void *ctx);
+
+ATReturn at_send_command_batch(ATChannel* atch, ATBatchEntry *entries, size_t count,
+                            unsigned int flags);
+ATReturn at_send_command_sms_batch(ATChannel* atch, ATSmsEntry *entries, size_t count,
+                            unsigned int maxRetries);
+ATReturn at_get_sms_stats(ATChannel* atch, ATSmsStats *p_stats);
+
+ATReturn at_sms_decode(const char *pdu, size_t len, ATSmsPdu *p_sms);
+ATReturn at_sms_encode(const ATSmsPdu *p_sms, char *pdu, size_t size, size_t *p_tpduLen);
+
+ATFuture* at_future_new(void);
+void at_future_complete(ATChannel* atch, ATReturn err, ATResponse *p_response, void *ctx);
+ATReturn at_future_wait(ATFuture* future, ATResponse **pp_outResponse);
+bool at_future_is_done(ATFuture* future);
+void at_future_free(ATFuture* future);
+
 ATReturn at_response_free(ATResponse *p_response);
 
+ATReturn at_get_stats(ATChannel* atch, ATCommandStats *p_stats, size_t maxCount, size_t *p_count);
+ATReturn at_reset_stats(ATChannel* atch);
+
+ATReturn at_cache_command(ATChannel* atch, const char *command, long long ttlMsec,
+                          const char *invalidatingPrefix);
+ATReturn at_cache_invalidate(ATChannel* atch, const char *command);
+ATReturn at_set_coalescing(ATChannel* atch, bool enabled);
+
+ATReturn at_set_command_priority(ATChannel* atch, const char *prefix, ATPriority priority);
+ATReturn at_get_priority_stats(ATChannel* atch, ATPriorityStats *p_stats);
+
+ATReturn at_trace_enable(ATChannel* atch, size_t capacity, ATTraceCallback callback, void *ctx);
+ATReturn at_trace_disable(ATChannel* atch);
+ATReturn at_trace_drain(ATChannel* atch, ATTraceCallback callback, void *ctx);
+void at_trace_log(ATChannel* atch, const ATTraceRecord *record, void *ctx);
+
 typedef enum {
     CME_ERROR_NON_CME = -1,
     CME_SUCCESS = 0,
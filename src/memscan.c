@@ -0,0 +1,114 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "memscan.h"
+
+/* the bytes that are left after the vector loop, or everything without one */
+static const char *memchr2Scalar(const char *s, char c1, char c2, size_t n)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    const uint64_t m1 = ones * (unsigned char) c1;
+    const uint64_t m2 = ones * (unsigned char) c2;
+
+    /* eight bytes at a time, a zero byte in x ^ m marks a match */
+    while (n >= sizeof(uint64_t)) {
+        uint64_t x;
+        uint64_t x1;
+        uint64_t x2;
+
+        memcpy(&x, s, sizeof(x));
+        x1 = x ^ m1;
+        x2 = x ^ m2;
+        if ((((x1 - ones) & ~x1) | ((x2 - ones) & ~x2)) & highs) {
+            break;
+        }
+        s += sizeof(uint64_t);
+        n -= sizeof(uint64_t);
+    }
+
+    for (; n > 0; s++, n--) {
+        if (*s == c1 || *s == c2) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+const char *memchr2(const char *s, char c1, char c2, size_t n)
+{
+#if defined(__AVX2__)
+    const __m256i v1 = _mm256_set1_epi8(c1);
+    const __m256i v2 = _mm256_set1_epi8(c2);
+
+    while (n >= sizeof(__m256i)) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) (const void *) s);
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+                _mm256_or_si256(_mm256_cmpeq_epi8(x, v1), _mm256_cmpeq_epi8(x, v2)));
+
+        if (mask != 0) {
+            return s + __builtin_ctz(mask);
+        }
+        s += sizeof(__m256i);
+        n -= sizeof(__m256i);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i w1 = _mm_set1_epi8(c1);
+    const __m128i w2 = _mm_set1_epi8(c2);
+
+    while (n >= sizeof(__m128i)) {
+        __m128i x = _mm_loadu_si128((const __m128i *) (const void *) s);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+                _mm_or_si128(_mm_cmpeq_epi8(x, w1), _mm_cmpeq_epi8(x, w2)));
+
+        if (mask != 0) {
+            return s + __builtin_ctz(mask);
+        }
+        s += sizeof(__m128i);
+        n -= sizeof(__m128i);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t w1 = vdupq_n_u8((uint8_t) c1);
+    const uint8x16_t w2 = vdupq_n_u8((uint8_t) c2);
+
+    while (n >= sizeof(uint8x16_t)) {
+        uint8x16_t x = vld1q_u8((const uint8_t *) (const void *) s);
+        uint8x16_t eq = vorrq_u8(vceqq_u8(x, w1), vceqq_u8(x, w2));
+
+        if (vmaxvq_u8(eq) != 0) {
+            /* narrow to four bits per byte to locate the first match */
+            uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(
+                    vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+            return s + (__builtin_ctzll(mask) >> 2);
+        }
+        s += sizeof(uint8x16_t);
+        n -= sizeof(uint8x16_t);
+    }
+#endif
+
+    return memchr2Scalar(s, c1, c2, n);
+}
@@ -0,0 +1,37 @@
+/*
+** Copyright 2020, The libatch Project
+**
+** Licensed under the Apache License, Version 2.0 (the "License");
+** you may not use this file except in compliance with the License.
+** You may obtain a copy of the License at
+**
+**     http://www.apache.org/licenses/LICENSE-2.0
+**
+** Unless required by applicable law or agreed to in writing, software
+** distributed under the License is distributed on an "AS IS" BASIS,
+** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+** See the License for the specific language governing permissions and
+** limitations under the License.
+*/
+
+#ifndef MEMSCAN_H
+#define MEMSCAN_H 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+/**
+ * returns a pointer to the first of the "n" bytes at "s" that equals
+ * "c1" or "c2", NULL if there is none
+ * uses AVX2, SSE2 or NEON when the compiler targets them
+ */
+const char *memchr2(const char *s, char c1, char c2, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MEMSCAN_H */
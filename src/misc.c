@@ -15,6 +15,10 @@
 ** limitations under the License.
 */
 
+#define _POSIX_C_SOURCE (200809L)
+
+#include <time.h>
+
 #include "misc.h"
 
 /** returns true if line starts with prefix, false if it does not */
@@ -28,3 +32,29 @@ bool strStartsWith(const char *line, const char *prefix)
 
     return *prefix == '\0';
 }
+
+/** returns the CLOCK_MONOTONIC time in nanoseconds */
+uint64_t monotonicNsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/** for pthread_cond_timedwait() on conditions of CLOCK_MONOTONIC */
+void setTimespecRelative(struct timespec *p_ts, long long msec)
+{
+    const int NS_PER_S = 1000 * 1000 * 1000;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    p_ts->tv_sec = now.tv_sec + (msec / 1000);
+    p_ts->tv_nsec = now.tv_nsec + (msec % 1000) * 1000L * 1000L;
+    if (p_ts->tv_nsec >= NS_PER_S) {
+        p_ts->tv_sec++;
+        p_ts->tv_nsec -= NS_PER_S;
+    }
+}
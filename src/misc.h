@@ -23,10 +23,18 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 
 /** returns true if line starts with prefix, false if it does not */
 bool strStartsWith(const char *line, const char *prefix);
 
+/** returns the CLOCK_MONOTONIC time in nanoseconds */
+uint64_t monotonicNsec(void);
+
+/** sets *p_ts to "msec" from now on CLOCK_MONOTONIC */
+void setTimespecRelative(struct timespec *p_ts, long long msec);
+
 #ifdef __cplusplus
 }
 #endif